@@ -21,6 +21,7 @@
 
 #include <nori/color.h>
 #include <nori/vector.h>
+#include <map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -48,8 +49,18 @@ public:
     /// Save the bitmap as an EXR file with the specified filename
     void save(const std::string &filename);
 
+    /// Set an integer attribute that \ref save() stores in the EXR header
+    void setAttribute(const std::string &name, int value) { m_intAttributes[name] = value; }
+
+    /// Set a floating point attribute that \ref save() stores in the EXR header
+    void setAttribute(const std::string &name, float value) { m_floatAttributes[name] = value; }
+
     /// Save the bitmap as a PNG file with the specified filename
     void saveToLDR(const std::string &filename);
+
+protected:
+    std::map<std::string, int> m_intAttributes;
+    std::map<std::string, float> m_floatAttributes;
 };
 
 NORI_NAMESPACE_END
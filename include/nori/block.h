@@ -88,6 +88,17 @@ public:
      */
     Bitmap *toBitmap() const;
 
+    /**
+     * \brief Turn the block into a bitmap and convolve it with
+     * the given reconstruction filter
+     *
+     * This is used when the samples were accumulated using a box filter
+     * (e.g. by adaptive sampling, see \ref PixelStatistics). The filter
+     * is evaluated at the pixel centers and renormalized near the
+     * boundary of the image.
+     */
+    Bitmap *toBitmap(const ReconstructionFilter *filter) const;
+
     /// Convert a bitmap into an image block
     void fromBitmap(const Bitmap &bitmap);
 
@@ -100,13 +111,58 @@ public:
     /**
      * \brief Merge another image block into this one
      *
-     * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * This function does not lock the destination block. Several threads
+     * may merge blocks concurrently as long as they cover different
+     * rectangles (e.g. blocks of one pass of a \ref BlockGenerator): the
+     * pixels near the edges of \c b, which the filter footprints of the
+     * neighboring blocks reach as well, are accumulated using atomic
+     * operations, while the interior belongs to \c b alone.
      */
     void put(ImageBlock &b);
 
+    /// Write the raw (unnormalized) pixels including the border to a binary stream
+    void saveState(std::ostream &os) const;
+
+    /// Restore pixels written by \ref saveState() into a block of the same size
+    void loadState(std::istream &is);
+
+    /**
+     * \brief Save the raw (unnormalized) pixels as an OpenEXR file
+     *
+     * The weighted radiance sums are stored in the RGB channels and the
+     * accumulated filter weights in the alpha channel, which is just the
+     * premultiplied alpha convention of OpenEXR. Unlike \ref toBitmap(),
+     * this keeps everything that is needed to merge several renderings of
+     * the same image without loss (see \ref loadEXR()). The border region
+     * is discarded.
+     *
+     * \param seeds
+     *     Sampler seeds of the renderings that the image contains. Renderings
+     *     with the same seed have identical samples, so merging them would
+     *     add no information.
+     */
+    void saveEXR(const std::string &filename, uint32_t sampleCount,
+                 const std::vector<uint32_t> &seeds) const;
+
+    /**
+     * \brief Load a file written by \ref saveEXR()
+     *
+     * The block is reinitialized to the size of the image (without
+     * a reconstruction filter or border region).
+     *
+     * \param seeds
+     *     If given, receives the seeds recorded in the file (none for
+     *     files that were written without them)
+     *
+     * \return The number of samples per pixel of the file
+     */
+    uint32_t loadEXR(const std::string &filename, std::vector<uint32_t> *seeds = nullptr);
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
+
+    /// Try to lock the image block without waiting
+    inline bool tryLock() const { return m_mutex.try_lock(); }
     
     /// Unlock the image block
     inline void unlock() const { m_mutex.unlock(); }
@@ -126,6 +182,87 @@ protected:
     mutable tbb::mutex m_mutex;
 };
 
+/**
+ * \brief Per-pixel sample statistics for adaptive sampling
+ *
+ * Keeps the number of samples, the running mean and the running variance
+ * (using Welford's algorithm) of the radiance values sampled in each pixel.
+ * A pixel is considered converged once the standard error of its mean drops
+ * below a fraction of its value. As isolated pixels can receive identical
+ * samples by chance (e.g. near an edge), a pixel stays active until all of
+ * its eight neighbors have converged as well.
+ *
+ * Stopping individual pixels leads to varying sample densities within the
+ * footprint of the reconstruction filter, which biases images whose samples
+ * are splatted over several pixels. Adaptive rendering therefore accumulates
+ * samples with a box filter and applies the actual reconstruction filter
+ * once the pixel values are known (see \ref ImageBlock::toBitmap()).
+ *
+ * Samples are attributed to the pixel that contains them, so blocks rendered
+ * in parallel never touch the same statistics.
+ */
+class PixelStatistics {
+public:
+    /**
+     * \brief Create statistics for an image of the given size
+     * \param threshold
+     *     Relative standard error at which a pixel is considered converged
+     * \param minSamples
+     *     Minimum number of samples before a pixel may converge
+     */
+    PixelStatistics(const Vector2i &size, float threshold, uint32_t minSamples);
+
+    /// Record a sample of the given pixel
+    void put(const Point2i &pixel, const Color3f &value) {
+        size_t index = (size_t) pixel.y() * m_size.x() + pixel.x();
+        float n = (float) ++m_counts[index];
+        Color3f delta = value - m_mean[index];
+        m_mean[index] += delta / n;
+        m_m2[index] += delta * (value - m_mean[index]);
+    }
+
+    /**
+     * \brief Recompute which pixels need further samples
+     *
+     * Must not be called while samples are being recorded.
+     */
+    void update();
+
+    /// Check whether the given pixel needs further samples
+    bool isActive(const Point2i &pixel) const {
+        return m_active[(size_t) pixel.y() * m_size.x() + pixel.x()] != 0;
+    }
+
+    /// Check whether any pixel covered by the block needs further samples
+    bool isActive(const ImageBlock &block) const;
+
+    /// Return the number of samples taken in the given pixel
+    uint32_t getSampleCount(const Point2i &pixel) const {
+        return m_counts[(size_t) pixel.y() * m_size.x() + pixel.x()];
+    }
+
+    /// Return the total number of samples taken in all pixels
+    uint64_t getTotalSampleCount() const;
+
+    /// Return the image size
+    const Vector2i &getSize() const { return m_size; }
+
+    /// Write the statistics to a binary stream
+    void saveState(std::ostream &os) const;
+
+    /// Restore statistics written by \ref saveState() for an image of the same size
+    void loadState(std::istream &is);
+
+protected:
+    Vector2i m_size;
+    float m_threshold;
+    uint32_t m_minSamples;
+    std::vector<uint32_t> m_counts;
+    std::vector<Color3f> m_mean;
+    std::vector<Color3f> m_m2;
+    std::vector<uint8_t> m_active;
+};
+
 /**
  * \brief Spiraling block generator
  *
@@ -161,11 +298,31 @@ public:
      */
     void reset();
 
-    /// Return the total number of blocks
+    /**
+     * \brief Exclude a block (e.g. one that has converged) from all
+     * following passes, starting with the next \ref reset()
+     *
+     * This function is thread-safe
+     */
+    void setFinished(uint32_t blockId);
+
+    /// Return the number of blocks of the current pass
     int getBlockCount() const { return m_blocksLeft; }
+
+    /// Return the number of blocks that the image was split into
+    int getTotalBlockCount() const { return m_numBlocks.x() * m_numBlocks.y(); }
+
+    /// Write the set of finished blocks to a binary stream
+    void saveState(std::ostream &os) const;
+
+    /// Restore the finished blocks written by \ref saveState() and \ref reset()
+    void loadState(std::istream &is);
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
+    /// Advance along the spiral to the next block within the image that is not finished
+    void advance();
+
     Point2i m_block;
     Vector2i m_numBlocks;
     Vector2i m_size;
@@ -174,6 +331,7 @@ protected:
     int m_blocksLeft;
     int m_stepsLeft;
     int m_direction;
+    std::vector<bool> m_finished;
     tbb::mutex m_mutex;
 };
 
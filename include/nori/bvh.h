@@ -20,6 +20,17 @@
 #define __NORI_BVH_H
 
 #include <nori/shape.h>
+#include <filesystem/path.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+
+/* Counting the traversal steps costs a thread-local lookup and a few memory
+   updates per ray, so the statistics are only compiled in on request */
+#if defined(NORI_BVH_STATS)
+#define NORI_BVH_STAT(expr) expr
+#else
+#define NORI_BVH_STAT(expr) do { } while (0)
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,13 +49,102 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * After construction, the binary tree can optionally be collapsed into a
+ * 4- or 8-wide BVH, whose nodes store the bounding boxes of all children
+ * in SoA form so that they can be tested against a ray using a single
+ * SSE/AVX instruction sequence. The layout is selected using the scene-level
+ * <tt>bvhLayout</tt> property (<tt>binary</tt>, <tt>bvh4</tt>, or <tt>bvh8</tt>).
+ * Setting <tt>bvhCompressNodes</tt> additionally quantizes the child bounding
+ * boxes of wide nodes to 8 bits, which halves their size and thereby the
+ * number of cache misses during traversal.
+ *
+ * For quick previews, the scene-level <tt>bvhQuality</tt> property
+ * (<tt>low</tt>, <tt>medium</tt>, or <tt>high</tt>, the default) selects
+ * a linear BVH builder instead (see \ref LBVHBuilder), which is much faster
+ * but produces a tree of lower quality.
+ *
+ * When the scene-level <tt>bvhSpatialSplits</tt> property is set, the tree
+ * is rebuilt using spatial splits (see \ref SBVHBuilder), which may
+ * reference a primitive from several leaves. The number of additional
+ * references is limited to <tt>bvhSplitBudget</tt> (default: 0.3) times
+ * the number of primitives.
+ *
+ * The scene-level <tt>bvhPrecomputeTriangles</tt> property trades memory
+ * for speed: it stores the vertex and edge vectors of all triangles
+ * in leaf order (~40 bytes per triangle), so that leaves are intersected
+ * four triangles at a time without indirect vertex fetches. Leaves that
+ * consist of several \ref Sphere shapes are always stored in a similar
+ * SIMD layout (~20 bytes per sphere).
+ *
+ * Animated or edited geometry is handled by \ref refit(), which is much
+ * cheaper than a full build.
+ *
+ * Consecutive shadow rays traced by a thread (e.g. the light samples of
+ * a pixel) are often blocked by the same primitive. When the scene-level
+ * <tt>bvhOccluderCache</tt> property is set, \ref rayOccluded() remembers
+ * the last occluder of each thread and tests it before traversing the tree.
+ *
+ * When the scene-level <tt>bvhCache</tt> property is set, the finished tree
+ * is written to a file next to the scene, whose name contains a hash of the
+ * geometry and build parameters. Later runs skip the build when the hash
+ * matches: they memory-map the file and copy the tree out of it (loading
+ * the meshes and hashing them still takes time on every run).
+ *
  * \author Wenzel Jakob
  */
 class BVH {
     friend class BVHBuildTask;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
 public:
-    /// Create a new and empty BVH
-    BVH() { m_shapeOffset.push_back(0u); }
+    /// Ray traversal statistics (only counted when compiled with \c NORI_BVH_STATS)
+    struct TraversalStatistics {
+        uint64_t rays = 0;       ///< Number of traced rays
+        uint64_t nodes = 0;      ///< Number of node bounding box tests (binary) or visited wide nodes
+        uint64_t primitives = 0; ///< Number of ray-primitive intersection tests
+        uint64_t occluderCacheQueries = 0; ///< Number of shadow rays tested against a cached occluder
+        uint64_t occluderCacheHits = 0;    ///< Number of shadow rays blocked by the cached occluder
+
+        /// Return a human-readable summary
+        std::string toString() const;
+    };
+
+    /// Binary tree and primitive references, as kept by the \ref GeometryCache
+    struct ResidentTree;
+
+    /// Number of rays that are traversed together by the batched queries
+    static const int PACKET_SIZE = 8;
+
+    /// Maximum depth of the binary tree, which bounds the size of the traversal stacks
+    static const uint32_t MAX_DEPTH = 64;
+
+    /// Memory layouts used for ray traversal
+    enum ELayout {
+        /// Traverse the binary SAH tree directly
+        EBinary = 0,
+        /// Traverse a 4-wide BVH obtained by collapsing the binary tree
+        EWide4,
+        /// Traverse an 8-wide BVH obtained by collapsing the binary tree
+        EWide8
+    };
+
+    /// Build quality, which trades build time for traversal performance
+    enum EBuildQuality {
+        /// Linear BVH over the Morton codes of the primitives (fastest build)
+        ELowQuality = 0,
+        /// Linear BVH that is improved using tree rotations
+        EMediumQuality,
+        /// Binned SAH build (best traversal performance)
+        EHighQuality
+    };
+
+    /**
+     * \brief Create a new and empty BVH
+     *
+     * The scene-level properties are used to configure the build
+     * (e.g. <tt>bvhLayout</tt>)
+     */
+    BVH(const PropertyList &propList = PropertyList());
 
     /// Release all resources
     virtual ~BVH() { clear(); };
@@ -59,9 +159,29 @@ public:
      */
     void addShape(Shape *shape);
 
-    /// Build the BVH
+    /**
+     * \brief Build the BVH
+     *
+     * Calling this function again rebuilds the tree from scratch, e.g.
+     * after the shapes have moved too far for \ref refit() to be effective
+     */
     void build();
 
+    /**
+     * \brief Update the BVH after the primitives of its shapes have moved
+     *
+     * The bounding boxes of all nodes are recomputed bottom-up (in parallel)
+     * while keeping the tree topology. Since the tree quality degrades as
+     * the geometry moves away from the configuration it was built for,
+     * subtrees whose SAH cost has grown by more than a factor of
+     * <tt>bvhRebuildThreshold</tt> (default: 1.5, 0 disables rebuilds)
+     * compared to their last build are then rebuilt from scratch.
+     *
+     * Shapes cannot be added or removed, and their primitive counts must
+     * not change.
+     */
+    void refit();
+
     /**
      * \brief Intersect a ray against all shapes registered
      * with the BVH
@@ -73,19 +193,84 @@ public:
      * information is really needed. When set to \c true, the 
      * function just checks whether or not there is occlusion, but without
      * providing any more detail (i.e. \c its will not be filled with
-     * contents). This is usually much faster.
+     * contents). This is usually much faster. Shadow rays are forwarded
+     * to \ref rayOccluded().
      *
      * \return \c true If an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Check whether a ray segment intersects any shape
+     *
+     * Uses a dedicated any-hit traversal: since the query ends with the
+     * first intersection found, the children of a node are visited in the
+     * order of decreasing surface area (the larger child is more likely
+     * to contain an occluder) instead of front to back, and leaves are
+     * tested using the \ref Shape::rayOccluded() fast paths.
+     */
+    bool rayOccluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a batch of rays against all shapes registered
+     * with the BVH
+     *
+     * The rays are grouped into packets of \ref PACKET_SIZE rays that share
+     * the same direction octant. All rays of a packet traverse the tree
+     * together: each node is fetched once and tested against the entire
+     * packet using SIMD instructions. This works best for coherent rays,
+     * e.g. camera rays through neighboring pixels, which should thus be
+     * passed in scanline or tile order.
+     *
+     * For rays that don't hit anything, <tt>its[i].mesh</tt> is set to
+     * \c nullptr and <tt>its[i].t</tt> to infinity.
+     */
+    void rayIntersect(const Ray3f *rays, Intersection *its, size_t count) const;
+
+    /**
+     * \brief Batched version of the shadow ray query
+     *
+     * Sets <tt>occluded[i]</tt> to \c true when the i-th ray segment
+     * intersects any shape.
+     */
+    void rayIntersect(const Ray3f *rays, bool *occluded, size_t count) const;
+
+    /**
+     * \brief Low-level intersection query that skips the computation of
+     * detailed intersection information
+     *
+     * This is used to traverse the nested BVH of a \ref ShapeGroup. Unlike
+     * \ref rayIntersect(), the ray epsilon is used as is. Upon success,
+     * <tt>ray.maxt</tt> is set to the distance of the intersection, and
+     * \c shape, \c prim, and \c uv identify the intersected primitive
+     * (\c shape and \c prim are not set for shadow rays).
+     */
+    bool rayIntersectPrimitive(Ray3f &ray, const Shape *&shape, uint32_t &prim,
+        Point2f &uv, bool shadowRay) const;
+
+    /// Low-level version of \ref rayOccluded() that uses the ray epsilon as is
+    bool rayOccludedPrimitive(const Ray3f &ray) const;
+
     /// Return the total number of shapes registered with the BVH
     uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
 
     /// Return the total number of internally represented primitives
     uint32_t getPrimitiveCount() const { return m_shapeOffset.back(); }
 
+    /// Return the index of the first primitive of the given shape
+    uint32_t getPrimitiveOffset(uint32_t shapeIdx) const { return m_shapeOffset[shapeIdx]; }
+
+    /**
+     * \brief Compute the shape and primitive indices corresponding to
+     * a primitive index used by the underlying generic BVH implementation. 
+     */
+    uint32_t findShape(uint32_t &idx) const {
+        auto it = std::lower_bound(m_shapeOffset.begin(), m_shapeOffset.end(), idx+1) - 1;
+        idx -= *it;
+        return (uint32_t) (it - m_shapeOffset.begin());
+    }
+
     /// Return one of the registered shapes
     Shape *getShape(uint32_t idx) { return m_shapes[idx]; }
     
@@ -97,32 +282,87 @@ public:
         return m_bbox;
     }
 
-protected:
+    /// Return the memory layout used for ray traversal
+    ELayout getLayout() const { return m_layout; }
+
     /**
-     * \brief Compute the shape and primitive indices corresponding to
-     * a primitive index used by the underlying generic BVH implementation. 
+     * \brief Return the ray traversal statistics accumulated over all threads
+     *
+     * Without \c NORI_BVH_STATS, all counters are zero.
      */
-    uint32_t findShape(uint32_t &idx) const {
-        auto it = std::lower_bound(m_shapeOffset.begin(), m_shapeOffset.end(), idx+1) - 1;
-        idx -= *it;
-        return (uint32_t) (it - m_shapeOffset.begin());
-    }
+    TraversalStatistics getTraversalStatistics() const;
 
-    //// Return an axis-aligned bounding box containing the given primitive
-    BoundingBox3f getBoundingBox(uint32_t index) const {
-        uint32_t shapeIdx = findShape(index);
-        return m_shapes[shapeIdx]->getBoundingBox(index);
+protected:
+    //// Return an axis-aligned bounding box containing the given primitive (only during the build)
+    const BoundingBox3f &getBoundingBox(uint32_t index) const {
+        return m_primBounds[index];
     }
     
-    //// Return the centroid of the given primitive
-    Point3f getCentroid(uint32_t index) const {
-        uint32_t shapeIdx = findShape(index);
-        return m_shapes[shapeIdx]->getCentroid(index);
+    //// Return the centroid of the given primitive (only during the build)
+    const Point3f &getCentroid(uint32_t index) const {
+        return m_centroids[index];
     }
 
+    /// Build the binary tree (object splits, followed by spatial splits if enabled)
+    void buildTree();
+
+    /**
+     * \brief Convert the primitive indices of \ref m_indices into shape and
+     * shape-local primitive indices, grouped into runs of the same shape
+     */
+    void buildReferences();
+
+    /// Derive the memory layout used for traversal from the binary tree
+    void buildLayout();
+
+    /// Build the precomputed triangle data of all leaves that only contain triangles
+    void buildTriangleBlocks();
+
+    /// Store the spheres of leaves that only contain spheres in blocks of four
+    void buildSphereBlocks();
+
+    /// Hash of the geometry and build parameters that identifies a cached tree
+    uint64_t getCacheHash() const;
+
+    /// Total number of mesh vertices, which is stored along with cached trees
+    uint64_t getVertexCount() const;
+
+    /// Return the filename of the on-disk cache for the given \ref getCacheHash()
+    filesystem::path getCachePath(uint64_t hash) const;
+
+    /// Try to load the binary tree with the given hash from the on-disk cache
+    bool loadCache(const filesystem::path &filename, uint64_t hash);
+
+    /// Write the binary tree to the on-disk cache
+    void saveCache(const filesystem::path &filename, uint64_t hash) const;
+
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /// Return the depth of the binary tree (the number of inner nodes above its deepest leaf)
+    uint32_t depth() const;
+
+    /**
+     * \brief Compute the SAH cost of every node of the subtree occupying
+     * the nodes <tt>[node_idx, end)</tt>, and optionally refit its bounding
+     * boxes first (recursive, in parallel for large subtrees)
+     *
+     * \return The SAH cost of \c node_idx
+     */
+    float refitSubtree(uint32_t node_idx, uint32_t end, std::vector<float> &costs, bool updateBounds);
+
+    /// Collect the topmost subtrees whose SAH cost exceeds the rebuild threshold
+    void findDegradedSubtrees(uint32_t node_idx, uint32_t end, const std::vector<float> &costs,
+        std::vector<std::pair<uint32_t, uint32_t>> &subtrees) const;
+
+    /**
+     * \brief Replace the subtree occupying the nodes <tt>[node_idx, end)</tt>
+     * with a newly built one, and update the costs accordingly
+     *
+     * \return The number of primitive references of the new subtree
+     */
+    uint32_t rebuildSubtree(uint32_t node_idx, uint32_t end, std::vector<float> &costs);
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -162,12 +402,235 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief Node of a collapsed N-wide BVH
+     *
+     * The bounding boxes of all children are stored in SoA form, i.e.
+     * <tt>bounds[2*axis + 0]</tt> and <tt>bounds[2*axis + 1]</tt> hold the
+     * minimum and maximum coordinates along \c axis for all \c N children.
+     * Unused child slots have an inverted (empty) bounding box.
+     */
+    template <int N> struct BVHWideNode {
+        float bounds[6][N];
+        /// Index of a child node, or start of the primitive range for leaves
+        uint32_t child[N];
+        /// Number of primitives for leaves, or zero for inner nodes
+        uint32_t size[N];
+
+        /// Load the bounds <tt>bounds[k]</tt> of all children into a SIMD register
+        template <typename SimdFloat> SimdFloat getBounds(int k) const {
+            return SimdFloat::load(bounds[k]);
+        }
+
+        /// Return a bit mask of the used child slots (unused ones have empty bounds)
+        int getChildMask() const { return (1 << N) - 1; }
+    };
+
+    /**
+     * \brief Precomputed data of four triangles in SoA form
+     *
+     * Stores the first vertex and the two edges adjacent to it. Unused slots
+     * have degenerate edges, which never produce an intersection.
+     */
+    struct TriangleBlock {
+        float p0[3][4];
+        float e1[3][4];
+        float e2[3][4];
+        /// Index into \ref m_refShapes and \ref m_refPrims
+        uint32_t ref[4];
+    };
+
+    typedef std::vector<TriangleBlock, tbb::cache_aligned_allocator<TriangleBlock>> TriangleBlockArray;
+
+    /// Four spheres in SoA layout (unused slots have a negative squared radius)
+    struct SphereBlock {
+        float center[3][4];
+        float radius2[4];
+        /// Index into \ref m_refShapes and \ref m_refPrims
+        uint32_t ref[4];
+    };
+
+    typedef std::vector<SphereBlock, tbb::cache_aligned_allocator<SphereBlock>> SphereBlockArray;
+
+    /// Marks entries of \ref m_leafBlocks that refer to sphere blocks
+    static const uint32_t SPHERE_BLOCK_FLAG = 0x80000000u;
+
+    /**
+     * \brief Compressed node of a collapsed N-wide BVH (64 or 128 bytes)
+     *
+     * The child bounding boxes are quantized to a grid that starts at
+     * \c origin and has a power-of-two spacing along each axis, whose
+     * exponent is stored in \c exponent. The quantized coordinates are
+     * rounded outwards, so the decoded boxes conservatively enclose the
+     * original ones.
+     */
+    template <int N> struct alignas(16 * N) BVHQuantizedNode {
+        float origin[3];
+        int8_t exponent[3];
+        /// Bit mask of the used child slots
+        uint8_t childMask;
+        /// Quantized child bounding boxes (same arrangement as in \ref BVHWideNode)
+        uint8_t bounds[6][N];
+        /// Number of primitives for leaves, or zero for inner nodes
+        uint16_t size[N];
+        /// Index of a child node, or start of the primitive range for leaves
+        uint32_t child[N];
+
+        /// Decode the bounds <tt>bounds[k]</tt> of all children into a SIMD register
+        template <typename SimdFloat> SimdFloat getBounds(int k) const {
+            int axis = k / 2;
+            return SimdFloat(origin[axis]) +
+                SimdFloat::loadBytes(bounds[k]) * SimdFloat(getSpacing(axis));
+        }
+
+        /// Return the grid spacing along the given axis
+        float getSpacing(int axis) const {
+            uint32_t bits = (uint32_t) (exponent[axis] + 127) << 23;
+            float result;
+            memcpy(&result, &bits, sizeof(float));
+            return result;
+        }
+
+        int getChildMask() const { return childMask; }
+    };
+
+    typedef std::vector<BVHWideNode<4>, tbb::cache_aligned_allocator<BVHWideNode<4>>> BVH4NodeArray;
+    typedef std::vector<BVHWideNode<8>, tbb::cache_aligned_allocator<BVHWideNode<8>>> BVH8NodeArray;
+    typedef std::vector<BVHQuantizedNode<4>, tbb::cache_aligned_allocator<BVHQuantizedNode<4>>> BVH4QuantizedNodeArray;
+    typedef std::vector<BVHQuantizedNode<8>, tbb::cache_aligned_allocator<BVHQuantizedNode<8>>> BVH8QuantizedNodeArray;
+
+    /// Collapse the binary tree into a wide BVH (recursive)
+    template <int N, typename Array> uint32_t collapse(Array &nodes, uint32_t node_idx) const;
+
+    /**
+     * \brief Convert the nodes of a collapsed N-wide BVH into the compressed format
+     *
+     * \return \c false if the tree has a leaf with too many primitives
+     */
+    template <int N, typename Array, typename QuantizedArray>
+    bool quantize(const Array &nodes, QuantizedArray &result) const;
+
+    /// Intersect a ray against the primitive references in the range [start, end)
+    bool intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray, Intersection &its,
+        uint32_t &f, bool shadowRay, TraversalStatistics &stats) const;
+
+    /// Intersect a ray against \c count precomputed triangle blocks using SIMD instructions
+    bool intersectTriangleBlocks(uint32_t block, uint32_t count, Ray3f &ray,
+        Intersection &its, uint32_t &f, bool shadowRay) const;
+
+    /// Intersect a ray against \c count sphere blocks using SIMD instructions
+    bool intersectSphereBlocks(uint32_t block, uint32_t count, Ray3f &ray,
+        Intersection &its, uint32_t &f, bool shadowRay) const;
+
+    /// Intersect a ray against the precomputed blocks of a leaf (see \ref m_leafBlocks)
+    bool intersectBlocks(uint32_t block, uint32_t count, Ray3f &ray,
+        Intersection &its, uint32_t &f, bool shadowRay) const {
+        if (block & SPHERE_BLOCK_FLAG)
+            return intersectSphereBlocks(block & ~SPHERE_BLOCK_FLAG, count, ray, its, f, shadowRay);
+        return intersectTriangleBlocks(block, count, ray, its, f, shadowRay);
+    }
+
+    /// Traverse the tree using the selected memory layout
+    bool traverse(Ray3f &ray, Intersection &its, uint32_t &f,
+        bool shadowRay, TraversalStatistics &stats) const;
+
+    /// Traversal of the binary tree
+    bool rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f,
+        bool shadowRay, TraversalStatistics &stats) const;
+
+    /**
+     * \brief Traversal of the binary tree by a packet of up to \c N rays
+     * with matching direction signs
+     *
+     * Shadow rays are traced when \c its is \c nullptr.
+     */
+    template <int N> void rayIntersectPacket(const Ray3f *rays, const uint32_t *indices,
+        uint32_t count, Intersection *its, bool *occluded, TraversalStatistics &stats) const;
+
+    /// Shared implementation of the batched queries
+    void rayIntersectBatch(const Ray3f *rays, size_t count, Intersection *its, bool *occluded) const;
+
+    /// Traversal of a collapsed N-wide BVH
+    template <int N, typename Array> bool rayIntersectWide(const Array &nodes,
+        Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay,
+        TraversalStatistics &stats) const;
+
+    /**
+     * \brief Check whether any primitive reference in the range [start, end)
+     * occludes the ray
+     *
+     * When \c occluder is not \c nullptr, it receives the blocking reference.
+     */
+    bool occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+        TraversalStatistics &stats, uint32_t *occluder) const;
+
+    /// Return a reference in the range [start, end) that occludes the ray (or \c start)
+    uint32_t findOccluder(uint32_t start, uint32_t end, const Ray3f &ray) const;
+
+    /// Any-hit traversal using the selected memory layout
+    bool occluded(const Ray3f &ray, TraversalStatistics &stats,
+        uint32_t *occluder = nullptr) const;
+
+    /// Any-hit traversal of the binary tree
+    bool occludedBinary(const Ray3f &ray, TraversalStatistics &stats,
+        uint32_t *occluder) const;
+
+    /// Any-hit traversal of a collapsed N-wide BVH
+    template <int N, typename Array> bool occludedWide(const Array &nodes,
+        const Ray3f &ray, TraversalStatistics &stats, uint32_t *occluder) const;
 private:
     std::vector<Shape *> m_shapes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
-    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes (only during the build)
+    std::vector<uint32_t> m_refShapes;  ///< Shape index of each primitive reference in leaf order
+    std::vector<uint32_t> m_refPrims;   ///< Shape-local index of each primitive reference
+    std::vector<BoundingBox3f> m_primBounds; ///< Primitive bounding boxes (only during the build)
+    std::vector<Point3f> m_centroids;   ///< Primitive centroids (only during the build)
+    TriangleBlockArray m_triangleBlocks; ///< Precomputed triangle data (if enabled)
+    SphereBlockArray m_sphereBlocks;    ///< Sphere data of leaves that only contain spheres
+    std::vector<uint32_t> m_leafBlocks; ///< First triangle or sphere block of the leaf starting at a given reference
+    BVH4NodeArray m_nodes4;             ///< Collapsed 4-wide BVH nodes (if enabled)
+    BVH8NodeArray m_nodes8;             ///< Collapsed 8-wide BVH nodes (if enabled)
+    BVH4QuantizedNodeArray m_quantizedNodes4; ///< Compressed 4-wide BVH nodes (if enabled)
+    BVH8QuantizedNodeArray m_quantizedNodes8; ///< Compressed 8-wide BVH nodes (if enabled)
+    bool m_compressNodes = false;       ///< Quantize the nodes of the wide BVH?
+    ELayout m_layout = EBinary;         ///< Memory layout used for traversal
+    EBuildQuality m_quality = EHighQuality; ///< Builder that is used to construct the tree
+    bool m_useCache = false;            ///< Cache the binary tree on disk?
+    bool m_precomputeTriangles = false; ///< Build the precomputed triangle data?
+    bool m_occluderCache = false;       ///< Test the last occluder of each thread first?
+    bool m_spatialSplits = false;       ///< Rebuild the tree using spatial splits?
+    float m_splitBudget = 0.3f;         ///< Max. duplicated references per primitive
+    float m_rebuildThreshold = 1.5f;    ///< Max. relative SAH cost increase of refitted subtrees
+    std::vector<float> m_nodeCosts;     ///< SAH cost of each node after its last build (for refitting)
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+
+    /// Return the traversal statistics of the calling thread
+    TraversalStatistics &localStatistics() const {
+#if defined(NORI_BVH_STATS)
+        return m_traversalStats.local();
+#else
+        static TraversalStatistics unused; /* Never written */
+        return unused;
+#endif
+    }
+
+    /* The per-thread storage below looks up threads in a hash table
+       (ets_no_key). ets_key_per_instance would take one of the ~1024
+       native TLS keys of the process per BVH, and every shape group
+       has its own BVH */
+
+#if defined(NORI_BVH_STATS)
+    /// Per-thread ray traversal statistics
+    mutable tbb::enumerable_thread_specific<TraversalStatistics,
+        tbb::cache_aligned_allocator<TraversalStatistics>> m_traversalStats;
+#endif
+
+    /// Per-thread reference of the primitive that blocked the last shadow ray
+    mutable tbb::enumerable_thread_specific<uint32_t,
+        tbb::cache_aligned_allocator<uint32_t>> m_lastOccluder;
 };
 
 NORI_NAMESPACE_END
@@ -119,11 +119,13 @@ typedef TRay<Point3f, Vector3f> Ray3f;
 
 /// Some more forward declarations
 class BSDF;
+class BVH;
 class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
 class Integrator;
+struct Intersection;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
@@ -193,6 +195,25 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/**
+ * \brief Compute a 64-bit hash of a memory region (FNV-1a, processing
+ * 8 bytes at a time and folding the high half of the state into the
+ * low half after each word)
+ *
+ * The \c hash parameter can be used to combine the hashes of several regions.
+ */
+extern uint64_t hashBuffer(const void *data, size_t size,
+                           uint64_t hash = 14695981039346656037ULL);
+
+/// Combine a 32-bit hash with an integer (e.g. to seed a sampler per pixel)
+inline uint32_t hashCombine(uint32_t hash, uint32_t value) {
+    uint32_t x = hash ^ (value + 0x9e3779b9u + (hash << 6) + (hash >> 2));
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
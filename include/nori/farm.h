@@ -0,0 +1,89 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_FARM_H)
+#define __NORI_FARM_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Distributes the blocks of an image over several rendering
+ * processes that share a directory
+ *
+ * The coordinator splits the image into the blocks of a \ref BlockGenerator
+ * and creates a task file for each of them in the shared directory, followed
+ * by a job file that announces the number of tasks and samples. Worker
+ * processes (on the same machine or on others that mount the directory)
+ * claim tasks by atomically renaming their files, render all samples of the
+ * block and write its unnormalized weighted pixels, including the border, to
+ * a result file. The coordinator merges these using \ref ImageBlock::put(),
+ * just like the blocks rendered by the threads of a single process, and
+ * writes the output image once all blocks have arrived.
+ *
+ * Workers touch the files of the tasks they have claimed every few seconds.
+ * When the file of a claimed task stays unchanged for too long (e.g. since
+ * its worker on another machine was killed), the coordinator returns the
+ * task to the queue. Workers therefore keep looking for tasks until the
+ * coordinator removes the job. If the coordinator fails, it stops its local
+ * workers and removes the files of the job.
+ *
+ * Every block is rendered with the sampler prepared for it, so the image
+ * matches that of a single process up to the rounding of the merges.
+ * Adaptive sampling and time budgets are not supported.
+ */
+class RenderFarm {
+public:
+    /// Create a farm that communicates through the given directory
+    RenderFarm(const std::string &directory);
+
+    /// Write the raw weighted samples instead of a normalized image (see \ref ImageBlock::saveEXR())
+    void setRawOutput(bool rawOutput) { m_rawOutput = rawOutput; }
+
+    /**
+     * \brief Render a scene by distributing its blocks over the workers
+     *
+     * \param sampleCount
+     *     Samples per pixel (0: use the sample count of the scene's sampler)
+     * \param workerCommand
+     *     Command line for starting \c localWorkers worker processes on
+     *     this machine. Further workers can be started manually.
+     */
+    void coordinate(const std::string &filename, const std::string &outputName,
+                    uint32_t sampleCount, const std::vector<std::string> &workerCommand,
+                    int localWorkers, bool progress);
+
+    /**
+     * \brief Render tasks of the scene using \c threadCount threads until
+     * the job has ended (waiting for the coordinator to create it if necessary)
+     */
+    void work(const std::string &filename, int threadCount);
+
+protected:
+    /// Return the path of a file within the shared directory
+    std::string getPath(const std::string &name) const;
+
+private:
+    std::string m_directory;
+    bool m_rawOutput = false;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_FARM_H */
@@ -0,0 +1,100 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_GEOMETRYCACHE_H)
+#define __NORI_GEOMETRYCACHE_H
+
+#include <nori/bvh.h>
+#include <tbb/mutex.h>
+#include <memory>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Keeps loaded meshes and BVH trees in memory across scenes
+ *
+ * When several scenes that share geometry are rendered by one process
+ * (e.g. a batch of jobs that only differ in their camera, sampler or
+ * integrator), most of the loading time is spent parsing the same OBJ
+ * files and building the same BVH again. While the cache is enabled,
+ * the OBJ loader looks up meshes by their resolved filename and
+ * <tt>toWorld</tt> transform, and \ref BVH::build() looks up the binary
+ * tree by the same geometry hash that the on-disk <tt>bvhCache</tt> uses.
+ * Only the geometry is shared: every scene still creates its own shapes,
+ * materials and emitters, so the jobs may differ in those as well.
+ *
+ * The cache is disabled by default, since a single rendering would
+ * only pay for the extra copies.
+ */
+class GeometryCache {
+public:
+    /// Vertex data of a loaded mesh (see \ref Mesh)
+    struct MeshData {
+        MatrixXf V, N, UV;
+        MatrixXu F;
+        BoundingBox3f bbox;
+    };
+
+    /// Binary BVH tree along with its primitive references (defined by \ref BVH)
+    typedef BVH::ResidentTree TreeData;
+
+    /// Enable or disable the cache (disabling it releases all entries)
+    void setEnabled(bool enabled);
+
+    /// Is the cache enabled?
+    bool isEnabled() const { return m_enabled; }
+
+    /// Look up a mesh loaded from \c filename with the given transform
+    std::shared_ptr<const MeshData> getMesh(const std::string &filename,
+                                            const Transform &trafo);
+
+    /// Store a mesh loaded from \c filename with the given transform
+    void putMesh(const std::string &filename, const Transform &trafo,
+                 const std::shared_ptr<const MeshData> &mesh);
+
+    /// Look up a tree by its hash (see \ref BVH::getCacheHash())
+    std::shared_ptr<const TreeData> getTree(uint64_t hash);
+
+    /// Store a tree under its hash
+    void putTree(uint64_t hash, const std::shared_ptr<const TreeData> &tree);
+
+    /// Release all entries
+    void clear();
+
+    /// Return a summary of the number of entries and hits
+    std::string toString() const;
+
+protected:
+    /// Return the lookup key of a mesh
+    static std::string getMeshKey(const std::string &filename, const Transform &trafo);
+
+private:
+    bool m_enabled = false;
+    std::map<std::string, std::shared_ptr<const MeshData>> m_meshes;
+    std::map<uint64_t, std::shared_ptr<const TreeData>> m_trees;
+    size_t m_meshHits = 0, m_treeHits = 0;
+    mutable tbb::mutex m_mutex;
+};
+
+/// Return the process-wide geometry cache
+extern GeometryCache *getGeometryCache();
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_GEOMETRYCACHE_H */
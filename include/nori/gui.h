@@ -44,6 +44,7 @@ private:
     nanogui::Slider *m_slider = nullptr;
     nanogui::ProgressBar *m_progressBar = nullptr;
     uint32_t m_texture = 0;
+    uint32_t m_textureVersion = (uint32_t) -1; ///< Snapshot version stored in \ref m_texture
     float m_scale = 1.f;
     Widget *panel = nullptr;
 
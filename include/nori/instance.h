@@ -0,0 +1,189 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_INSTANCE_H)
+#define __NORI_INSTANCE_H
+
+#include <nori/shape.h>
+#include <nori/transform.h>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Collection of shapes that can be referenced by several \ref Instance shapes
+ *
+ * The shapes are organized in a BVH of their own, which is built once
+ * when the group is activated, and which is traversed in the local
+ * coordinate system of each instance. The group is referenced by the name
+ * given in the XML file, and it must be declared before its instances:
+ *
+ * <pre>
+ * &lt;mesh type="shapegroup" name="tree"&gt;
+ *     &lt;mesh type="obj"&gt; ... &lt;/mesh&gt;
+ * &lt;/mesh&gt;
+ *
+ * &lt;mesh type="instance"&gt;
+ *     &lt;string name="shapegroup" value="tree"/&gt;
+ *     &lt;transform name="toWorld"&gt; ... &lt;/transform&gt;
+ * &lt;/mesh&gt;
+ * </pre>
+ *
+ * A shape group is not rendered by itself. The BVH of the group is
+ * configured using the same properties as the scene-level BVH (e.g.
+ * <tt>bvhLayout</tt>), specified on the <tt>shapegroup</tt> element.
+ */
+class ShapeGroup : public Shape {
+public:
+    ShapeGroup(const PropertyList &propList);
+
+    /// Release all memory
+    virtual ~ShapeGroup();
+
+    virtual void addChild(NoriObject *child) override;
+
+    /// Build the BVH of the group
+    virtual void activate() override;
+
+    /// Return the BVH containing the shapes of the group
+    const BVH *getBVH() const { return m_bvh; }
+
+    /// Update the BVH of the group after its shapes have moved (see \ref BVH::refit())
+    void refit();
+
+    /// Rebuild the BVH of the group from scratch after its shapes have moved
+    void rebuild();
+
+    /// A shape group has no primitives of its own (only instances do)
+    virtual uint32_t getPrimitiveCount() const override { return 0; }
+
+    using Shape::getBoundingBox;
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    /// Return a hash of the geometry of all shapes in the group
+    virtual uint64_t getGeometryHash() const override;
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
+
+    virtual bool rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const override;
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
+
+    virtual void sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const override;
+
+    virtual float pdfSurface(const ShapeQueryRecord & sRec) const override;
+
+    /**
+     * \brief Intersect a ray in the local coordinate system of the group
+     *
+     * Upon success, <tt>ray.maxt</tt> is set to the distance of the
+     * intersection, and \c index to a primitive index that can be passed to
+     * \ref setHitInformation(const Ray3f &, uint32_t, Intersection &).
+     */
+    bool rayIntersect(Ray3f &ray, float &u, float &v, uint32_t &index, bool shadowRay) const;
+
+    /// Check whether a ray segment in the local coordinate system of the group is occluded
+    bool rayOccluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Compute the intersection information of a primitive found
+     * by \ref rayIntersect(Ray3f &, float &, float &, uint32_t &, bool)
+     *
+     * The result is expressed in the local coordinate system of the group,
+     * and <tt>its.mesh</tt> is set to the intersected shape.
+     */
+    void setHitInformation(const Ray3f &ray, uint32_t index, Intersection &its) const;
+
+    virtual std::string toString() const override;
+
+protected:
+    BVH *m_bvh;
+    /// Maps the shapes of the group to their index in \ref m_bvh
+    std::unordered_map<const Shape *, uint32_t> m_shapeIndex;
+};
+
+/**
+ * \brief Instance of a \ref ShapeGroup, which is placed into the scene
+ * using the <tt>toWorld</tt> transformation
+ *
+ * An instance is a single primitive of the top-level (scene) BVH. Rays that
+ * reach it are transformed into the local coordinate system of the group
+ * and traverse its BVH, so that the geometry is stored only once no matter
+ * how many instances there are. Intersections report the BSDF of the shape
+ * that was hit. Instanced shapes cannot be area emitters.
+ */
+class Instance : public Shape {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Does not create a default BSDF (the shapes of the group have their own)
+    virtual void activate() override { }
+
+    /// Return the name of the referenced shape group
+    const std::string &getShapeGroupName() const { return m_groupName; }
+
+    /// Set the referenced shape group (called by \ref Scene)
+    void setShapeGroup(const ShapeGroup *group);
+
+    /// Recompute the bounding box after the shape group was refitted
+    void updateBoundingBox();
+
+    using Shape::getBoundingBox;
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    /// Return a hash of the group geometry and the transformation
+    virtual uint64_t getGeometryHash() const override;
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
+
+    /**
+     * \brief Traverse the BVH of the group
+     *
+     * The returned \c index refers to the intersected primitive of the group
+     * rather than to the (single) primitive of the instance.
+     */
+    virtual bool rayIntersectPrimitives(const uint32_t *indices, uint32_t count, Ray3f &ray,
+                                        float &u, float &v, uint32_t &index, bool shadowRay) const override;
+
+    /// Check whether the ray is occluded by the shapes of the group
+    virtual bool rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const override;
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
+
+    virtual void sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const override;
+
+    virtual float pdfSurface(const ShapeQueryRecord & sRec) const override;
+
+    virtual std::string toString() const override;
+
+protected:
+    std::string m_groupName;
+    const ShapeGroup *m_group = nullptr;
+    Transform m_toWorld;
+    Transform m_toLocal;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_INSTANCE_H */
@@ -54,6 +54,29 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose first
+     * intersection with the scene is already known
+     *
+     * When \ref usesPrimaryIntersections() returns \c true, the renderer
+     * traces the camera rays of a whole block row as one packet and then
+     * calls this function instead of \ref Li(), so that implementations
+     * can skip the first intersection query.
+     *
+     * \param its
+     *    The first intersection along \c ray, where <tt>its.mesh</tt>
+     *    is \c nullptr if the ray escapes the scene
+     *
+     * The default implementation ignores \c its and calls \ref Li().
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+            const Intersection &its) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Should the renderer precompute primary intersections for \ref LiPrimary()?
+    virtual bool usesPrimaryIntersections() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -46,6 +46,12 @@ public:
     //// Return the centroid of the given triangle
     virtual Point3f getCentroid(uint32_t index) const override;
 
+    //// Return the exact bounding box of the part of a triangle that lies inside \c clip
+    virtual BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const override;
+
+    /// Return a hash of the vertex positions and indices
+    virtual uint64_t getGeometryHash() const override;
+
     /** \brief Ray-triangle intersection test
      *
      * Uses the algorithm by Moeller and Trumbore discussed at
@@ -73,6 +79,22 @@ public:
      */
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
 
+    /// Intersect a ray against several triangles (without per-triangle virtual calls)
+    virtual bool rayIntersectPrimitives(const uint32_t *indices, uint32_t count, Ray3f &ray,
+                                        float &u, float &v, uint32_t &index, bool shadowRay) const override;
+
+    /**
+     * \brief Ray-triangle occlusion test
+     *
+     * A variant of \ref rayIntersect() that compares the unnormalized
+     * barycentric coordinates and distance against the determinant
+     * instead of dividing by it.
+     */
+    bool rayOccluded(uint32_t index, const Ray3f &ray) const;
+
+    /// Check whether a ray segment intersects any of several triangles
+    virtual bool rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const override;
+
     /// Set intersection information: hit point, shading frame, UVs
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
 
@@ -104,6 +126,15 @@ public:
     /// Return a pointer to the triangle vertex index list
     const MatrixXu &getIndices() const { return m_F; }
 
+    /**
+     * \brief Move the vertices of the mesh (e.g. to the next frame of an animation)
+     *
+     * The number of vertices must not change. When \c normals is nonempty,
+     * the vertex normals are replaced as well. The BVH containing the mesh
+     * must be updated afterwards using \ref BVH::refit().
+     */
+    void setVertexPositions(const MatrixXf &positions, const MatrixXf &normals = MatrixXf());
+
 
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
@@ -115,6 +146,9 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Build the discrete PDF used to sample triangles proportional to their area
+    void buildAreaPdf();
+
 protected:
     std::string m_name;                  ///< Identifying name
     MatrixXf      m_V;                   ///< Vertex positions
@@ -22,26 +22,146 @@
 #include <nori/common.h>
 #include <thread>
 #include <nori/block.h>
+#include <nori/timer.h>
 #include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Renders a scene into an \ref ImageBlock on a background thread
+ *
+ * This class has no dependency on the graphical user interface: the
+ * interactive viewer (\c nori) polls the image block to display it,
+ * while the command line renderer (\c nori-cli) just waits for the
+ * rendering to finish.
+ *
+ * The samples are accumulated into a private image without any locking.
+ * The block passed to the constructor only receives snapshots of it
+ * (every few hundred milliseconds and when the rendering is done), so
+ * the viewer can lock it to upload the image without stalling the
+ * rendering threads.
+ */
 class RenderThread {
 
 public:
     RenderThread(ImageBlock & block);
     ~RenderThread();
 
+    /**
+     * \brief Load a scene and start rendering it asynchronously
+     *
+     * The image is written next to the scene file (with an
+     * <tt>.exr</tt> extension) unless \ref setOutputName() was called.
+     */
     void renderScene(const std::string & filename);
 
+    /// Write the rendered image to \c outputName instead (empty: default)
+    void setOutputName(const std::string &outputName) { m_outputName = outputName; }
+
+    /// Override the sample count of the scene's sampler (0: keep)
+    void setSampleCount(uint32_t sampleCount) { m_sampleCount = sampleCount; }
+
+    /// Override the seed of the scene's sampler (0: keep, see \ref Sampler::setSeed())
+    void setSeed(uint32_t seed) { m_seed = seed; }
+
+    /**
+     * \brief Write the raw weighted samples instead of a normalized image
+     *
+     * See \ref ImageBlock::saveEXR(). Renderings of the same scene with
+     * different seeds can then be combined using the <tt>nori-merge</tt>
+     * tool. Adaptive sampling is not supported in this mode, since it
+     * accumulates the samples with a box filter.
+     */
+    void setRawOutput(bool rawOutput) { m_rawOutput = rawOutput; }
+
+    /**
+     * \brief Set the number of samples per pixel that are rendered in
+     * each pass over the image
+     *
+     * Every pass merges each block into the image once. The default (0)
+     * adapts the pass size so that a pass takes about half a second, which
+     * keeps the displayed image fresh without synchronizing for every sample.
+     */
+    void setPassSamples(uint32_t passSamples) { m_passSamples = passSamples; }
+
+    /**
+     * \brief Render for the given number of seconds instead of a fixed
+     * number of samples (0: use the scene's \c timeBudget property)
+     *
+     * The sample count of the scene's sampler is ignored in this case. The
+     * pass sizes are chosen based on the measured rendering throughput so
+     * that the last pass ends just before the deadline, and every pixel
+     * receives the same number of samples (unless adaptive sampling
+     * stops some of them earlier).
+     */
+    void setTimeBudget(float seconds) { m_timeBudget = seconds; }
+
+    /**
+     * \brief Periodically save the state of the rendering to a checkpoint
+     * file next to the output image (with a <tt>.checkpoint</tt> suffix)
+     *
+     * A checkpoint is written after every pass that ends at least \c
+     * interval seconds after the previous checkpoint. It contains the
+     * accumulated image, the number of rendered samples and the states of
+     * the samplers, which allows \ref setResume() to continue an interrupted
+     * rendering. The file is removed once the rendering has finished.
+     */
+    void setCheckpointInterval(float seconds) { m_checkpointInterval = seconds; }
+
+    /**
+     * \brief Continue from the checkpoint of an interrupted rendering
+     * (if there is one) instead of starting from scratch
+     *
+     * With a fixed pass size (see \ref setPassSamples()) and a single
+     * rendering thread, the final image is identical to that of an
+     * uninterrupted rendering.
+     */
+    void setResume(bool resume) { m_resume = resume; }
+
     bool isBusy();
     void stopRendering();
 
     float getProgress();
 
+    /// Return a counter that is incremented whenever a new snapshot was stored in the block
+    uint32_t getSnapshotVersion() const { return m_snapshotVersion; }
+
+    /**
+     * \brief Render \c sampleCount samples for each pixel of \c block
+     * using the given sampler (after clearing the block)
+     *
+     * \c firstSample is the number of samples per pixel that earlier
+     * passes have rendered (see \ref Sampler::startPixelSample()). When
+     * \c stats is given, the samples are recorded there as well and
+     * converged pixels are skipped.
+     */
+    static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                            uint32_t firstSample, uint32_t sampleCount,
+                            PixelStatistics *stats = nullptr);
+
+protected:
+    /**
+     * \brief Copy the accumulated image into the block passed to the constructor
+     *
+     * Unless \c force is set, nothing happens when the block is locked by
+     * another thread or the last snapshot is too recent.
+     */
+    void storeSnapshot(bool force);
+
 protected:
     Scene* m_scene = nullptr;
     ImageBlock & m_block;
+    ImageBlock m_accum;
+    Timer m_snapshotTimer;
+    std::atomic<uint32_t> m_snapshotVersion;
+    std::string m_outputName;
+    uint32_t m_sampleCount = 0;
+    uint32_t m_seed = 0;
+    uint32_t m_passSamples = 0;
+    float m_timeBudget = 0;
+    float m_checkpointInterval = 0;
+    bool m_resume = false;
+    bool m_rawOutput = false;
     std::thread m_render_thread;
     std::atomic<int> m_render_status; // 0: free, 1: busy, 2: interruption, 3: done
     std::atomic<float> m_progress;
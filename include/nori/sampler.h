@@ -51,6 +51,11 @@ class ImageBlock;
  * algorithm requests (pseudo-) random numbers using the \ref next1D() and
  * \ref next2D() functions.
  *
+ * Samplers that derive the samples of a pixel from a deterministic sequence
+ * (e.g. \ref Sobol and \ref Halton) need to know which pixel and sample
+ * index they are generating. The renderer therefore also calls
+ * \ref startPixelSample() before the camera ray of each pixel sample.
+ *
  * Conceptually, the right way of thinking of this goes as follows:
  * For each sample in a pixel, a sample generator produces a (hypothetical)
  * point in an infinite dimensional random number hypercube. A rendering 
@@ -89,6 +94,21 @@ public:
     /// Advance to the next sample
     virtual void advance() = 0;
 
+    /**
+     * \brief Prepare to generate sample \c index of the given pixel
+     *
+     * Called by the renderer before the camera ray of every pixel sample.
+     * The samples of a pixel may be rendered in several passes and
+     * interleaved with those of other pixels, so \c index counts the
+     * samples of the pixel across all passes. When the renderer resumes a
+     * sample after tracing a batch of camera rays, \c dimension is the
+     * number of components that were already consumed.
+     *
+     * The default implementation does nothing, which suits samplers
+     * that produce independent random numbers.
+     */
+    virtual void startPixelSample(const Point2i &pixel, uint32_t index, uint32_t dimension = 0) { }
+
     /// Retrieve the next component value from the current sample
     virtual float next1D() = 0;
 
@@ -98,6 +118,32 @@ public:
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
+    /// Override the number of pixel samples (e.g. from the command line)
+    virtual void setSampleCount(size_t sampleCount) { m_sampleCount = sampleCount; }
+
+    /**
+     * \brief Offset the random number streams by \c seed (e.g. from the
+     * command line)
+     *
+     * Renderings with different seeds are statistically independent, so
+     * that their images can be merged into one with more samples.
+     */
+    virtual void setSeed(uint32_t seed) { m_seed = seed; }
+
+    /// Return the seed of the random number streams
+    uint32_t getSeed() const { return m_seed; }
+
+    /**
+     * \brief Write the state of the sampler to a binary stream (e.g. for
+     * checkpoints of long renderings)
+     *
+     * \return \c false if the sampler does not support this
+     */
+    virtual bool saveState(std::ostream &os) const { return false; }
+
+    /// Restore a state written by \ref saveState() (after \ref prepare())
+    virtual void loadState(std::istream &is) { }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
@@ -105,6 +151,7 @@ public:
     virtual EClassType getClassType() const override { return ESampler; }
 protected:
     size_t m_sampleCount;
+    uint32_t m_seed = 0;
 };
 
 NORI_NAMESPACE_END
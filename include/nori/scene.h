@@ -21,6 +21,8 @@
 
 #include <nori/bvh.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <map>
 
 NORI_NAMESPACE_BEGIN
 
@@ -42,6 +44,18 @@ public:
     /// Return a pointer to the scene's kd-tree
     const BVH *getBVH() const { return m_bvh; }
 
+    /**
+     * \brief Update the acceleration data structures after shapes of the
+     * scene have moved (see \ref BVH::refit())
+     */
+    void refit();
+
+    /**
+     * \brief Rebuild the acceleration data structures from scratch
+     * after shapes of the scene have moved (see \ref BVH::build())
+     */
+    void rebuild();
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -57,6 +71,28 @@ public:
     /// Return a pointer to the scene's sample generator
     Sampler *getSampler() { return m_sampler; }
 
+    /**
+     * \brief Return the relative error at which adaptive sampling considers
+     * a pixel converged (0 if adaptive sampling is disabled)
+     *
+     * Set using the scene's \c adaptiveThreshold property. A pixel stops
+     * receiving samples once the standard error of its color drops below
+     * this fraction of the mean, but no earlier than after
+     * \ref getAdaptiveMinSamples() samples (see \ref PixelStatistics).
+     */
+    float getAdaptiveThreshold() const { return m_adaptiveThreshold; }
+
+    /// Return the minimum number of samples per pixel before adaptive sampling may stop
+    uint32_t getAdaptiveMinSamples() const { return m_adaptiveMinSamples; }
+
+    /**
+     * \brief Return the time in seconds that the rendering may take
+     * (0 if the sample count of the sampler should be rendered instead)
+     *
+     * Set using the scene's \c timeBudget property.
+     */
+    float getTimeBudget() const { return m_timeBudget; }
+
     /// Return a reference to an array containing all shapes
     const std::vector<Shape *> &getShapes() const { return m_shapes; }
 
@@ -106,8 +142,48 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Intersect a batch of rays against all triangles stored in
+     * the scene and return detailed intersection information
+     *
+     * The rays are traced in packets that share bounding box tests, which
+     * is considerably faster than individual queries when the rays are
+     * coherent (e.g. camera rays through neighboring pixels).
+     *
+     * \param rays
+     *    An array of \c count rays
+     *
+     * \param its
+     *    An array of \c count intersection records. Rays that don't
+     *    intersect the scene are marked by <tt>its[i].mesh == nullptr</tt>
+     *
+     * \return The number of rays that intersected the scene
+     */
+    size_t rayIntersect(const Ray3f *rays, Intersection *its, size_t count) const {
+        m_bvh->rayIntersect(rays, its, count);
+        size_t hits = 0;
+        for (size_t i = 0; i < count; ++i)
+            hits += its[i].mesh != nullptr ? 1 : 0;
+        return hits;
+    }
+
+    /**
+     * \brief Determine for a batch of rays whether or not they
+     * intersect the scene
+     *
+     * This is the batched counterpart of the shadow ray query above.
+     *
+     * \param rays
+     *    An array of \c count rays
+     *
+     * \param occluded
+     *    Receives \c true for each ray segment that intersects the scene
+     */
+    void rayIntersect(const Ray3f *rays, bool *occluded, size_t count) const {
+        m_bvh->rayIntersect(rays, occluded, count);
     }
 
     /**
@@ -138,8 +214,12 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     BVH *m_bvh = nullptr;
+    float m_adaptiveThreshold = 0;
+    uint32_t m_adaptiveMinSamples = 0;
+    float m_timeBudget = 0;
 
     std::vector<Emitter *> m_emitters;
+    std::map<std::string, ShapeGroup *> m_shapeGroups;
 };
 
 NORI_NAMESPACE_END
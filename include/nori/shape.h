@@ -129,9 +129,59 @@ public:
     //// Return the centroid of the given triangle
     virtual Point3f getCentroid(uint32_t index) const = 0;
 
+    /**
+     * \brief Return an axis-aligned bounding box containing the part of the
+     * given primitive that lies inside \c clip
+     *
+     * This is needed by the spatial split BVH builder. The default
+     * implementation simply clips the bounding box of the primitive, which
+     * is conservative but loose. The result is invalid when the primitive
+     * does not overlap \c clip.
+     */
+    virtual BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const {
+        BoundingBox3f result = getBoundingBox(index);
+        result.clip(clip);
+        return result;
+    }
+
+    /**
+     * \brief Return a hash of the geometry of this shape
+     *
+     * This is used to recognize shapes whose BVH was cached on disk. The
+     * default implementation hashes the bounding boxes and centroids of
+     * all primitives, since these determine the BVH construction.
+     */
+    virtual uint64_t getGeometryHash() const;
+
     //// Ray-Shape intersection test
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const = 0;
 
+    /**
+     * \brief Intersect a ray against several primitives of this shape
+     *
+     * Tests the primitives <tt>indices[0], ..., indices[count-1]</tt> and
+     * shortens <tt>ray.maxt</tt> to the closest intersection found. Its
+     * primitive index and UV coordinates are returned via \c index, \c u,
+     * and \c v. When \c shadowRay is set, the function returns as soon as
+     * any intersection has been found.
+     *
+     * The default implementation calls \ref rayIntersect() for each
+     * primitive. Subclasses should override it to avoid a virtual function
+     * call per primitive.
+     */
+    virtual bool rayIntersectPrimitives(const uint32_t *indices, uint32_t count, Ray3f &ray,
+                                        float &u, float &v, uint32_t &index, bool shadowRay) const;
+
+    /**
+     * \brief Check whether a ray segment intersects any of several primitives
+     *
+     * This is the shadow ray counterpart of \ref rayIntersectPrimitives().
+     * It returns as soon as an intersection has been found and need not
+     * compute its distance or UV coordinates. The default implementation
+     * calls \ref rayIntersect() for each primitive.
+     */
+    virtual bool rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const;
+
     /// Set the intersection information: hit point, shading frame, UVs, etc.
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const = 0;
 
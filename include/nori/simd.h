@@ -0,0 +1,220 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_SIMD_H)
+#define __NORI_SIMD_H
+
+#include <nori/common.h>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NORI_HAS_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define NORI_HAS_AVX 1
+#include <immintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of \c N single precision values that are processed in lock-step
+ *
+ * This is a tiny wrapper around the SSE (<tt>N=4</tt>) and AVX (<tt>N=8</tt>)
+ * instruction sets that covers just what the ray tracing kernels need.
+ * When the compiler does not target these instruction sets, a plain
+ * loop-based implementation is used instead, and 8-wide packets are
+ * processed as two 4-wide halves when only SSE is available.
+ *
+ * Note that \ref simdMin() and \ref simdMax() follow the conventions of
+ * the <tt>minps</tt>/<tt>maxps</tt> instructions: when either argument
+ * is a NaN, the \a second argument is returned. The slab tests in \ref BVH
+ * rely on this to ignore the NaNs that arise when a ray travels exactly
+ * within one of the planes of a bounding box.
+ */
+template <int N> struct TSimdFloat {
+    float v[N];
+
+    TSimdFloat() { }
+    explicit TSimdFloat(float value) { for (int i=0; i<N; ++i) v[i] = value; }
+
+    static TSimdFloat load(const float *ptr) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = ptr[i]; return r;
+    }
+    void store(float *ptr) const { for (int i=0; i<N; ++i) ptr[i] = v[i]; }
+
+    /// Convert \c N unsigned bytes into single precision values
+    static TSimdFloat loadBytes(const uint8_t *ptr) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = (float) ptr[i]; return r;
+    }
+
+    TSimdFloat operator+(const TSimdFloat &b) const {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = v[i] + b.v[i]; return r;
+    }
+    TSimdFloat operator-(const TSimdFloat &b) const {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = v[i] - b.v[i]; return r;
+    }
+    TSimdFloat operator*(const TSimdFloat &b) const {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = v[i] * b.v[i]; return r;
+    }
+    TSimdFloat operator/(const TSimdFloat &b) const {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = v[i] / b.v[i]; return r;
+    }
+
+    friend TSimdFloat simdMin(const TSimdFloat &a, const TSimdFloat &b) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r;
+    }
+    friend TSimdFloat simdMax(const TSimdFloat &a, const TSimdFloat &b) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r;
+    }
+    friend TSimdFloat simdSqrt(const TSimdFloat &a) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = std::sqrt(a.v[i]); return r;
+    }
+    /// Return the magnitude of \c a with the sign of \c b
+    friend TSimdFloat simdCopySign(const TSimdFloat &a, const TSimdFloat &b) {
+        TSimdFloat r; for (int i=0; i<N; ++i) r.v[i] = std::copysign(a.v[i], b.v[i]); return r;
+    }
+
+    /// Return a bit mask that has bit \c i set when <tt>a[i] <= b[i]</tt>
+    friend int simdLessEqualMask(const TSimdFloat &a, const TSimdFloat &b) {
+        int mask = 0;
+        for (int i=0; i<N; ++i)
+            mask |= (a.v[i] <= b.v[i] ? 1 : 0) << i;
+        return mask;
+    }
+};
+
+#if defined(NORI_HAS_SSE)
+template <> struct TSimdFloat<4> {
+    __m128 v;
+
+    TSimdFloat() { }
+    TSimdFloat(__m128 v) : v(v) { }
+    explicit TSimdFloat(float value) : v(_mm_set1_ps(value)) { }
+
+    /// Load from a 16 byte-aligned address
+    static TSimdFloat load(const float *ptr) { return _mm_load_ps(ptr); }
+    void store(float *ptr) const { _mm_storeu_ps(ptr, v); }
+
+    static TSimdFloat loadBytes(const uint8_t *ptr) {
+        int32_t bytes;
+        memcpy(&bytes, ptr, sizeof(int32_t));
+        __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    }
+
+    TSimdFloat operator+(const TSimdFloat &b) const { return _mm_add_ps(v, b.v); }
+    TSimdFloat operator-(const TSimdFloat &b) const { return _mm_sub_ps(v, b.v); }
+    TSimdFloat operator*(const TSimdFloat &b) const { return _mm_mul_ps(v, b.v); }
+    TSimdFloat operator/(const TSimdFloat &b) const { return _mm_div_ps(v, b.v); }
+
+    friend TSimdFloat simdMin(const TSimdFloat &a, const TSimdFloat &b) { return _mm_min_ps(a.v, b.v); }
+    friend TSimdFloat simdMax(const TSimdFloat &a, const TSimdFloat &b) { return _mm_max_ps(a.v, b.v); }
+    friend TSimdFloat simdSqrt(const TSimdFloat &a) { return _mm_sqrt_ps(a.v); }
+    friend TSimdFloat simdCopySign(const TSimdFloat &a, const TSimdFloat &b) {
+        __m128 sign = _mm_set1_ps(-0.0f);
+        return _mm_or_ps(_mm_andnot_ps(sign, a.v), _mm_and_ps(sign, b.v));
+    }
+    friend int simdLessEqualMask(const TSimdFloat &a, const TSimdFloat &b) {
+        return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+    }
+};
+#endif
+
+#if defined(NORI_HAS_AVX)
+template <> struct TSimdFloat<8> {
+    __m256 v;
+
+    TSimdFloat() { }
+    TSimdFloat(__m256 v) : v(v) { }
+    explicit TSimdFloat(float value) : v(_mm256_set1_ps(value)) { }
+
+    /// Load from a 32 byte-aligned address
+    static TSimdFloat load(const float *ptr) { return _mm256_load_ps(ptr); }
+    void store(float *ptr) const { _mm256_storeu_ps(ptr, v); }
+
+    static TSimdFloat loadBytes(const uint8_t *ptr) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(
+            TSimdFloat<4>::loadBytes(ptr).v), TSimdFloat<4>::loadBytes(ptr + 4).v, 1);
+    }
+
+    TSimdFloat operator+(const TSimdFloat &b) const { return _mm256_add_ps(v, b.v); }
+    TSimdFloat operator-(const TSimdFloat &b) const { return _mm256_sub_ps(v, b.v); }
+    TSimdFloat operator*(const TSimdFloat &b) const { return _mm256_mul_ps(v, b.v); }
+    TSimdFloat operator/(const TSimdFloat &b) const { return _mm256_div_ps(v, b.v); }
+
+    friend TSimdFloat simdMin(const TSimdFloat &a, const TSimdFloat &b) { return _mm256_min_ps(a.v, b.v); }
+    friend TSimdFloat simdMax(const TSimdFloat &a, const TSimdFloat &b) { return _mm256_max_ps(a.v, b.v); }
+    friend TSimdFloat simdSqrt(const TSimdFloat &a) { return _mm256_sqrt_ps(a.v); }
+    friend TSimdFloat simdCopySign(const TSimdFloat &a, const TSimdFloat &b) {
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        return _mm256_or_ps(_mm256_andnot_ps(sign, a.v), _mm256_and_ps(sign, b.v));
+    }
+    friend int simdLessEqualMask(const TSimdFloat &a, const TSimdFloat &b) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+    }
+};
+#elif defined(NORI_HAS_SSE)
+template <> struct TSimdFloat<8> {
+    TSimdFloat<4> lo, hi;
+
+    TSimdFloat() { }
+    TSimdFloat(const TSimdFloat<4> &lo, const TSimdFloat<4> &hi) : lo(lo), hi(hi) { }
+    explicit TSimdFloat(float value) : lo(value), hi(value) { }
+
+    static TSimdFloat load(const float *ptr) {
+        return TSimdFloat(TSimdFloat<4>::load(ptr), TSimdFloat<4>::load(ptr + 4));
+    }
+    void store(float *ptr) const { lo.store(ptr); hi.store(ptr + 4); }
+
+    static TSimdFloat loadBytes(const uint8_t *ptr) {
+        return TSimdFloat(TSimdFloat<4>::loadBytes(ptr), TSimdFloat<4>::loadBytes(ptr + 4));
+    }
+
+    TSimdFloat operator+(const TSimdFloat &b) const { return TSimdFloat(lo + b.lo, hi + b.hi); }
+    TSimdFloat operator-(const TSimdFloat &b) const { return TSimdFloat(lo - b.lo, hi - b.hi); }
+    TSimdFloat operator*(const TSimdFloat &b) const { return TSimdFloat(lo * b.lo, hi * b.hi); }
+    TSimdFloat operator/(const TSimdFloat &b) const { return TSimdFloat(lo / b.lo, hi / b.hi); }
+
+    friend TSimdFloat simdMin(const TSimdFloat &a, const TSimdFloat &b) {
+        return TSimdFloat(simdMin(a.lo, b.lo), simdMin(a.hi, b.hi));
+    }
+    friend TSimdFloat simdMax(const TSimdFloat &a, const TSimdFloat &b) {
+        return TSimdFloat(simdMax(a.lo, b.lo), simdMax(a.hi, b.hi));
+    }
+    friend TSimdFloat simdSqrt(const TSimdFloat &a) {
+        return TSimdFloat(simdSqrt(a.lo), simdSqrt(a.hi));
+    }
+    friend TSimdFloat simdCopySign(const TSimdFloat &a, const TSimdFloat &b) {
+        return TSimdFloat(simdCopySign(a.lo, b.lo), simdCopySign(a.hi, b.hi));
+    }
+    friend int simdLessEqualMask(const TSimdFloat &a, const TSimdFloat &b) {
+        return simdLessEqualMask(a.lo, b.lo) | (simdLessEqualMask(a.hi, b.hi) << 4);
+    }
+};
+#endif
+
+typedef TSimdFloat<4> SimdFloat4;
+typedef TSimdFloat<8> SimdFloat8;
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_SIMD_H */
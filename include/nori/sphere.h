@@ -0,0 +1,80 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_SPHERE_H)
+#define __NORI_SPHERE_H
+
+#include <nori/shape.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Analytic sphere
+ *
+ * The sphere consists of a single primitive. Leaves of the \ref BVH that
+ * only contain spheres are intersected four spheres at a time using SIMD
+ * instructions, which makes scenes with many small spheres (e.g. particles)
+ * cheap to trace.
+ */
+class Sphere : public Shape {
+public:
+    Sphere(const PropertyList & propList);
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_position; }
+
+    /**
+     * \brief Ray-sphere intersection test
+     *
+     * Solves the quadratic equation in a form that avoids catastrophic
+     * cancellation, as described in "Precision Improvements for Ray/Sphere
+     * Intersection" by Eric Haines et al. (Ray Tracing Gems, 2019). The
+     * UV coordinates are computed later by \ref setHitInformation().
+     */
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
+
+    /// Check whether the ray segment intersects the sphere
+    virtual bool rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const override;
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
+
+    virtual void sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const override;
+
+    virtual float pdfSurface(const ShapeQueryRecord & sRec) const override;
+
+    /// Return the center of the sphere
+    const Point3f &getCenter() const { return m_position; }
+
+    /// Return the radius of the sphere
+    float getRadius() const { return m_radius; }
+
+    virtual std::string toString() const override;
+
+protected:
+    /// Compute the distance of the closest intersection within the ray segment
+    bool intersect(const Ray3f &ray, float &t) const;
+
+protected:
+    Point3f m_position;
+    float m_radius;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_SPHERE_H */
@@ -0,0 +1,179 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/bitmap.h>
+#include <nori/render.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_scheduler_init.h>
+
+using namespace nori;
+
+/* Compares the convergence of samplers: renders a scene with 1, 2, 4, ..
+   samples per pixel using each sampler and reports the rendering time and
+   the RMSE with respect to a reference image (e.g. scenes/pa4/table/ref).
+   Note that the reference images were rendered with a finite number of
+   samples, so their own noise limits the RMSE that can be reached. */
+
+static void help() {
+    cout << "Syntax: nori-benchmark [options] <scene.xml> <reference.exr>" << endl
+         << "Options:" << endl
+         << "   -S, --samplers <list>    Samplers to compare (default: independent,sobol,halton)" << endl
+         << "   -s, --spp <count>        Maximum number of samples per pixel (default: scene's sampler)" << endl
+         << "   -t, --threads <count>    Number of rendering threads (default: all cores)" << endl
+         << "   -h, --help               Display this message" << endl;
+}
+
+/// Render the scene with \c sampleCount samples per pixel using a clone of \c sampler
+static Bitmap *render(const Scene *scene, const Sampler *sampler, uint32_t sampleCount) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+
+    ImageBlock result(outputSize, camera->getReconstructionFilter());
+    result.clear();
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+
+    tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+    tbb::parallel_for(range, [&](const tbb::blocked_range<int> &range) {
+        ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+        for (int i = range.begin(); i < range.end(); ++i) {
+            blockGenerator.next(block);
+            std::unique_ptr<Sampler> blockSampler(sampler->clone());
+            blockSampler->prepare(block);
+            RenderThread::renderBlock(scene, blockSampler.get(), block, 0, sampleCount);
+            result.put(block);
+        }
+    });
+
+    return result.toBitmap();
+}
+
+/// Root mean square error over all pixels and channels
+static double rmse(const Bitmap &image, const Bitmap &reference) {
+    double sum = 0;
+    for (int y = 0; y < image.rows(); ++y) {
+        for (int x = 0; x < image.cols(); ++x) {
+            Color3f diff = image(y, x) - reference(y, x);
+            sum += diff.matrix().squaredNorm();
+        }
+    }
+    return std::sqrt(sum / (3.0 * image.size()));
+}
+
+int main(int argc, char **argv) {
+    try {
+        int threadCount = tbb::task_scheduler_init::automatic;
+        uint32_t maxSamples = 0;
+        std::vector<std::string> samplerNames = { "independent", "sobol", "halton" };
+        std::string filename, referenceName;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "-h" || arg == "--help") {
+                help();
+                return 0;
+            } else if ((arg == "-S" || arg == "--samplers") && hasValue) {
+                samplerNames = tokenize(argv[++i], ",");
+            } else if ((arg == "-s" || arg == "--spp") && hasValue) {
+                int value = toInt(argv[++i]);
+                if (value <= 0)
+                    throw NoriException("Invalid sample count \"%s\"!", argv[i]);
+                maxSamples = (uint32_t) value;
+            } else if ((arg == "-t" || arg == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Invalid thread count \"%s\"!", argv[i]);
+            } else if (arg.size() > 0 && arg[0] != '-' && filename.empty()) {
+                filename = arg;
+            } else if (arg.size() > 0 && arg[0] != '-' && referenceName.empty()) {
+                referenceName = arg;
+            } else {
+                cerr << "Error: invalid argument \"" << arg << "\"" << endl;
+                help();
+                return -1;
+            }
+        }
+
+        if (filename.empty() || referenceName.empty() || samplerNames.empty()) {
+            help();
+            return -1;
+        }
+
+        tbb::task_scheduler_init init(threadCount);
+
+        filesystem::path path(filename);
+        getFileResolver()->prepend(path.parent_path());
+        std::unique_ptr<NoriObject> root(loadFromXML(filename));
+        if (root->getClassType() != NoriObject::EScene)
+            throw NoriException("\"%s\" does not contain a scene!", filename);
+        Scene *scene = static_cast<Scene *>(root.get());
+        if (maxSamples == 0)
+            maxSamples = (uint32_t) scene->getSampler()->getSampleCount();
+
+        Bitmap reference(referenceName);
+        Vector2i outputSize = scene->getCamera()->getOutputSize();
+        if (reference.cols() != outputSize.x() || reference.rows() != outputSize.y())
+            throw NoriException("The reference image has a different size than the scene!");
+
+        scene->getIntegrator()->preprocess(scene);
+
+        /* Render all sample counts with every sampler */
+        struct Result { std::string sampler; uint32_t sampleCount; double time, rmse; };
+        std::vector<Result> results;
+        for (const std::string &name : samplerNames) {
+            std::unique_ptr<NoriObject> object(NoriObjectFactory::createInstance(name, PropertyList()));
+            if (object->getClassType() != NoriObject::ESampler)
+                throw NoriException("\"%s\" is not a sampler!", name);
+            Sampler *sampler = static_cast<Sampler *>(object.get());
+            sampler->activate();
+
+            for (uint32_t sampleCount = 1; sampleCount <= maxSamples; sampleCount *= 2) {
+                Timer timer;
+                std::unique_ptr<Bitmap> image(render(scene, sampler, sampleCount));
+                double time = timer.elapsed();
+                results.push_back(Result { name, sampleCount, time, rmse(*image, reference) });
+            }
+        }
+
+        /* The speedup compares with the time that the first sampler would need to reach
+           the same error at the same sample count, assuming that its error decreases as
+           1/sqrt(time). Near the noise level of the reference, this underestimates. */
+        cout << endl << tfm::format("%-12s %8s %10s %12s %10s", "Sampler", "spp", "Time", "RMSE", "Speedup") << endl;
+        size_t levels = results.size() / samplerNames.size();
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &result = results[i], &baseline = results[i % levels];
+            double ratio = baseline.rmse / result.rmse;
+            cout << tfm::format("%-12s %8i %10s %12.6f %9.2fx", result.sampler, result.sampleCount,
+                                timeString(result.time), result.rmse,
+                                baseline.time * ratio * ratio / result.time) << endl;
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
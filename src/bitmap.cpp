@@ -21,6 +21,8 @@
 #include <ImfOutputFile.h>
 #include <ImfChannelList.h>
 #include <ImfStringAttribute.h>
+#include <ImfIntAttribute.h>
+#include <ImfFloatAttribute.h>
 #include <ImfVersion.h>
 #include <ImfIO.h>
 
@@ -85,6 +87,10 @@ void Bitmap::save(const std::string &filename) {
 
     Imf::Header header((int) cols(), (int) rows());
     header.insert("comments", Imf::StringAttribute("Generated by Nori"));
+    for (const auto &attribute : m_intAttributes)
+        header.insert(attribute.first, Imf::IntAttribute(attribute.second));
+    for (const auto &attribute : m_floatAttributes)
+        header.insert(attribute.first, Imf::FloatAttribute(attribute.second));
 
     Imf::ChannelList &channels = header.channels();
     channels.insert("R", Imf::Channel(Imf::FLOAT));
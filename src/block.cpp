@@ -21,6 +21,15 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfStringAttribute.h>
+#include <ImfIntAttribute.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -81,6 +90,49 @@ Bitmap *ImageBlock::toBitmap() const {
     return result;
 }
 
+Bitmap *ImageBlock::toBitmap(const ReconstructionFilter *filter) const {
+    /* Tabulate the filter at integer pixel offsets */
+    int radius = (int) std::floor(filter->getRadius());
+    std::vector<float> weights(2 * radius + 1);
+    for (int i = -radius; i <= radius; ++i)
+        weights[i + radius] = filter->eval((float) i);
+
+    std::unique_ptr<Bitmap> image(toBitmap());
+    int width = m_size.x(), height = m_size.y();
+
+    /* Separable convolution, first along x .. */
+    Bitmap temp(m_size);
+    tbb::parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            Color3f sum(0.0f);
+            float weightSum = 0;
+            for (int i = std::max(x - radius, 0); i <= std::min(x + radius, width - 1); ++i) {
+                float weight = weights[i - x + radius];
+                sum += image->coeff(y, i) * weight;
+                weightSum += weight;
+            }
+            temp.coeffRef(y, x) = weightSum != 0 ? Color3f(sum / weightSum) : Color3f(0.0f);
+        }
+    });
+
+    /* .. and then along y */
+    Bitmap *result = new Bitmap(m_size);
+    tbb::parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            Color3f sum(0.0f);
+            float weightSum = 0;
+            for (int i = std::max(y - radius, 0); i <= std::min(y + radius, height - 1); ++i) {
+                float weight = weights[i - y + radius];
+                sum += temp.coeff(i, x) * weight;
+                weightSum += weight;
+            }
+            result->coeffRef(y, x) = weightSum != 0 ? Color3f(sum / weightSum) : Color3f(0.0f);
+        }
+    });
+
+    return result;
+}
+
 void ImageBlock::fromBitmap(const Bitmap &bitmap) {
     if (bitmap.cols() != cols() || bitmap.rows() != rows())
         throw NoriException("Invalid bitmap dimensions!");
@@ -121,15 +173,136 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
             coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
 }
     
+/// Atomically add \c value to \c dst
+static inline void atomicAdd(float *dst, float value) {
+    static_assert(sizeof(float) == sizeof(uint32_t), "Unexpected float size");
+    uint32_t oldBits, newBits;
+    do {
+        float oldValue = *(volatile float *) dst, newValue = oldValue + value;
+        memcpy(&oldBits, &oldValue, sizeof(float));
+        memcpy(&newBits, &newValue, sizeof(float));
+#if defined(_MSC_VER)
+    } while (_InterlockedCompareExchange((volatile long *) dst, (long) newBits,
+                                         (long) oldBits) != (long) oldBits);
+#else
+    } while (!__sync_bool_compare_and_swap((volatile uint32_t *) dst, oldBits, newBits));
+#endif
+}
+
 void ImageBlock::put(ImageBlock &b) {
     Vector2i offset = b.getOffset() - m_offset +
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    /* The borders of the neighboring blocks overlap this many pixels */
+    int margin = 2 * b.getBorderSize();
+
+    for (int y = 0; y < size.y(); ++y) {
+        Color4f *target = &coeffRef(offset.y() + y, offset.x());
+        const Color4f *source = &b.coeff(y, 0);
+        bool shared = y < margin || y >= size.y() - margin;
+
+        for (int x = 0; x < size.x(); ++x) {
+            if (shared || x < margin || x >= size.x() - margin) {
+                for (int i = 0; i < 4; ++i)
+                    atomicAdd(&target[x][i], source[x][i]);
+            } else {
+                target[x] += source[x];
+            }
+        }
+    }
+}
+
+void ImageBlock::saveState(std::ostream &os) const {
+    int32_t dims[2] = { (int32_t) rows(), (int32_t) cols() };
+    os.write((const char *) dims, sizeof(dims));
+    os.write((const char *) data(), sizeof(Color4f) * size());
+}
+
+void ImageBlock::loadState(std::istream &is) {
+    int32_t dims[2];
+    is.read((char *) dims, sizeof(dims));
+    if (!is.good() || dims[0] != rows() || dims[1] != cols())
+        throw NoriException("ImageBlock::loadState(): the stored image has a different size!");
+    is.read((char *) data(), sizeof(Color4f) * size());
+}
+
+void ImageBlock::saveEXR(const std::string &filename, uint32_t sampleCount,
+                         const std::vector<uint32_t> &seeds) const {
+    cout << "Writing a " << m_size.x() << "x" << m_size.y()
+         << " raw OpenEXR file to \"" << filename << "\"" << endl;
+
+    Imf::Header header(m_size.x(), m_size.y());
+    header.insert("comments", Imf::StringAttribute("Generated by Nori (raw weighted samples)"));
+    header.insert("sampleCount", Imf::IntAttribute((int) sampleCount));
+
+    std::string seedList;
+    for (uint32_t seed : seeds)
+        seedList += (seedList.empty() ? "" : ",") + std::to_string(seed);
+    header.insert("seeds", Imf::StringAttribute(seedList));
+
+    Imf::ChannelList &channels = header.channels();
+    const char *names[] = { "R", "G", "B", "A" };
+    for (const char *name : names)
+        channels.insert(name, Imf::Channel(Imf::FLOAT));
+
+    /* Skip the border region */
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * cols();
+    char *ptr = const_cast<char *>(reinterpret_cast<const char *>(
+        &coeffRef(m_borderSize, m_borderSize)));
+
+    Imf::FrameBuffer frameBuffer;
+    for (const char *name : names) {
+        frameBuffer.insert(name, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+        ptr += compStride;
+    }
+
+    Imf::OutputFile file(filename.c_str(), header);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(m_size.y());
+}
+
+uint32_t ImageBlock::loadEXR(const std::string &filename, std::vector<uint32_t> *seeds) {
+    Imf::InputFile file(filename.c_str());
+    const Imf::Header &header = file.header();
+    const Imf::IntAttribute *sampleCount =
+        header.findTypedAttribute<Imf::IntAttribute>("sampleCount");
+    const char *names[] = { "R", "G", "B", "A" };
+    for (const char *name : names) {
+        if (!header.channels().findChannel(name) || !sampleCount)
+            throw NoriException("\"%s\" does not contain raw weighted samples!", filename);
+    }
+
+    if (seeds) {
+        seeds->clear();
+        const Imf::StringAttribute *seedList =
+            header.findTypedAttribute<Imf::StringAttribute>("seeds");
+        if (seedList) {
+            for (const std::string &seed : tokenize(seedList->value(), ","))
+                seeds->push_back(toUInt(seed));
+        }
+    }
+
+    Imath::Box2i dw = header.dataWindow();
+    init(Vector2i(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1), nullptr);
+
+    size_t compStride = sizeof(float),
+           pixelStride = sizeof(Color4f),
+           rowStride = pixelStride * cols();
+    char *ptr = reinterpret_cast<char *>(data())
+        - (dw.min.x * pixelStride + dw.min.y * rowStride);
+
+    Imf::FrameBuffer frameBuffer;
+    for (const char *name : names) {
+        frameBuffer.insert(name, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+        ptr += compStride;
+    }
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y, dw.max.y);
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+    return (uint32_t) sampleCount->value();
 }
 
 std::string ImageBlock::toString() const {
@@ -137,20 +310,132 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
+PixelStatistics::PixelStatistics(const Vector2i &size, float threshold, uint32_t minSamples)
+    : m_size(size), m_threshold(threshold), m_minSamples(minSamples) {
+    size_t pixelCount = (size_t) size.x() * size.y();
+    m_counts.resize(pixelCount, 0);
+    m_mean.resize(pixelCount, Color3f(0.0f));
+    m_m2.resize(pixelCount, Color3f(0.0f));
+    m_active.resize(pixelCount, 1);
+}
+
+void PixelStatistics::update() {
+    int width = m_size.x(), height = m_size.y();
+
+    /* Compare the standard error of each pixel's mean against its value */
+    std::vector<uint8_t> converged((size_t) width * height);
+    tbb::parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            size_t index = (size_t) y * width + x;
+            uint32_t n = m_counts[index];
+            if (n < m_minSamples || n < 2) {
+                converged[index] = 0;
+                continue;
+            }
+            Color3f error = (m_m2[index] / (float) ((uint64_t) n * (n - 1))).sqrt();
+            float value = std::max(m_mean[index].sum() / 3, 1e-2f);
+            converged[index] = error.sum() / 3 <= m_threshold * value ? 1 : 0;
+        }
+    });
+
+    /* A pixel stays active while any pixel of its 3x3 neighborhood has not converged */
+    tbb::parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; ++x) {
+            bool active = false;
+            for (int yo = std::max(y - 1, 0); yo <= std::min(y + 1, height - 1) && !active; ++yo)
+                for (int xo = std::max(x - 1, 0); xo <= std::min(x + 1, width - 1); ++xo)
+                    active |= !converged[(size_t) yo * width + xo];
+            m_active[(size_t) y * width + x] = active ? 1 : 0;
+        }
+    });
+}
+
+bool PixelStatistics::isActive(const ImageBlock &block) const {
+    const Point2i &offset = block.getOffset();
+    const Vector2i &size = block.getSize();
+    for (int y = offset.y(); y < offset.y() + size.y(); ++y)
+        for (int x = offset.x(); x < offset.x() + size.x(); ++x)
+            if (isActive(Point2i(x, y)))
+                return true;
+    return false;
+}
+
+uint64_t PixelStatistics::getTotalSampleCount() const {
+    uint64_t total = 0;
+    for (uint32_t count : m_counts)
+        total += count;
+    return total;
+}
+
+void PixelStatistics::saveState(std::ostream &os) const {
+    int32_t dims[2] = { m_size.x(), m_size.y() };
+    os.write((const char *) dims, sizeof(dims));
+    os.write((const char *) m_counts.data(), sizeof(uint32_t) * m_counts.size());
+    os.write((const char *) m_mean.data(), sizeof(Color3f) * m_mean.size());
+    os.write((const char *) m_m2.data(), sizeof(Color3f) * m_m2.size());
+    os.write((const char *) m_active.data(), sizeof(uint8_t) * m_active.size());
+}
+
+void PixelStatistics::loadState(std::istream &is) {
+    int32_t dims[2];
+    is.read((char *) dims, sizeof(dims));
+    if (!is.good() || dims[0] != m_size.x() || dims[1] != m_size.y())
+        throw NoriException("PixelStatistics::loadState(): the stored image has a different size!");
+    is.read((char *) m_counts.data(), sizeof(uint32_t) * m_counts.size());
+    is.read((char *) m_mean.data(), sizeof(Color3f) * m_mean.size());
+    is.read((char *) m_m2.data(), sizeof(Color3f) * m_m2.size());
+    is.read((char *) m_active.data(), sizeof(uint8_t) * m_active.size());
+}
+
 BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
         : m_size(size), m_blockSize(blockSize) {
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
+    m_finished.resize(m_numBlocks.x() * m_numBlocks.y(), false);
     reset();
 }
 
 void BlockGenerator::reset() {
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
+    tbb::mutex::scoped_lock lock(m_mutex);
+
+    m_blocksLeft = 0;
+    for (bool finished : m_finished)
+        m_blocksLeft += finished ? 0 : 1;
     m_direction = ERight;
     m_block = Point2i(m_numBlocks / 2);
     m_stepsLeft = 1;
     m_numSteps = 1;
+
+    if (m_blocksLeft > 0 && m_finished[m_block.y() * m_numBlocks.x() + m_block.x()])
+        advance();
+}
+
+void BlockGenerator::setFinished(uint32_t blockId) {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    m_finished[blockId] = true;
+}
+
+void BlockGenerator::saveState(std::ostream &os) const {
+    uint32_t count = (uint32_t) m_finished.size();
+    os.write((const char *) &count, sizeof(uint32_t));
+    for (bool finished : m_finished) {
+        uint8_t value = finished ? 1 : 0;
+        os.write((const char *) &value, sizeof(uint8_t));
+    }
+}
+
+void BlockGenerator::loadState(std::istream &is) {
+    uint32_t count;
+    is.read((char *) &count, sizeof(uint32_t));
+    if (!is.good() || count != m_finished.size())
+        throw NoriException("BlockGenerator::loadState(): the stored image has a different number of blocks!");
+    for (size_t i = 0; i < m_finished.size(); ++i) {
+        uint8_t value = 0;
+        is.read((char *) &value, sizeof(uint8_t));
+        m_finished[i] = value != 0;
+    }
+    reset();
 }
 
 bool BlockGenerator::next(ImageBlock &block) {
@@ -167,6 +452,12 @@ bool BlockGenerator::next(ImageBlock &block) {
     if (--m_blocksLeft == 0)
         return true;
 
+    advance();
+
+    return true;
+}
+
+void BlockGenerator::advance() {
     do {
         switch (m_direction) {
             case ERight: ++m_block.x(); break;
@@ -182,9 +473,8 @@ bool BlockGenerator::next(ImageBlock &block) {
             m_stepsLeft = m_numSteps;
         }
     } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
-
-    return true;
+             (m_block.array() >= m_numBlocks.array()).any() ||
+             m_finished[m_block.y() * m_numBlocks.x() + m_block.x()]);
 }
 
 NORI_NAMESPACE_END
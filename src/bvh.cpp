@@ -17,10 +17,28 @@
 */
 
 #include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/sphere.h>
 #include <nori/timer.h>
+#include <nori/simd.h>
+#include <nori/geometrycache.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
+#include <filesystem/resolver.h>
 #include <atomic>
+#include <fstream>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 /*
  * =======================================================================
@@ -42,26 +60,30 @@ struct Bins {
 };
 
 /**
- * \brief Build task for parallel BVH construction
+ * \brief Parallel binned SAH builder
  *
- * This class uses the task scheduling system of Intel' Thread Building Blocks
- * to parallelize the divide and conquer BVH build at all levels.
+ * Every node is split at the best of up to <tt>Bins::BIN_COUNT - 1</tt> candidate
+ * planes along each axis, which are evaluated by binning the primitive
+ * centroids (there is no sort-based fallback for small nodes). The
+ * primitives of large nodes are binned and partitioned by parallel loops,
+ * and the children of all but the smallest nodes are built concurrently
+ * using \c tbb::parallel_invoke, so that TBB's work stealing balances the
+ * load across all cores. Scratch memory for the parallel partitioning
+ * comes from per-thread arenas that are reused from node to node.
  *
  * The used methodology is roughly that described in
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  */
-class BVHBuildTask : public tbb::task {
-private:
-    BVH &bvh;
-    uint32_t node_idx;
-    uint32_t *start, *end, *temp;
-
+class BVHBuildTask {
 public:
     /// Build-related parameters
     enum {
-        /// Switch to a serial build when less than 32 triangles are left
-        SERIAL_THRESHOLD = 32,
+        /// Bin and partition the primitives of nodes with more than 16K primitives in parallel
+        PARALLEL_SPLIT_THRESHOLD = 16384,
+
+        /// Build the children of nodes with more than 512 primitives as separate tasks
+        PARALLEL_THRESHOLD = 512,
 
         /// Process triangles in batches of 1K for the purpose of parallelization
         GRAIN_SIZE = 1000,
@@ -73,392 +95,2957 @@ public:
         INTERSECTION_COST = 1
     };
 
-public:
+    BVHBuildTask(BVH &bvh) : bvh(bvh) { }
+
     /**
-     * Create a new build task
-     *
-     * \param bvh
-     *    Reference to the underlying BVH
+     * \brief Build the subtree rooted at the given node
      *
      * \param node_idx
-     *    Index of the BVH node that should be built
+     *    Index of the BVH node that should be built. Its bounding box must
+     *    already be set, and the subtree is written to the following
+     *    <tt>2*(end-start)-1</tt> entries of the (conservatively sized) node
+     *    array.
      *
      * \param start
-     *    Start pointer into a list of triangle indices to be processed
+     *    Start of the range of primitive indices to be processed
      *
      * \param end
-     *    End pointer into a list of triangle indices to be processed
+     *    End of the range of primitive indices to be processed
      *
-     *  \param temp
-     *    Pointer into a temporary memory region that can be used for
-     *    construction purposes. The usable length is <tt>end-start</tt>
-     *    unsigned integers.
+     * \param centroidBounds
+     *    Bounding box of the centroids of these primitives
      */
-    BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
-
-    task *execute() {
-        uint32_t size = (uint32_t) (end-start);
+    void build(uint32_t node_idx, uint32_t start, uint32_t end,
+               const BoundingBox3f &centroidBounds) {
+        uint32_t size = end - start;
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
+        uint32_t *indices = bvh.m_indices.data();
 
-        /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
-        if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+        if (size == 1) {
+            makeLeaf(node, start, size);
+            return;
         }
 
-        /* Always split along the largest axis */
-        int axis = node.bbox.getLargestAxis();
-        float min = node.bbox.min[axis], max = node.bbox.max[axis],
-              inv_bin_size = Bins::BIN_COUNT / (max-min);
-
-        /* Accumulate all triangles into bins */
-        Bins bins = tbb::parallel_reduce(
-            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
-            Bins(),
-            /* MAP: Bin a number of triangles and return the resulting 'Bins' data structure */
-            [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-
-                    int index = std::min(std::max(
-                        (int) ((centroid - min) * inv_bin_size), 0),
-                        (Bins::BIN_COUNT - 1));
-
-                    result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
-                }
-                return result;
-            },
-            /* REDUCE: Combine two 'Bins' data structures */
-            [](const Bins &b1, const Bins &b2) {
-                Bins result;
-                for (int i=0; i < Bins::BIN_COUNT; ++i) {
-                    result.counts[i] = b1.counts[i] + b2.counts[i];
-                    result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+        /* Small nodes use fewer bins, which makes their split
+           evaluation cheap. Axes along which all centroids
+           coincide cannot be split */
+        int binCount = (int) std::min(size, (uint32_t) Bins::BIN_COUNT);
+        float binScale[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+            binScale[axis] = extent > 0 ? binCount / extent : 0.0f;
+        }
+        auto binIndex = [&](float centroid, int axis) {
+            return std::min((int) ((centroid - centroidBounds.min[axis]) * binScale[axis]),
+                            binCount - 1);
+        };
+
+        /* Accumulate all triangles into bins along each axis */
+        auto binRange = [&](uint32_t rangeStart, uint32_t rangeEnd, BinSet &result) {
+            for (uint32_t i = rangeStart; i != rangeEnd; ++i) {
+                uint32_t f = indices[i];
+                const Point3f &centroid = bvh.getCentroid(f);
+                const BoundingBox3f &bbox = bvh.getBoundingBox(f);
+                for (int axis = 0; axis < 3; ++axis) {
+                    Bins &bins = result.axis[axis];
+                    int index = binIndex(centroid[axis], axis);
+                    bins.counts[index]++;
+                    bins.bbox[index].expandBy(bbox);
                 }
-                return result;
             }
-        );
-
-        /* Choose the best split plane based on the binned data */
-        BoundingBox3f bbox_left[Bins::BIN_COUNT];
-        bbox_left[0] = bins.bbox[0];
-        for (int i=1; i<Bins::BIN_COUNT; ++i) {
-            bins.counts[i] += bins.counts[i-1];
-            bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[i]);
+        };
+
+        BinSet bins;
+        if (size >= PARALLEL_SPLIT_THRESHOLD) {
+            bins = tbb::parallel_reduce(
+                tbb::blocked_range<uint32_t>(start, end, GRAIN_SIZE),
+                BinSet(),
+                /* MAP: Bin a number of triangles and return the resulting 'BinSet' data structure */
+                [&](const tbb::blocked_range<uint32_t> &range, BinSet result) {
+                    binRange(range.begin(), range.end(), result);
+                    return result;
+                },
+                /* REDUCE: Combine two 'BinSet' data structures */
+                [&](const BinSet &b1, const BinSet &b2) {
+                    BinSet result;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        const Bins &a1 = b1.axis[axis], &a2 = b2.axis[axis];
+                        Bins &r = result.axis[axis];
+                        for (int i = 0; i < binCount; ++i) {
+                            r.counts[i] = a1.counts[i] + a2.counts[i];
+                            r.bbox[i] = BoundingBox3f::merge(a1.bbox[i], a2.bbox[i]);
+                        }
+                    }
+                    return result;
+                }
+            );
+        } else {
+            binRange(start, end, bins);
         }
 
-        BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
-        int64_t best_index = -1;
+        /* Choose the best split plane based on the binned data */
         float best_cost = (float) INTERSECTION_COST * size;
         float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
+        int best_axis = -1, best_index = -1;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (binScale[axis] == 0)
+                continue;
+            const Bins &b = bins.axis[axis];
+
+            uint32_t count_left[Bins::BIN_COUNT];
+            float area_left[Bins::BIN_COUNT];
+            BoundingBox3f bbox_left;
+            for (int i = 0, count = 0; i < binCount; ++i) {
+                count += b.counts[i];
+                bbox_left.expandBy(b.bbox[i]);
+                count_left[i] = count;
+                area_left[i] = bbox_left.getSurfaceArea();
+            }
+
+            BoundingBox3f bbox_right;
+            for (int i = binCount - 2; i >= 0; --i) {
+                bbox_right.expandBy(b.bbox[i + 1]);
+                uint32_t prims_left = count_left[i], prims_right = size - count_left[i];
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
 
-        for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
-            float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                              prims_right * bbox_right.getSurfaceArea());
-            if (sah_cost < best_cost) {
-                best_cost = sah_cost;
-                best_index = i;
-                best_bbox_right = bbox_right;
+                float sah_cost = 2.0f * TRAVERSAL_COST +
+                    tri_factor * (prims_left * area_left[i] +
+                                  prims_right * bbox_right.getSurfaceArea());
+                if (sah_cost < best_cost) {
+                    best_cost = sah_cost;
+                    best_axis = axis;
+                    best_index = i;
+                }
             }
-            bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
         }
 
-        if (best_index == -1) {
-            /* Could not find a good split plane -- retry with
-               more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+        if (best_axis == -1) {
+            /* Splitting does not reduce the cost, make a leaf */
+            makeLeaf(node, start, size);
+            return;
         }
 
-        uint32_t left_count = bins.counts[best_index];
-        int node_idx_left = node_idx+1;
-        int node_idx_right = node_idx+2*left_count;
-
-        bvh.m_nodes[node_idx_left ].bbox = bbox_left[best_index];
-        bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = axis;
-        node.inner.flag = 0;
-
-        std::atomic<uint32_t> offset_left(0),
-                              offset_right(bins.counts[best_index]);
+        /* Bounding boxes of the two children */
+        const Bins &b = bins.axis[best_axis];
+        BoundingBox3f bbox_left, bbox_right;
+        uint32_t left_count = 0;
+        for (int i = 0; i < binCount; ++i) {
+            if (i <= best_index) {
+                bbox_left.expandBy(b.bbox[i]);
+                left_count += b.counts[i];
+            } else {
+                bbox_right.expandBy(b.bbox[i]);
+            }
+        }
 
-        tbb::parallel_for(
-            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
-            [&](const tbb::blocked_range<uint32_t> &range) {
-                uint32_t count_left = 0, count_right = 0;
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    (index <= best_index ? count_left : count_right)++;
+        auto isLeft = [&](uint32_t f) {
+            return binIndex(bvh.getCentroid(f)[best_axis], best_axis) <= best_index;
+        };
+
+        /* Partition the primitives, while computing the centroid bounds of the children */
+        BoundingBox3f centroids_left, centroids_right;
+        uint32_t mid = start + left_count;
+
+        if (size >= PARALLEL_SPLIT_THRESHOLD) {
+            /* Detach the scratch memory from the arena of this thread while it
+               is in use: the thread may execute other build tasks (which need
+               their own scratch memory) while waiting for the parallel loops */
+            std::vector<uint32_t> temp;
+            temp.swap(m_arena.local());
+            if (temp.size() < size)
+                temp.resize(size);
+
+            std::atomic<uint32_t> offset_left(0), offset_right(left_count);
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(start, end, GRAIN_SIZE),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    uint32_t count_left = 0;
+                    for (uint32_t i = range.begin(); i != range.end(); ++i)
+                        count_left += isLeft(indices[i]) ? 1 : 0;
+                    uint32_t idx_l = offset_left.fetch_add(count_left);
+                    uint32_t idx_r = offset_right.fetch_add((uint32_t) range.size() - count_left);
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        uint32_t f = indices[i];
+                        temp[isLeft(f) ? idx_l++ : idx_r++] = f;
+                    }
                 }
-                uint32_t idx_l = offset_left.fetch_add(count_left);
-                uint32_t idx_r = offset_right.fetch_add(count_right);
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    if (index <= best_index)
-                        temp[idx_l++] = f;
-                    else
-                        temp[idx_r++] = f;
+            );
+            assert(offset_left == left_count && offset_right == size);
+
+            typedef std::pair<BoundingBox3f, BoundingBox3f> BoundsPair;
+            BoundsPair centroids = tbb::parallel_reduce(
+                tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+                BoundsPair(),
+                [&](const tbb::blocked_range<uint32_t> &range, BoundsPair result) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        uint32_t f = temp[i];
+                        (i < left_count ? result.first : result.second)
+                            .expandBy(bvh.getCentroid(f));
+                        indices[start + i] = f;
+                    }
+                    return result;
+                },
+                [](const BoundsPair &b1, const BoundsPair &b2) {
+                    return BoundsPair(BoundingBox3f::merge(b1.first, b2.first),
+                                      BoundingBox3f::merge(b1.second, b2.second));
                 }
+            );
+            centroids_left = centroids.first;
+            centroids_right = centroids.second;
+
+            /* Return the scratch memory (keeping the larger one, in case
+               a nested task has left a buffer behind in the meantime) */
+            std::vector<uint32_t> &arena = m_arena.local();
+            if (arena.capacity() < temp.capacity())
+                arena.swap(temp);
+        } else {
+            uint32_t *left = indices + start, *right = indices + end;
+            while (true) {
+                while (left < right && isLeft(*left))
+                    centroids_left.expandBy(bvh.getCentroid(*left++));
+                while (left < right && !isLeft(*(right - 1)))
+                    centroids_right.expandBy(bvh.getCentroid(*--right));
+                if (left == right)
+                    break;
+                std::swap(*left, *(right - 1));
             }
-        );
-        memcpy(start, temp, size * sizeof(uint32_t));
-        assert(offset_left == left_count && offset_right == size);
+            assert(left == indices + mid);
+        }
 
-        /* Create an empty parent task */
-        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-        c.set_ref_count(2);
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        bvh.m_nodes[node_idx_left ].bbox = bbox_left;
+        bvh.m_nodes[node_idx_right].bbox = bbox_right;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
 
-        /* Post right subtree to scheduler */
-        BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                         end, temp + left_count);
-        spawn(b);
+        if (size >= PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { build(node_idx_left, start, mid, centroids_left); },
+                [&] { build(node_idx_right, mid, end, centroids_right); }
+            );
+        } else {
+            build(node_idx_left, start, mid, centroids_left);
+            build(node_idx_right, mid, end, centroids_right);
+        }
+    }
 
-        /* Directly start working on left subtree */
-        recycle_as_child_of(c);
-        node_idx = node_idx_left;
-        end = start + left_count;
+private:
+    /// Bins along all three axes
+    struct BinSet {
+        Bins axis[3];
+    };
 
-        return this;
+    static void makeLeaf(BVH::BVHNode &node, uint32_t start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.start = start;
+        node.leaf.size = size;
     }
 
-    /// Single-threaded build function
-    static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
-        BVH::BVHNode &node = bvh.m_nodes[node_idx];
-        uint32_t size = (uint32_t) (end - start);
-        float best_cost = (float) INTERSECTION_COST * size;
-        int64_t best_index = -1, best_axis = -1;
-        float *left_areas = (float *) temp;
-
-        /* Try splitting along every axis */
-        for (int axis=0; axis<3; ++axis) {
-            /* Sort all triangles based on their centroid positions projected on the axis */
-            std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
-            });
-
-            BoundingBox3f bbox;
-            for (uint32_t i = 0; i<size; ++i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-                left_areas[i] = (float) bbox.getSurfaceArea();
-            }
-            if (axis == 0)
-                node.bbox = bbox;
-
-            bbox.reset();
-
-            /* Choose the best split plane */
-            float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
-            for (uint32_t i = size-1; i>=1; --i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-
-                float left_area = left_areas[i-1];
-                float right_area = bbox.getSurfaceArea();
-                uint32_t prims_left = i;
-                uint32_t prims_right = size-i;
+private:
+    BVH &bvh;
+    /// Per-thread scratch memory used to partition large nodes
+    tbb::enumerable_thread_specific<std::vector<uint32_t>> m_arena;
+};
 
-                float sah_cost = 2.0f * TRAVERSAL_COST +
-                    tri_factor * (prims_left * left_area +
-                                  prims_right * right_area);
+/**
+ * \brief Spatial split BVH (SBVH) builder
+ *
+ * In addition to object splits, which partition the primitive references
+ * of a node, this builder considers spatial splits that cut the node with
+ * an axis-aligned plane and place references straddling the plane into
+ * both children (with their bounding boxes clipped to either side). This
+ * greatly reduces the overlap of sibling nodes in scenes with long and
+ * thin triangles. The number of duplicated references is limited by a
+ * budget that is distributed among the children of each split.
+ *
+ * The used methodology is that described in
+ * "Spatial Splits in Bounding Volume Hierarchies"
+ * by Martin Stich, Heiko Friedrich, and Andreas Dietrich (Proc. HPG 2009)
+ *
+ * Nodes are emitted directly in depth-first order, so that no
+ * compactification pass is needed afterwards.
+ */
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins used to evaluate object and spatial split candidates
+        BIN_COUNT = 32,
 
-                if (sah_cost < best_cost) {
-                    best_cost = sah_cost;
-                    best_index = i;
-                    best_axis = axis;
-                }
-            }
+        /// Evaluate all object splits along sorted centroids below 32 references
+        SWEEP_THRESHOLD = 32,
+
+        /// Build the children of nodes with more than 4K references in parallel
+        PARALLEL_THRESHOLD = 4096
+    };
+
+    /// A reference to a primitive, whose bounding box may have been clipped
+    struct Reference {
+        uint32_t prim;
+        BoundingBox3f bbox;
+    };
+
+    /// Nodes and indices of a subtree in depth-first order
+    struct Subtree {
+        std::vector<BVH::BVHNode> nodes;
+        std::vector<uint32_t> indices;
+        uint32_t spatialSplits = 0;
+    };
+
+    /**
+     * Create a new builder
+     *
+     * \param bvh
+     *    Reference to the underlying BVH
+     *
+     * \param rootArea
+     *    Surface area of the root node. Spatial splits are only attempted
+     *    when the children of the best object split overlap by more than a
+     *    small fraction of this area.
+     */
+    SBVHBuilder(const BVH &bvh, float rootArea)
+        : bvh(bvh), minOverlap(1e-5f * rootArea) { }
+
+    /**
+     * \brief Recursively build the subtree for a set of references
+     *
+     * \param refs
+     *    References to be processed (consumed by this function)
+     *
+     * \param bbox
+     *    Bounding box of all references
+     *
+     * \param budget
+     *    Number of reference duplicates that may be created in this subtree
+     *
+     * \param out
+     *    Output subtree, to which the new nodes are appended
+     */
+    void build(std::vector<Reference> &refs, const BoundingBox3f &bbox,
+               float budget, Subtree &out) const {
+        uint32_t size = (uint32_t) refs.size();
+        uint32_t node_idx = (uint32_t) out.nodes.size();
+        out.nodes.push_back(BVH::BVHNode()); /* Value-initialized, i.e. unused */
+        out.nodes[node_idx].bbox = bbox;
+
+        Split split;
+        split.cost = (float) BVHBuildTask::INTERSECTION_COST * size;
+        if (size > 1) {
+            findObjectSplit(refs, bbox, split);
+
+            /* Only look for spatial splits when the children of
+               the best object split overlap substantially */
+            BoundingBox3f overlap = split.left;
+            overlap.clip(split.right);
+            bool trySpatial = split.axis == -1 ||
+                (overlap.isValid() && overlap.getSurfaceArea() > minOverlap);
+
+            if (budget >= 1.0f && trySpatial)
+                findSpatialSplit(refs, bbox, budget, split);
+        }
+
+        std::vector<Reference> left, right;
+        if (split.axis != -1) {
+            if (split.spatial)
+                performSpatialSplit(refs, split, left, right);
+            else
+                performObjectSplit(refs, split, left, right);
         }
 
-        if (best_index == -1) {
+        if (left.empty() || right.empty()) {
             /* Splitting does not reduce the cost, make a leaf */
+            BVH::BVHNode &node = out.nodes[node_idx];
             node.leaf.flag = 1;
-            node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
-            node.leaf.size  = size;
+            node.leaf.start = (uint32_t) out.indices.size();
+            node.leaf.size = size;
+            for (const Reference &ref : refs)
+                out.indices.push_back(ref.prim);
             return;
         }
 
-        std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
-        });
+        if (split.spatial)
+            out.spatialSplits++;
+        std::vector<Reference>().swap(refs);
 
-        uint32_t left_count = (uint32_t) best_index;
-        uint32_t node_idx_left = node_idx + 1;
-        uint32_t node_idx_right = node_idx + 2 * left_count;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = best_axis;
+        BoundingBox3f bbox_left, bbox_right;
+        for (const Reference &ref : left)
+            bbox_left.expandBy(ref.bbox);
+        for (const Reference &ref : right)
+            bbox_right.expandBy(ref.bbox);
+
+        /* Distribute the remaining duplication budget */
+        uint32_t total = (uint32_t) (left.size() + right.size());
+        float remaining = std::max(0.0f, budget - (float) (total - size));
+        float budget_left = remaining * left.size() / (float) total,
+              budget_right = remaining - budget_left;
+
+        BVH::BVHNode &node = out.nodes[node_idx];
         node.inner.flag = 0;
+        node.inner.axis = split.axis;
+
+        if (size > PARALLEL_THRESHOLD) {
+            Subtree subtree_left, subtree_right;
+            tbb::parallel_invoke(
+                [&] { build(left, bbox_left, budget_left, subtree_left); },
+                [&] { build(right, bbox_right, budget_right, subtree_right); }
+            );
+            append(out, subtree_left);
+            out.nodes[node_idx].inner.rightChild = (uint32_t) out.nodes.size();
+            append(out, subtree_right);
+        } else {
+            build(left, bbox_left, budget_left, out);
+            out.nodes[node_idx].inner.rightChild = (uint32_t) out.nodes.size();
+            build(right, bbox_right, budget_right, out);
+        }
+    }
+
+private:
+    /// Best split candidate found so far
+    struct Split {
+        float cost;
+        int axis = -1;
+        bool spatial = false;
+        /// Object splits: index of the last bin (or sorted reference) on the left side
+        uint32_t index = 0;
+        /// Object splits: binning parameters
+        float binMin = 0, binScale = 0;
+        /// Spatial splits: position of the split plane
+        float pos = 0;
+        uint32_t count_left = 0, count_right = 0;
+        BoundingBox3f left, right;
+    };
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+    /// Compute the SAH cost of a split
+    static float sahCost(const BoundingBox3f &bbox, const BoundingBox3f &left, uint32_t count_left,
+                         const BoundingBox3f &right, uint32_t count_right) {
+        return 2.0f * BVHBuildTask::TRAVERSAL_COST +
+            BVHBuildTask::INTERSECTION_COST * (count_left * left.getSurfaceArea() +
+                count_right * right.getSurfaceArea()) / bbox.getSurfaceArea();
     }
-};
 
-void BVH::addShape(Shape *shape) {
-    m_shapes.push_back(shape);
-    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
-    m_bbox.expandBy(shape->getBoundingBox());
-}
+    /// Find the best object split along all three axes
+    void findObjectSplit(std::vector<Reference> &refs, const BoundingBox3f &bbox, Split &split) const {
+        uint32_t size = (uint32_t) refs.size();
+
+        if (size < SWEEP_THRESHOLD) {
+            /* Exact sweep over the sorted centroids */
+            BoundingBox3f bbox_left[SWEEP_THRESHOLD];
+            for (int axis = 0; axis < 3; ++axis) {
+                sortByCentroid(refs, axis);
+                BoundingBox3f accum;
+                for (uint32_t i = 0; i < size; ++i) {
+                    accum.expandBy(refs[i].bbox);
+                    bbox_left[i] = accum;
+                }
+                accum.reset();
+                for (uint32_t i = size - 1; i >= 1; --i) {
+                    accum.expandBy(refs[i].bbox);
+                    float cost = sahCost(bbox, bbox_left[i-1], i, accum, size - i);
+                    if (cost < split.cost) {
+                        split.cost = cost;
+                        split.axis = axis;
+                        split.index = i;
+                        split.count_left = i;
+                        split.count_right = size - i;
+                        split.left = bbox_left[i-1];
+                        split.right = accum;
+                    }
+                }
+            }
+            return;
+        }
 
-void BVH::clear() {
-    for (auto shape : m_shapes)
-        delete shape;
-    m_shapes.clear();
-    m_shapeOffset.clear();
-    m_shapeOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
-    m_bbox.reset();
-    m_nodes.shrink_to_fit();
-    m_shapes.shrink_to_fit();
-    m_shapeOffset.shrink_to_fit();
-    m_indices.shrink_to_fit();
-}
+        BoundingBox3f centroids;
+        for (const Reference &ref : refs)
+            centroids.expandBy(ref.bbox.getCenter());
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroids.min[axis], extent = centroids.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float scale = BIN_COUNT / extent;
+
+            uint32_t counts[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+            for (const Reference &ref : refs) {
+                int index = binIndex(ref.bbox.getCenter()[axis], min, scale);
+                counts[index]++;
+                bins[index].expandBy(ref.bbox);
+            }
 
-void BVH::build() {
-    uint32_t size  = getPrimitiveCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVH (" << m_shapes.size()
-        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
-        << size << " primitives) .. ";
-    cout.flush();
-    Timer timer;
+            BoundingBox3f bbox_left[BIN_COUNT];
+            uint32_t count_left[BIN_COUNT];
+            bbox_left[0] = bins[0];
+            count_left[0] = counts[0];
+            for (int i = 1; i < BIN_COUNT; ++i) {
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins[i]);
+                count_left[i] = count_left[i-1] + counts[i];
+            }
+
+            BoundingBox3f bbox_right = bins[BIN_COUNT - 1];
+            for (int i = BIN_COUNT - 2; i >= 0; --i) {
+                if (count_left[i] > 0 && count_left[i] < size) {
+                    float cost = sahCost(bbox, bbox_left[i], count_left[i],
+                                         bbox_right, size - count_left[i]);
+                    if (cost < split.cost) {
+                        split.cost = cost;
+                        split.axis = axis;
+                        split.index = (uint32_t) i;
+                        split.binMin = min;
+                        split.binScale = scale;
+                        split.count_left = count_left[i];
+                        split.count_right = size - count_left[i];
+                        split.left = bbox_left[i];
+                        split.right = bbox_right;
+                    }
+                }
+                bbox_right.expandBy(bins[i]);
+            }
+        }
+    }
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2*size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+    /// Find the best spatial split along all three axes
+    void findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                          float budget, Split &split) const {
+        uint32_t size = (uint32_t) refs.size();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = bbox.min[axis], extent = bbox.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float scale = BIN_COUNT / extent;
+
+            uint32_t enter[BIN_COUNT] = { 0 }, exit[BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BIN_COUNT];
+
+            /* Chop each reference into the bins that it overlaps */
+            for (const Reference &ref : refs) {
+                int first = binIndex(ref.bbox.min[axis], min, scale),
+                    last  = std::max(first, binIndex(ref.bbox.max[axis], min, scale));
+                enter[first]++;
+                exit[last]++;
+
+                if (first == last) {
+                    bins[first].expandBy(ref.bbox);
+                    continue;
+                }
+                for (int i = first; i <= last; ++i) {
+                    BoundingBox3f clip = ref.bbox;
+                    if (i > first)
+                        clip.min[axis] = min + i / scale;
+                    if (i < last)
+                        clip.max[axis] = min + (i + 1) / scale;
+                    bins[i].expandBy(clippedBoundingBox(ref.prim, clip));
+                }
+            }
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+            BoundingBox3f bbox_left[BIN_COUNT];
+            uint32_t count_left[BIN_COUNT];
+            bbox_left[0] = bins[0];
+            count_left[0] = enter[0];
+            for (int i = 1; i < BIN_COUNT; ++i) {
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins[i]);
+                count_left[i] = count_left[i-1] + enter[i];
+            }
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
+            BoundingBox3f bbox_right = bins[BIN_COUNT - 1];
+            uint32_t count_right = exit[BIN_COUNT - 1];
+            for (int i = BIN_COUNT - 2; i >= 0; --i) {
+                uint32_t duplicates = count_left[i] + count_right - size;
+                if (count_left[i] > 0 && count_right > 0 && duplicates <= budget) {
+                    float cost = sahCost(bbox, bbox_left[i], count_left[i],
+                                         bbox_right, count_right);
+                    if (cost < split.cost) {
+                        split.cost = cost;
+                        split.axis = axis;
+                        split.spatial = true;
+                        split.pos = min + (i + 1) / scale;
+                        split.count_left = count_left[i];
+                        split.count_right = count_right;
+                        split.left = bbox_left[i];
+                        split.right = bbox_right;
+                    }
+                }
+                bbox_right.expandBy(bins[i]);
+                count_right += exit[i];
+            }
+        }
+    }
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
+    /// Partition the references according to an object split
+    void performObjectSplit(std::vector<Reference> &refs, const Split &split,
+                            std::vector<Reference> &left, std::vector<Reference> &right) const {
+        if (refs.size() < SWEEP_THRESHOLD) {
+            sortByCentroid(refs, split.axis);
+            left.assign(refs.begin(), refs.begin() + split.index);
+            right.assign(refs.begin() + split.index, refs.end());
+            return;
+        }
 
-    /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
+        left.reserve(split.count_left);
+        right.reserve(split.count_right);
+        for (const Reference &ref : refs) {
+            int index = binIndex(ref.bbox.getCenter()[split.axis], split.binMin, split.binScale);
+            (index <= (int) split.index ? left : right).push_back(ref);
+        }
+    }
 
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
+    /**
+     * \brief Partition the references according to a spatial split
+     *
+     * References that straddle the split plane are either clipped into
+     * both children, or moved entirely into one child when this turns
+     * out to be cheaper ("reference unsplitting").
+     */
+    void performSpatialSplit(const std::vector<Reference> &refs, const Split &split,
+                             std::vector<Reference> &left, std::vector<Reference> &right) const {
+        int axis = split.axis;
+        BoundingBox3f bbox_left = split.left, bbox_right = split.right;
+        float count_left = (float) split.count_left, count_right = (float) split.count_right;
+
+        left.reserve(split.count_left);
+        right.reserve(split.count_right);
+
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= split.pos) {
+                left.push_back(ref);
+                continue;
+            } else if (ref.bbox.min[axis] >= split.pos) {
+                right.push_back(ref);
+                continue;
+            }
 
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
+            BoundingBox3f unsplit_left = BoundingBox3f::merge(bbox_left, ref.bbox),
+                          unsplit_right = BoundingBox3f::merge(bbox_right, ref.bbox);
+            float area_left = bbox_left.getSurfaceArea(),
+                  area_right = bbox_right.getSurfaceArea();
+            float cost_split = area_left * count_left + area_right * count_right,
+                  cost_left  = unsplit_left.getSurfaceArea() * count_left + area_right * (count_right - 1),
+                  cost_right = area_left * (count_left - 1) + unsplit_right.getSurfaceArea() * count_right;
+
+            if (cost_left < cost_split && cost_left <= cost_right) {
+                left.push_back(ref);
+                bbox_left = unsplit_left;
+                count_right -= 1;
+            } else if (cost_right < cost_split) {
+                right.push_back(ref);
+                bbox_right = unsplit_right;
+                count_left -= 1;
+            } else {
+                BoundingBox3f clip_left = ref.bbox, clip_right = ref.bbox;
+                clip_left.max[axis] = clip_right.min[axis] = split.pos;
+                Reference ref_left  { ref.prim, clippedBoundingBox(ref.prim, clip_left) },
+                          ref_right { ref.prim, clippedBoundingBox(ref.prim, clip_right) };
+
+                bool valid_left = ref_left.bbox.isValid(), valid_right = ref_right.bbox.isValid();
+                if (valid_left)
+                    left.push_back(ref_left);
+                if (valid_right)
+                    right.push_back(ref_right);
+                if (!valid_left && !valid_right)
+                    left.push_back(ref);
+            }
         }
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
 
-    m_nodes = std::move(compactified);
-}
+    /// Append a subtree that was built separately, adjusting all of its indices
+    static void append(Subtree &out, const Subtree &subtree) {
+        uint32_t node_offset = (uint32_t) out.nodes.size(),
+                 index_offset = (uint32_t) out.indices.size();
+        for (BVH::BVHNode node : subtree.nodes) {
+            if (node.isInner())
+                node.inner.rightChild += node_offset;
+            else
+                node.leaf.start += index_offset;
+            out.nodes.push_back(node);
+        }
+        out.indices.insert(out.indices.end(), subtree.indices.begin(), subtree.indices.end());
+        out.spatialSplits += subtree.spatialSplits;
+    }
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
-    const BVHNode &node = m_nodes[node_idx];
-    if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-    } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-        float saCur = node.bbox.getSurfaceArea();
-        float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
-            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-        return std::make_pair(
-            sahCost,
-            stats_left.second + stats_right.second + 1u
-        );
+    static int binIndex(float value, float min, float scale) {
+        return std::min(std::max((int) ((value - min) * scale), 0), BIN_COUNT - 1);
     }
-}
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    static void sortByCentroid(std::vector<Reference> &refs, int axis) {
+        std::sort(refs.begin(), refs.end(), [axis](const Reference &r1, const Reference &r2) {
+            return r1.bbox.min[axis] + r1.bbox.max[axis] < r2.bbox.min[axis] + r2.bbox.max[axis];
+        });
+    }
 
-    its.t = std::numeric_limits<float>::infinity();
+    BoundingBox3f clippedBoundingBox(uint32_t prim, const BoundingBox3f &clip) const {
+        uint32_t shapeIdx = bvh.findShape(prim);
+        return bvh.m_shapes[shapeIdx]->getClippedBoundingBox(prim, clip);
+    }
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+private:
+    const BVH &bvh;
+    float minOverlap;
+};
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+/**
+ * \brief Linear BVH (LBVH) builder
+ *
+ * Sorts the primitives along a Morton (Z-order) curve through their
+ * centroids and emits the binary radix tree over the sorted Morton codes,
+ * whose inner nodes can all be determined independently of each other.
+ * This is much faster than the binned SAH build, at the cost of a lower
+ * tree quality. Subtrees are collapsed into leaves wherever this reduces
+ * the SAH cost, and the tree can optionally be improved using local tree
+ * rotations before that.
+ *
+ * The radix tree has one level per bit of the 63-bit Morton codes plus
+ * those that separate duplicate codes, and the rotations can make it even
+ * deeper. Subtrees that would exceed \ref BVH::MAX_DEPTH are therefore
+ * replaced by balanced trees over their primitives.
+ *
+ * The used methodology is described in
+ * "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+ * by Tero Karras (Proc. HPG 2012) and
+ * "Tree Rotations for Improving Bounding Volume Hierarchies"
+ * by Andrew Kensler (Proc. IEEE Symposium on Interactive Ray Tracing 2008)
+ */
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Process the children of nodes with more than 4K primitives in parallel
+        PARALLEL_THRESHOLD = 4096,
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
+        /// Number of passes over the tree that apply rotations
+        ROTATION_PASSES = 3
+    };
 
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+    /// Create a new builder
+    LBVHBuilder(BVH &bvh) : bvh(bvh) { }
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
-        }
+    /**
+     * \brief Build the tree over the primitives cached in \c bvh
+     *
+     * Writes the nodes in depth-first order to <tt>bvh.m_nodes</tt> and
+     * the primitive indices referenced by the leaves to <tt>bvh.m_indices</tt>.
+     */
+    void build(bool rotate) {
+        uint32_t size = bvh.getPrimitiveCount();
+        m_size = size;
+
+        /* Compute the bounding box of all centroids */
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(bvh.getCentroid(i));
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
-        } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Shape *shape = m_shapes[findShape(idx)];
-
-                float u, v, t;
-                if (shape->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = shape;
-                    f = idx;
+        /* Sort the primitives by the Morton codes of their centroids. The
+           grid cells are cubes, otherwise flat scenes would be split along
+           their thin axis as often as along the other ones. */
+        float extent = centroidBounds.getExtents().maxCoeff();
+        float scale = extent > 0 ? (float) MORTON_RESOLUTION / extent : 0.0f;
+
+        m_keys.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Vector3f p = (bvh.getCentroid(i) - centroidBounds.min) * scale;
+                    uint64_t code = 0;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        uint32_t cell = std::min((uint32_t) std::max(p[axis], 0.0f),
+                                                 (uint32_t) MORTON_RESOLUTION - 1);
+                        code |= expandBits(cell) << (2 - axis);
+                    }
+                    m_keys[i] = MortonKey { code, i };
                 }
             }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
-        }
-    }
-
-    if (foundIntersection) {
-        its.mesh->setHitInformation(f,ray,its);
-    }
+        );
+        tbb::parallel_sort(m_keys.begin(), m_keys.end());
 
-    return foundIntersection;
+        /* Leaf i is stored at index size-1+i, following the size-1 inner nodes */
+        m_nodes.resize(2 * size - 1);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Node &leaf = m_nodes[size - 1 + i];
+                    leaf.child[0] = leaf.child[1] = INVALID;
+                    leaf.bbox = bvh.getBoundingBox(m_keys[i].prim);
+                    leaf.count = 1;
+                    if (i + 1 < size)
+                        buildInnerNode(i);
+                }
+            }
+        );
+
+        if (size > 1) {
+            updateBounds(0u);
+            if (rotate) {
+                for (int i = 0; i < ROTATION_PASSES; ++i)
+                    rotateSubtree(0u);
+            }
+        }
+        uint32_t root = size > 1 ? 0u : size - 1;
+        evaluateCost(root);
+        limitDepth(root, 0u);
+
+        bvh.m_nodes.resize(m_nodes[root].emitted);
+        bvh.m_indices.resize(size);
+        emit(root, 0u, 0u);
+    }
+
+private:
+    /// Morton code of a primitive, ties are broken using the primitive index
+    struct MortonKey {
+        uint64_t code;
+        uint32_t prim;
+
+        bool operator<(const MortonKey &key) const {
+            return code < key.code || (code == key.code && prim < key.prim);
+        }
+    };
+
+    /// Node of the radix tree
+    struct Node {
+        uint32_t child[2];
+        BoundingBox3f bbox;
+        uint32_t count;   ///< Number of primitives in the subtree
+        float cost;       ///< SAH cost of the subtree
+        uint32_t emitted; ///< Number of nodes that are emitted for the subtree
+        uint32_t height;  ///< Height of the emitted subtree
+        bool flatten;     ///< Emit the subtree as a single leaf?
+        bool balance;     ///< Emit a balanced tree over the primitives of the subtree?
+    };
+
+    enum {
+        /// Resolution of the Morton code along each axis (21 bits)
+        MORTON_RESOLUTION = 1 << 21,
+
+        INVALID = 0xFFFFFFFFu
+    };
+
+    /// Insert two zero bits after each of the lower 21 bits of \c x
+    static uint64_t expandBits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2)  & 0x1249249249249249ULL;
+        return x;
+    }
+
+    /// Length of the common prefix of the keys \c i and \c j (or -1 when \c j is out of range)
+    int commonPrefix(int64_t i, int64_t j) const {
+        if (j < 0 || j >= (int64_t) m_size)
+            return -1;
+        uint64_t a = m_keys[i].code, b = m_keys[j].code;
+        if (a == b)
+            return 64 + clz((uint64_t) (i ^ j));
+        return clz(a ^ b);
+    }
+
+    /// Count the leading zero bits of a nonzero value
+    static int clz(uint64_t x) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, x);
+        return 63 - (int) index;
+#else
+        return __builtin_clzll(x);
+#endif
+    }
+
+    /// Determine the key range and split position of the i-th inner node
+    void buildInnerNode(int64_t i) {
+        /* Direction of the range covered by this node */
+        int d = commonPrefix(i, i + 1) > commonPrefix(i, i - 1) ? 1 : -1;
+        int minPrefix = commonPrefix(i, i - d);
+
+        /* Find the other end of the range using exponential and binary search */
+        int64_t maxLength = 2;
+        while (commonPrefix(i, i + maxLength * d) > minPrefix)
+            maxLength *= 2;
+        int64_t length = 0;
+        for (int64_t t = maxLength / 2; t >= 1; t /= 2) {
+            if (commonPrefix(i, i + (length + t) * d) > minPrefix)
+                length += t;
+        }
+        int64_t j = i + length * d;
+
+        /* Find the split position, where the common prefix gets shorter */
+        int nodePrefix = commonPrefix(i, j);
+        int64_t split = 0;
+        for (int64_t t = length; t > 1; ) {
+            t = (t + 1) / 2;
+            if (commonPrefix(i, i + (split + t) * d) > nodePrefix)
+                split += t;
+        }
+        int64_t gamma = i + split * d + std::min(d, 0);
+
+        Node &node = m_nodes[i];
+        node.child[0] = (uint32_t) (std::min(i, j) == gamma ? m_size - 1 + gamma : gamma);
+        node.child[1] = (uint32_t) (std::max(i, j) == gamma + 1 ? m_size + gamma : gamma + 1);
+        node.count = (uint32_t) (length + 1);
+    }
+
+    bool isLeaf(uint32_t idx) const { return idx >= m_size - 1; }
+
+    /// Recursively run \c f on both children, in parallel for large subtrees
+    template <typename Func> void recurse(uint32_t idx, const Func &f) {
+        const Node &node = m_nodes[idx];
+        if (node.count > PARALLEL_THRESHOLD)
+            tbb::parallel_invoke([&] { f(node.child[0]); }, [&] { f(node.child[1]); });
+        else {
+            f(node.child[0]);
+            f(node.child[1]);
+        }
+    }
+
+    /// Compute the bounding boxes of all inner nodes
+    void updateBounds(uint32_t idx) {
+        if (isLeaf(idx))
+            return;
+        recurse(idx, [this](uint32_t child) { updateBounds(child); });
+        Node &node = m_nodes[idx];
+        node.bbox = BoundingBox3f::merge(m_nodes[node.child[0]].bbox, m_nodes[node.child[1]].bbox);
+    }
+
+    /**
+     * \brief Apply tree rotations bottom-up
+     *
+     * Swapping a child of a node with one of the children of its sibling
+     * only changes the bounding box of the sibling. The swap that reduces
+     * its surface area the most is performed.
+     */
+    void rotateSubtree(uint32_t idx) {
+        if (isLeaf(idx))
+            return;
+        recurse(idx, [this](uint32_t child) { rotateSubtree(child); });
+
+        Node &node = m_nodes[idx];
+        float bestArea = 0.0f;
+        int bestSibling = -1, bestGrandchild = -1;
+        for (int sibling = 0; sibling < 2; ++sibling) {
+            uint32_t siblingIdx = node.child[sibling];
+            if (isLeaf(siblingIdx))
+                continue;
+            const Node &s = m_nodes[siblingIdx];
+            const BoundingBox3f &other = m_nodes[node.child[1 - sibling]].bbox;
+            float area = s.bbox.getSurfaceArea();
+            for (int grandchild = 0; grandchild < 2; ++grandchild) {
+                /* Area of the sibling after swapping the other child of 'node' with 'grandchild' */
+                float newArea = BoundingBox3f::merge(other,
+                    m_nodes[s.child[1 - grandchild]].bbox).getSurfaceArea();
+                if (area - newArea > bestArea) {
+                    bestArea = area - newArea;
+                    bestSibling = sibling;
+                    bestGrandchild = grandchild;
+                }
+            }
+        }
+
+        if (bestSibling == -1)
+            return;
+
+        Node &s = m_nodes[node.child[bestSibling]];
+        std::swap(node.child[1 - bestSibling], s.child[bestGrandchild]);
+        s.bbox = BoundingBox3f::merge(m_nodes[s.child[0]].bbox, m_nodes[s.child[1]].bbox);
+        s.count = m_nodes[s.child[0]].count + m_nodes[s.child[1]].count;
+    }
+
+    /// Compute the SAH costs and decide which subtrees are collapsed into leaves
+    void evaluateCost(uint32_t idx) {
+        Node &node = m_nodes[idx];
+        node.balance = false;
+        if (isLeaf(idx)) {
+            node.cost = (float) BVHBuildTask::INTERSECTION_COST;
+            node.emitted = 1;
+            node.height = 0;
+            node.flatten = true;
+            return;
+        }
+        recurse(idx, [this](uint32_t child) { evaluateCost(child); });
+
+        const Node &left = m_nodes[node.child[0]], &right = m_nodes[node.child[1]];
+        float saCur = node.bbox.getSurfaceArea();
+        float innerCost = 2.0f * BVHBuildTask::TRAVERSAL_COST;
+        if (saCur > 0)
+            innerCost += (left.bbox.getSurfaceArea() * left.cost +
+                          right.bbox.getSurfaceArea() * right.cost) / saCur;
+        float leafCost = (float) BVHBuildTask::INTERSECTION_COST * node.count;
+
+        node.flatten = leafCost <= innerCost;
+        node.cost = node.flatten ? leafCost : innerCost;
+        node.emitted = node.flatten ? 1 : (1 + left.emitted + right.emitted);
+        node.height = node.flatten ? 0 : (1 + std::max(left.height, right.height));
+    }
+
+    /// Height of a balanced tree over \c count primitives (see \ref emitBalanced())
+    static uint32_t balancedHeight(uint32_t count) {
+        uint32_t height = 0;
+        while ((1ull << height) < count)
+            height++;
+        return height;
+    }
+
+    /**
+     * \brief Limit the depth of the emitted tree to <tt>BVH::MAX_DEPTH-1</tt>
+     *
+     * Descends into the subtrees that are too deep, as long as their
+     * balanced replacement would still fit, and marks the deepest such
+     * subtrees for balancing. This requires that the balanced tree over
+     * the subtree at \c idx fits, which always holds at the root.
+     */
+    void limitDepth(uint32_t idx, uint32_t depth) {
+        Node &node = m_nodes[idx];
+        if (node.flatten || depth + node.height < BVH::MAX_DEPTH)
+            return;
+
+        for (int i = 0; i < 2; ++i) {
+            const Node &child = m_nodes[node.child[i]];
+            if (depth + 1 + child.height >= BVH::MAX_DEPTH &&
+                depth + 1 + balancedHeight(child.count) >= BVH::MAX_DEPTH) {
+                node.balance = true;
+                node.emitted = 2 * node.count - 1;
+                node.height = balancedHeight(node.count);
+                return;
+            }
+        }
+
+        limitDepth(node.child[0], depth + 1);
+        limitDepth(node.child[1], depth + 1);
+        const Node &left = m_nodes[node.child[0]], &right = m_nodes[node.child[1]];
+        node.emitted = 1 + left.emitted + right.emitted;
+        node.height = 1 + std::max(left.height, right.height);
+    }
+
+    /// Choose the axis that separates two children the most (for front-to-back traversal)
+    static uint32_t splitAxis(const BoundingBox3f &left, const BoundingBox3f &right) {
+        Vector3f delta = (right.getCenter() - left.getCenter()).cwiseAbs();
+        uint32_t axis = 0;
+        for (int i = 1; i < 3; ++i)
+            if (delta[i] > delta[axis])
+                axis = (uint32_t) i;
+        return axis;
+    }
+
+    /// Append the primitives of a subtree to <tt>bvh.m_indices</tt>
+    void gatherPrimitives(uint32_t idx, uint32_t &offset) const {
+        if (isLeaf(idx)) {
+            bvh.m_indices[offset++] = m_keys[idx - (m_size - 1)].prim;
+        } else {
+            gatherPrimitives(m_nodes[idx].child[0], offset);
+            gatherPrimitives(m_nodes[idx].child[1], offset);
+        }
+    }
+
+    /// Write the subtree to <tt>bvh.m_nodes</tt> in depth-first order
+    void emit(uint32_t idx, uint32_t nodeOffset, uint32_t primOffset) {
+        const Node &node = m_nodes[idx];
+        BVH::BVHNode &out = bvh.m_nodes[nodeOffset];
+        out.bbox = node.bbox;
+
+        if (node.flatten) {
+            out.leaf.flag = 1;
+            out.leaf.start = primOffset;
+            out.leaf.size = node.count;
+            gatherPrimitives(idx, primOffset);
+            return;
+        }
+
+        if (node.balance) {
+            uint32_t primEnd = primOffset;
+            gatherPrimitives(idx, primEnd);
+            emitBalanced(nodeOffset, primOffset, primEnd);
+            return;
+        }
+
+        const Node &left = m_nodes[node.child[0]], &right = m_nodes[node.child[1]];
+        uint32_t rightOffset = nodeOffset + 1 + left.emitted;
+        out.inner.flag = 0;
+        out.inner.axis = splitAxis(left.bbox, right.bbox);
+        out.inner.rightChild = rightOffset;
+
+        uint32_t rightPrimOffset = primOffset + left.count;
+        if (node.count > PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { emit(node.child[0], nodeOffset + 1, primOffset); },
+                [&] { emit(node.child[1], rightOffset, rightPrimOffset); }
+            );
+        } else {
+            emit(node.child[0], nodeOffset + 1, primOffset);
+            emit(node.child[1], rightOffset, rightPrimOffset);
+        }
+    }
+
+    /**
+     * \brief Write a balanced tree with one primitive per leaf over
+     * <tt>bvh.m_indices[start..end)</tt>, which are in the order of the
+     * radix tree, and return its bounding box
+     */
+    const BoundingBox3f &emitBalanced(uint32_t nodeOffset, uint32_t start, uint32_t end) {
+        BVH::BVHNode &out = bvh.m_nodes[nodeOffset];
+        if (end - start == 1) {
+            out.bbox = bvh.getBoundingBox(bvh.m_indices[start]);
+            out.leaf.flag = 1;
+            out.leaf.start = start;
+            out.leaf.size = 1;
+            return out.bbox;
+        }
+
+        uint32_t mid = start + (end - start) / 2;
+        uint32_t rightOffset = nodeOffset + 2 * (mid - start);
+        const BoundingBox3f &left = emitBalanced(nodeOffset + 1, start, mid);
+        const BoundingBox3f &right = emitBalanced(rightOffset, mid, end);
+        out.bbox = BoundingBox3f::merge(left, right);
+        out.inner.flag = 0;
+        out.inner.axis = splitAxis(left, right);
+        out.inner.rightChild = rightOffset;
+        return out.bbox;
+    }
+
+private:
+    BVH &bvh;
+    uint32_t m_size = 0;
+    std::vector<MortonKey> m_keys;
+    std::vector<Node> m_nodes;
+};
+
+BVH::BVH(const PropertyList &propList) : m_lastOccluder((uint32_t) -1) {
+    m_shapeOffset.push_back(0u);
+
+    std::string layout = toLower(propList.getString("bvhLayout", "binary"));
+    if (layout == "binary")
+        m_layout = EBinary;
+    else if (layout == "bvh4")
+        m_layout = EWide4;
+    else if (layout == "bvh8")
+        m_layout = EWide8;
+    else
+        throw NoriException("BVH: unknown layout \"%s\" (expected \"binary\", "
+                            "\"bvh4\", or \"bvh8\")", layout);
+
+    m_useCache = propList.getBoolean("bvhCache", false);
+    m_precomputeTriangles = propList.getBoolean("bvhPrecomputeTriangles", false);
+    m_occluderCache = propList.getBoolean("bvhOccluderCache", false);
+    m_spatialSplits = propList.getBoolean("bvhSpatialSplits", false);
+    m_splitBudget = propList.getFloat("bvhSplitBudget", 0.3f);
+    if (m_splitBudget < 0)
+        throw NoriException("BVH: the spatial split budget must be nonnegative!");
+    std::string quality = toLower(propList.getString("bvhQuality", "high"));
+    if (quality == "low")
+        m_quality = ELowQuality;
+    else if (quality == "medium")
+        m_quality = EMediumQuality;
+    else if (quality == "high")
+        m_quality = EHighQuality;
+    else
+        throw NoriException("BVH: unknown build quality \"%s\" (expected \"low\", "
+                            "\"medium\", or \"high\")", quality);
+
+    m_rebuildThreshold = propList.getFloat("bvhRebuildThreshold", 1.5f);
+    if (m_rebuildThreshold < 0)
+        throw NoriException("BVH: the rebuild threshold must be nonnegative!");
+
+    m_compressNodes = propList.getBoolean("bvhCompressNodes", false);
+    if (m_compressNodes && m_layout == EBinary)
+        throw NoriException("BVH: compressed nodes require the \"bvh4\" or \"bvh8\" layout!");
+}
+
+void BVH::addShape(Shape *shape) {
+    m_shapes.push_back(shape);
+    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
+    m_bbox.expandBy(shape->getBoundingBox());
+}
+
+void BVH::clear() {
+    for (auto shape : m_shapes)
+        delete shape;
+    m_shapes.clear();
+    m_shapeOffset.clear();
+    m_shapeOffset.push_back(0u);
+    m_nodes.clear();
+    m_indices.clear();
+    m_refShapes.clear();
+    m_refPrims.clear();
+    m_triangleBlocks.clear();
+    m_sphereBlocks.clear();
+    m_leafBlocks.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_quantizedNodes4.clear();
+    m_quantizedNodes8.clear();
+    m_nodeCosts.clear();
+    m_bbox.reset();
+    m_nodes.shrink_to_fit();
+    m_shapes.shrink_to_fit();
+    m_shapeOffset.shrink_to_fit();
+    m_indices.shrink_to_fit();
+    m_refShapes.shrink_to_fit();
+    m_refPrims.shrink_to_fit();
+    m_triangleBlocks.shrink_to_fit();
+    m_sphereBlocks.shrink_to_fit();
+    m_leafBlocks.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_quantizedNodes4.shrink_to_fit();
+    m_quantizedNodes8.shrink_to_fit();
+    m_nodeCosts.shrink_to_fit();
+}
+
+struct BVH::ResidentTree {
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> refShapes;
+    std::vector<uint32_t> refPrims;
+    uint64_t primitiveCount;
+    uint64_t vertexCount;
+};
+
+void BVH::build() {
+    m_nodeCosts.clear();
+    if (getPrimitiveCount() == 0)
+        return;
+
+    /* The shapes may have moved since they were added (when rebuilding) */
+    m_bbox.reset();
+    for (auto shape : m_shapes)
+        m_bbox.expandBy(shape->getBoundingBox());
+
+    /* Reuse the tree of an earlier scene with the same geometry if possible.
+       Hashing reads all vertices and indices, so it is only done once */
+    GeometryCache *residentCache = getGeometryCache();
+    uint64_t hash = residentCache->isEnabled() || m_useCache ? getCacheHash() : 0;
+    std::shared_ptr<const ResidentTree> tree;
+    if (residentCache->isEnabled()) {
+        tree = residentCache->getTree(hash);
+        /* Guard against hash collisions */
+        if (tree && (tree->primitiveCount != getPrimitiveCount() ||
+                     tree->vertexCount != getVertexCount()))
+            tree = nullptr;
+    }
+
+    if (tree) {
+        m_nodes = tree->nodes;
+        m_refShapes = tree->refShapes;
+        m_refPrims = tree->refPrims;
+        cout << "Reusing a resident BVH (" << m_nodes.size() << " nodes)." << endl;
+    } else {
+        if (m_useCache) {
+            filesystem::path cachePath = getCachePath(hash);
+            if (!loadCache(cachePath, hash)) {
+                buildTree();
+                saveCache(cachePath, hash);
+            }
+        } else {
+            buildTree();
+        }
+
+        if (residentCache->isEnabled()) {
+            std::shared_ptr<ResidentTree> copy(new ResidentTree());
+            copy->nodes = m_nodes;
+            copy->refShapes = m_refShapes;
+            copy->refPrims = m_refPrims;
+            copy->primitiveCount = getPrimitiveCount();
+            copy->vertexCount = getVertexCount();
+            residentCache->putTree(hash, copy);
+        }
+    }
+
+    buildLayout();
+}
+
+void BVH::buildTree() {
+    uint32_t size  = getPrimitiveCount();
+    cout << (m_quality == EHighQuality ? "Constructing a SAH BVH (" : "Constructing a linear BVH (")
+        << m_shapes.size()
+        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << size << " primitives) .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Cache the bounding boxes and centroids of all primitives, which saves
+       a shape lookup and a virtual function call per access during the build */
+    m_primBounds.resize(size);
+    m_centroids.resize(size);
+    for (size_t shapeIdx = 0; shapeIdx < m_shapes.size(); ++shapeIdx) {
+        const Shape *shape = m_shapes[shapeIdx];
+        uint32_t offset = m_shapeOffset[shapeIdx];
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, shape->getPrimitiveCount(), BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_primBounds[offset + i] = shape->getBoundingBox(i);
+                    m_centroids[offset + i] = shape->getCentroid(i);
+                }
+            }
+        );
+    }
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+    std::pair<float, uint32_t> stats;
+    if (m_quality == EHighQuality) {
+        /* Conservative estimate for the total number of nodes, which
+           are value-initialized, i.e. unused (see BVHNode::isUnused()) */
+        m_nodes.assign(2*size, BVHNode());
+        m_nodes[0].bbox = m_bbox;
+        m_indices.resize(size);
+
+        for (uint32_t i = 0; i < size; ++i)
+            m_indices[i] = i;
+
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(m_centroids[i]);
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        BVHBuildTask(*this).build(0u, 0u, size, centroidBounds);
+        stats = statistics();
+
+        /* The node array was allocated conservatively and now contains
+           many unused entries -- do a compactification pass. */
+        std::vector<BVHNode> compactified(stats.second);
+        std::vector<uint32_t> skipped_accum(m_nodes.size());
+
+        for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
+            while (m_nodes[--j].isUnused())
+                skipped++;
+            BVHNode &new_node = compactified[i];
+            new_node = m_nodes[j];
+            skipped_accum[j] = (uint32_t) skipped;
+
+            if (new_node.isInner()) {
+                new_node.inner.rightChild = (uint32_t)
+                    (i + new_node.inner.rightChild - j -
+                    (skipped - skipped_accum[new_node.inner.rightChild]));
+            }
+        }
+
+        m_nodes = std::move(compactified);
+    } else {
+        LBVHBuilder(*this).build(m_quality == EMediumQuality);
+        stats = statistics();
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
+        << ", SAH cost = " << stats.first
+        << ")." << endl;
+
+    if (m_spatialSplits) {
+        cout << "Rebuilding with spatial splits .. ";
+        cout.flush();
+        timer.reset();
+
+        std::vector<SBVHBuilder::Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    refs[i] = SBVHBuilder::Reference { i, getBoundingBox(i) };
+            }
+        );
+
+        SBVHBuilder::Subtree tree;
+        SBVHBuilder(*this, m_bbox.getSurfaceArea()).build(refs, m_bbox, m_splitBudget * size, tree);
+        m_nodes = std::move(tree.nodes);
+        m_indices = std::move(tree.indices);
+        float sahCost = statistics().first;
+
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
+            << ", " << tree.spatialSplits << " spatial splits, "
+            << (m_indices.size() - size) << " duplicated references, SAH cost = "
+            << stats.first << " -> " << sahCost << ")." << endl;
+    }
+
+    buildReferences();
+}
+
+void BVH::buildReferences() {
+    /* Sort the primitives of each leaf, which groups them by shape */
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0u, m_nodes.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                const BVHNode &node = m_nodes[i];
+                if (node.isLeaf())
+                    std::sort(m_indices.begin() + node.start(), m_indices.begin() + node.end());
+            }
+        }
+    );
+
+    m_refShapes.resize(m_indices.size());
+    m_refPrims.resize(m_indices.size());
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0u, m_indices.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t idx = m_indices[i];
+                m_refShapes[i] = findShape(idx);
+                m_refPrims[i] = idx;
+            }
+        }
+    );
+
+    /* Release the temporary build data */
+    std::vector<uint32_t>().swap(m_indices);
+    std::vector<BoundingBox3f>().swap(m_primBounds);
+    std::vector<Point3f>().swap(m_centroids);
+}
+
+void BVH::buildLayout() {
+    /* The traversal stacks have room for MAX_DEPTH-1 entries. The linear
+       builder limits the depth of its trees, the SAH builders can only
+       exceed it for pathological inputs (and trees loaded from a cache
+       might be corrupt) */
+    uint32_t treeDepth = depth();
+    if (treeDepth >= MAX_DEPTH)
+        throw NoriException("BVH::build(): the tree has a depth of %i, which exceeds "
+                            "the maximum of %i supported by the traversal!",
+                            treeDepth, MAX_DEPTH - 1);
+
+    m_leafBlocks.clear();
+    m_triangleBlocks.clear();
+    m_sphereBlocks.clear();
+    if (m_precomputeTriangles)
+        buildTriangleBlocks();
+    buildSphereBlocks();
+
+    if (m_layout == EWide4 || m_layout == EWide8) {
+        Timer timer;
+        int width = m_layout == EWide4 ? 4 : 8;
+        cout << "Collapsing into a " << (m_compressNodes ? "compressed " : "")
+             << width << "-wide BVH .. ";
+        cout.flush();
+
+        size_t nodeCount, nodeSize, quantizedSize = 0;
+        bool compressed = false;
+        if (m_layout == EWide4) {
+            m_nodes4.clear();
+            collapse<4>(m_nodes4, 0u);
+            nodeCount = m_nodes4.size(); nodeSize = sizeof(BVHWideNode<4>);
+            if (m_compressNodes && quantize<4>(m_nodes4, m_quantizedNodes4)) {
+                BVH4NodeArray().swap(m_nodes4);
+                quantizedSize = sizeof(BVHQuantizedNode<4>);
+                compressed = true;
+            }
+        } else {
+            m_nodes8.clear();
+            collapse<8>(m_nodes8, 0u);
+            nodeCount = m_nodes8.size(); nodeSize = sizeof(BVHWideNode<8>);
+            if (m_compressNodes && quantize<8>(m_nodes8, m_quantizedNodes8)) {
+                BVH8NodeArray().swap(m_nodes8);
+                quantizedSize = sizeof(BVHQuantizedNode<8>);
+                compressed = true;
+            }
+        }
+
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString((compressed ? quantizedSize : nodeSize) * nodeCount)
+            << ", " << nodeCount << " nodes";
+        if (compressed)
+            cout << ", saved " << memString((nodeSize - quantizedSize) * nodeCount);
+        cout << ")." << endl;
+
+        if (m_compressNodes && !compressed)
+            cerr << "Warning: the BVH has leaves with more than 65535 primitives, "
+                    "falling back to uncompressed nodes." << endl;
+    }
+}
+
+void BVH::buildTriangleBlocks() {
+    cout << "Precomputing triangle data .. ";
+    cout.flush();
+    Timer timer;
+
+    std::vector<const Mesh *> meshes(m_shapes.size());
+    for (size_t i = 0; i < m_shapes.size(); ++i)
+        meshes[i] = dynamic_cast<const Mesh *>(m_shapes[i]);
+
+    if (m_leafBlocks.empty())
+        m_leafBlocks.assign(m_refShapes.size(), (uint32_t) -1);
+    uint32_t leafCount = 0;
+
+    for (const BVHNode &node : m_nodes) {
+        if (!node.isLeaf() || node.leaf.size == 0)
+            continue;
+
+        bool triangles = true;
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            triangles &= meshes[m_refShapes[i]] != nullptr;
+        if (!triangles)
+            continue;
+
+        m_leafBlocks[node.start()] = (uint32_t) m_triangleBlocks.size();
+        leafCount++;
+
+        for (uint32_t i = node.start(); i < node.end(); i += 4) {
+            TriangleBlock block;
+            memset(&block, 0, sizeof(TriangleBlock));
+            for (uint32_t j = 0; j < 4; ++j) {
+                if (i + j >= node.end()) {
+                    block.ref[j] = (uint32_t) -1;
+                    continue;
+                }
+                uint32_t ref = i + j, prim = m_refPrims[ref];
+                const Mesh *mesh = meshes[m_refShapes[ref]];
+                const MatrixXf &V = mesh->getVertexPositions();
+                const MatrixXu &F = mesh->getIndices();
+                Point3f p0 = V.col(F(0, prim)), p1 = V.col(F(1, prim)), p2 = V.col(F(2, prim));
+                Vector3f e1 = p1 - p0, e2 = p2 - p0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    block.p0[axis][j] = p0[axis];
+                    block.e1[axis][j] = e1[axis];
+                    block.e2[axis][j] = e2[axis];
+                }
+                block.ref[j] = ref;
+            }
+            m_triangleBlocks.push_back(block);
+        }
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(TriangleBlock) * m_triangleBlocks.size() + sizeof(uint32_t) * m_leafBlocks.size())
+        << ", " << leafCount << " leaves)." << endl;
+}
+
+void BVH::buildSphereBlocks() {
+    std::vector<const Sphere *> spheres(m_shapes.size());
+    bool hasSpheres = false;
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        spheres[i] = dynamic_cast<const Sphere *>(m_shapes[i]);
+        hasSpheres |= spheres[i] != nullptr;
+    }
+    if (!hasSpheres)
+        return;
+
+    cout << "Precomputing sphere data .. ";
+    cout.flush();
+    Timer timer;
+
+    if (m_leafBlocks.empty())
+        m_leafBlocks.assign(m_refShapes.size(), (uint32_t) -1);
+    uint32_t leafCount = 0;
+
+    for (const BVHNode &node : m_nodes) {
+        /* Single spheres are intersected just as fast without a block */
+        if (!node.isLeaf() || node.leaf.size < 2)
+            continue;
+
+        bool allSpheres = true;
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            allSpheres &= spheres[m_refShapes[i]] != nullptr;
+        if (!allSpheres)
+            continue;
+
+        m_leafBlocks[node.start()] = (uint32_t) m_sphereBlocks.size() | SPHERE_BLOCK_FLAG;
+        leafCount++;
+
+        for (uint32_t i = node.start(); i < node.end(); i += 4) {
+            SphereBlock block;
+            memset(&block, 0, sizeof(SphereBlock));
+            for (uint32_t j = 0; j < 4; ++j) {
+                if (i + j >= node.end()) {
+                    block.radius2[j] = -1.0f;
+                    block.ref[j] = (uint32_t) -1;
+                    continue;
+                }
+                const Sphere *sphere = spheres[m_refShapes[i + j]];
+                for (int axis = 0; axis < 3; ++axis)
+                    block.center[axis][j] = sphere->getCenter()[axis];
+                block.radius2[j] = sphere->getRadius() * sphere->getRadius();
+                block.ref[j] = i + j;
+            }
+            m_sphereBlocks.push_back(block);
+        }
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(SphereBlock) * m_sphereBlocks.size())
+        << ", " << leafCount << " leaves)." << endl;
+}
+
+/// Header of the on-disk BVH cache
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t hash;
+    uint64_t primitiveCount;
+    uint64_t vertexCount;
+    uint64_t nodeCount;
+    uint64_t indexCount;
+};
+
+static const char BVH_CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+
+/// Increase when the file format or the build algorithms change
+static const uint32_t BVH_CACHE_VERSION = 4;
+
+/// Read-only memory mapping of an entire file
+class MemoryMappedFile {
+public:
+    MemoryMappedFile(const filesystem::path &filename) {
+#if defined(_WIN32)
+        m_file = CreateFileW(filename.wstr().c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping)
+            return;
+        m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_data)
+            m_size = (size_t) size.QuadPart;
+#else
+        int fd = open(filename.str().c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+            void *data = mmap(nullptr, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = data;
+                m_size = (size_t) sb.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MemoryMappedFile() {
+#if defined(_WIN32)
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data)
+            munmap(m_data, m_size);
+#endif
+    }
+
+    const uint8_t *data() const { return (const uint8_t *) m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    void *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+};
+
+uint64_t BVH::getCacheHash() const {
+    uint32_t params[] = {
+        BVH_CACHE_VERSION, (uint32_t) sizeof(BVHNode),
+        (uint32_t) m_shapes.size(), m_spatialSplits ? 1u : 0u, (uint32_t) m_quality
+    };
+    uint64_t hash = hashBuffer(params, sizeof(params));
+    if (m_spatialSplits)
+        hash = hashBuffer(&m_splitBudget, sizeof(float), hash);
+
+    for (const Shape *shape : m_shapes) {
+        uint64_t shapeHash[2] = { shape->getPrimitiveCount(), shape->getGeometryHash() };
+        hash = hashBuffer(shapeHash, sizeof(shapeHash), hash);
+    }
+    return hash;
+}
+
+uint64_t BVH::getVertexCount() const {
+    uint64_t count = 0;
+    for (const Shape *shape : m_shapes) {
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(shape))
+            count += mesh->getVertexCount();
+    }
+    return count;
+}
+
+filesystem::path BVH::getCachePath(uint64_t hash) const {
+    /* The first entry of the file resolver is the directory of the scene */
+    const filesystem::resolver *resolver = getFileResolver();
+    filesystem::path dir = resolver->size() > 0 ? *resolver->begin() : filesystem::path();
+    return dir / filesystem::path(tfm::format("bvhcache-%016x.bin", hash));
+}
+
+bool BVH::loadCache(const filesystem::path &filename, uint64_t hash) {
+    if (!filename.exists())
+        return false;
+
+    cout << "Loading cached BVH from \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    MemoryMappedFile file(filename);
+    const BVHCacheHeader *header = (const BVHCacheHeader *) file.data();
+    bool valid = file.size() >= sizeof(BVHCacheHeader) &&
+        memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) == 0 &&
+        header->version == BVH_CACHE_VERSION &&
+        header->nodeSize == sizeof(BVHNode) &&
+        header->hash == hash &&
+        header->primitiveCount == getPrimitiveCount() &&
+        header->vertexCount == getVertexCount() &&
+        header->nodeCount > 0 &&
+        file.size() == sizeof(BVHCacheHeader) + header->nodeCount * sizeof(BVHNode)
+                       + header->indexCount * 2 * sizeof(uint32_t);
+
+    if (valid) {
+        /* The arrays are copied out of the mapping, since refits and the
+           wide layouts modify or are derived from them */
+        const BVHNode *nodes = (const BVHNode *) (file.data() + sizeof(BVHCacheHeader));
+        const uint32_t *shapes = (const uint32_t *) (nodes + header->nodeCount),
+                       *prims = shapes + header->indexCount;
+        m_nodes.assign(nodes, nodes + header->nodeCount);
+        m_refShapes.assign(shapes, shapes + header->indexCount);
+        m_refPrims.assign(prims, prims + header->indexCount);
+
+        /* Guard against corrupted files, which could otherwise crash the traversal */
+        for (size_t i = 0; i < m_refShapes.size(); ++i)
+            valid &= m_refShapes[i] < m_shapes.size() &&
+                     m_refPrims[i] < m_shapes[m_refShapes[i]]->getPrimitiveCount();
+        for (size_t i = 0; i < m_nodes.size(); ++i) {
+            const BVHNode &node = m_nodes[i];
+            if (node.isInner())
+                valid &= node.inner.rightChild > i + 1 && node.inner.rightChild < m_nodes.size() &&
+                         node.inner.axis < 3;
+            else
+                valid &= (uint64_t) node.start() + node.leaf.size <= m_refShapes.size();
+        }
+    }
+
+    if (!valid) {
+        cout << "invalid, rebuilding." << endl;
+        m_nodes.clear();
+        m_refShapes.clear();
+        m_refPrims.clear();
+        return false;
+    }
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(BVHNode) * m_nodes.size() + 2 * sizeof(uint32_t) * m_refShapes.size())
+        << ", SAH cost = " << statistics().first << ")." << endl;
+    return true;
+}
+
+void BVH::saveCache(const filesystem::path &filename, uint64_t hash) const {
+    BVHCacheHeader header;
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    header.version = BVH_CACHE_VERSION;
+    header.nodeSize = (uint32_t) sizeof(BVHNode);
+    header.hash = hash;
+    header.primitiveCount = getPrimitiveCount();
+    header.vertexCount = getVertexCount();
+    header.nodeCount = m_nodes.size();
+    header.indexCount = m_refShapes.size();
+
+    /* Write to a temporary file first, so that concurrently
+       started renderers never see an incomplete cache */
+    std::string tempName = filename.str() + ".tmp";
+    std::ofstream os(tempName, std::ios::binary);
+    os.write((const char *) &header, sizeof(BVHCacheHeader));
+    os.write((const char *) m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+    os.write((const char *) m_refShapes.data(), sizeof(uint32_t) * m_refShapes.size());
+    os.write((const char *) m_refPrims.data(), sizeof(uint32_t) * m_refPrims.size());
+    os.close();
+
+    if (!os.good()) {
+        cerr << "Warning: unable to write the BVH cache file \"" << tempName << "\"" << endl;
+        std::remove(tempName.c_str());
+        return;
+    }
+
+    std::remove(filename.str().c_str());
+    if (std::rename(tempName.c_str(), filename.str().c_str()) != 0) {
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"" << endl;
+        std::remove(tempName.c_str());
+    }
+}
+
+void BVH::refit() {
+    if (m_nodes.empty())
+        return;
+
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        if (m_shapeOffset[i + 1] - m_shapeOffset[i] != m_shapes[i]->getPrimitiveCount())
+            throw NoriException("BVH::refit(): the number of primitives has changed!");
+    }
+
+    cout << "Refitting the BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    /* The costs of the tree as it was built serve as a reference */
+    uint32_t nodeCount = (uint32_t) m_nodes.size();
+    if (m_nodeCosts.size() != nodeCount) {
+        m_nodeCosts.resize(nodeCount);
+        refitSubtree(0u, nodeCount, m_nodeCosts, false);
+    }
+    float referenceCost = m_nodeCosts[0];
+
+    std::vector<float> costs(nodeCount);
+    refitSubtree(0u, nodeCount, costs, true);
+    m_bbox = m_nodes[0].bbox;
+
+    std::vector<std::pair<uint32_t, uint32_t>> subtrees;
+    uint32_t rebuiltRefs = 0;
+    if (m_rebuildThreshold > 0) {
+        findDegradedSubtrees(0u, nodeCount, costs, subtrees);
+
+        /* Process the subtrees back to front, so that the node
+           indices of the remaining ones stay valid */
+        for (auto it = subtrees.rbegin(); it != subtrees.rend(); ++it)
+            rebuiltRefs += rebuildSubtree(it->first, it->second, costs);
+
+        /* Update the costs of the ancestors of rebuilt subtrees */
+        if (!subtrees.empty())
+            refitSubtree(0u, (uint32_t) m_nodes.size(), costs, false);
+    }
+
+    cout << "done (took " << timer.elapsedString() << ", "
+        << subtrees.size() << (subtrees.size() == 1 ? " subtree" : " subtrees")
+        << " with " << rebuiltRefs << " references rebuilt, SAH cost = "
+        << referenceCost << " -> " << costs[0] << ")." << endl;
+
+    buildLayout();
+}
+
+float BVH::refitSubtree(uint32_t node_idx, uint32_t end, std::vector<float> &costs, bool updateBounds) {
+    BVHNode &node = m_nodes[node_idx];
+
+    if (node.isLeaf()) {
+        if (updateBounds) {
+            node.bbox.reset();
+            for (uint32_t i = node.start(); i < node.end(); ++i)
+                node.bbox.expandBy(m_shapes[m_refShapes[i]]->getBoundingBox(m_refPrims[i]));
+        }
+        return costs[node_idx] = (float) BVHBuildTask::INTERSECTION_COST * node.leaf.size;
+    }
+
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    float costLeft, costRight;
+    if (end - node_idx > SBVHBuilder::PARALLEL_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { costLeft = refitSubtree(left, right, costs, updateBounds); },
+            [&] { costRight = refitSubtree(right, end, costs, updateBounds); }
+        );
+    } else {
+        costLeft = refitSubtree(left, right, costs, updateBounds);
+        costRight = refitSubtree(right, end, costs, updateBounds);
+    }
+
+    if (updateBounds)
+        node.bbox = BoundingBox3f::merge(m_nodes[left].bbox, m_nodes[right].bbox);
+
+    /* Same cost model as in statistics() */
+    float saLeft = m_nodes[left].bbox.getSurfaceArea();
+    float saRight = m_nodes[right].bbox.getSurfaceArea();
+    float saCur = node.bbox.getSurfaceArea();
+    float sahCost = 2 * BVHBuildTask::TRAVERSAL_COST;
+    if (saCur > 0)
+        sahCost += (saLeft * costLeft + saRight * costRight) / saCur;
+
+    return costs[node_idx] = sahCost;
+}
+
+void BVH::findDegradedSubtrees(uint32_t node_idx, uint32_t end, const std::vector<float> &costs,
+                               std::vector<std::pair<uint32_t, uint32_t>> &subtrees) const {
+    float threshold = m_rebuildThreshold * m_nodeCosts[node_idx];
+    const BVHNode &node = m_nodes[node_idx];
+    if (costs[node_idx] <= threshold || node.isLeaf())
+        return;
+
+    /* Evaluate the cost of this node as if its subtrees had kept their
+       quality. When this alone exceeds the threshold, the split of the node
+       has become poor (e.g. its children overlap) and the entire subtree is
+       rebuilt. Otherwise, the degradation is due to some of its descendants. */
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    float saCur = node.bbox.getSurfaceArea();
+    float localCost = 2 * BVHBuildTask::TRAVERSAL_COST;
+    if (saCur > 0)
+        localCost += (m_nodes[left].bbox.getSurfaceArea() * m_nodeCosts[left] +
+                      m_nodes[right].bbox.getSurfaceArea() * m_nodeCosts[right]) / saCur;
+
+    if (localCost > threshold) {
+        subtrees.push_back(std::make_pair(node_idx, end));
+    } else {
+        findDegradedSubtrees(left, right, costs, subtrees);
+        findDegradedSubtrees(right, end, costs, subtrees);
+    }
+}
+
+uint32_t BVH::rebuildSubtree(uint32_t node_idx, uint32_t end, std::vector<float> &costs) {
+    /* The references of a subtree are stored contiguously */
+    uint32_t refStart = std::numeric_limits<uint32_t>::max(), refEnd = 0;
+    for (uint32_t i = node_idx; i < end; ++i) {
+        const BVHNode &node = m_nodes[i];
+        if (node.isLeaf() && node.leaf.size > 0) {
+            refStart = std::min(refStart, node.start());
+            refEnd = std::max(refEnd, node.end());
+        }
+    }
+    if (refStart >= refEnd)
+        return 0;
+
+    /* Gather the referenced primitives, dropping the duplicates created by spatial splits */
+    std::vector<uint32_t> prims(refEnd - refStart);
+    for (uint32_t i = refStart; i < refEnd; ++i)
+        prims[i - refStart] = m_shapeOffset[m_refShapes[i]] + m_refPrims[i];
+    std::sort(prims.begin(), prims.end());
+    prims.erase(std::unique(prims.begin(), prims.end()), prims.end());
+
+    std::vector<SBVHBuilder::Reference> refs(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i) {
+        uint32_t idx = prims[i];
+        uint32_t shapeIdx = findShape(idx);
+        refs[i] = SBVHBuilder::Reference { prims[i], m_shapes[shapeIdx]->getBoundingBox(idx) };
+    }
+
+    /* Build the new subtree using object splits only */
+    SBVHBuilder::Subtree tree;
+    SBVHBuilder(*this, m_bbox.getSurfaceArea()).build(refs, m_nodes[node_idx].bbox, 0.0f, tree);
+
+    int64_t nodeDelta = (int64_t) tree.nodes.size() - (int64_t) (end - node_idx);
+    int64_t refDelta = (int64_t) tree.indices.size() - (int64_t) (refEnd - refStart);
+
+    /* Splice the new nodes into the tree */
+    for (uint32_t i = 0; i < node_idx; ++i) {
+        BVHNode &node = m_nodes[i];
+        if (node.isInner() && node.inner.rightChild >= end)
+            node.inner.rightChild = (uint32_t) (node.inner.rightChild + nodeDelta);
+    }
+    for (uint32_t i = end; i < m_nodes.size(); ++i) {
+        BVHNode &node = m_nodes[i];
+        if (node.isInner())
+            node.inner.rightChild = (uint32_t) (node.inner.rightChild + nodeDelta);
+        else
+            node.leaf.start = (uint32_t) (node.leaf.start + refDelta);
+    }
+    for (BVHNode &node : tree.nodes) {
+        if (node.isInner()) {
+            node.inner.rightChild += node_idx;
+        } else {
+            /* Sort the primitives of each leaf, which groups them by shape */
+            std::sort(tree.indices.begin() + node.start(), tree.indices.begin() + node.end());
+            node.leaf.start += refStart;
+        }
+    }
+    m_nodes.erase(m_nodes.begin() + node_idx, m_nodes.begin() + end);
+    m_nodes.insert(m_nodes.begin() + node_idx, tree.nodes.begin(), tree.nodes.end());
+
+    /* Splice the new references */
+    std::vector<uint32_t> refShapes(tree.indices.size()), refPrims(tree.indices.size());
+    for (size_t i = 0; i < tree.indices.size(); ++i) {
+        uint32_t idx = tree.indices[i];
+        refShapes[i] = findShape(idx);
+        refPrims[i] = idx;
+    }
+    m_refShapes.erase(m_refShapes.begin() + refStart, m_refShapes.begin() + refEnd);
+    m_refShapes.insert(m_refShapes.begin() + refStart, refShapes.begin(), refShapes.end());
+    m_refPrims.erase(m_refPrims.begin() + refStart, m_refPrims.begin() + refEnd);
+    m_refPrims.insert(m_refPrims.begin() + refStart, refPrims.begin(), refPrims.end());
+
+    /* The new subtree becomes the reference for future refits */
+    uint32_t newEnd = node_idx + (uint32_t) tree.nodes.size();
+    costs.erase(costs.begin() + node_idx, costs.begin() + end);
+    costs.insert(costs.begin() + node_idx, tree.nodes.size(), 0.0f);
+    refitSubtree(node_idx, newEnd, costs, false);
+    m_nodeCosts.erase(m_nodeCosts.begin() + node_idx, m_nodeCosts.begin() + end);
+    m_nodeCosts.insert(m_nodeCosts.begin() + node_idx,
+        costs.begin() + node_idx, costs.begin() + newEnd);
+
+    return (uint32_t) tree.indices.size();
+}
+
+template <int N, typename Array> uint32_t BVH::collapse(Array &nodes, uint32_t node_idx) const {
+    /* Gather up to N children by repeatedly opening the
+       inner node with the largest surface area */
+    uint32_t children[N], count = 0;
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        children[count++] = node_idx;
+    } else {
+        children[count++] = node_idx + 1;
+        children[count++] = node.inner.rightChild;
+    }
+
+    while (count < N) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (uint32_t i = 0; i < count; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                bestArea = child.bbox.getSurfaceArea();
+                best = (int) i;
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t idx = children[best];
+        children[best] = idx + 1;
+        children[count++] = m_nodes[idx].inner.rightChild;
+    }
+
+    /* Allocate the wide node, unused slots receive an empty bounding box */
+    uint32_t result = (uint32_t) nodes.size();
+    nodes.emplace_back();
+    for (int i = 0; i < N; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            nodes[result].bounds[2*axis + 0][i] =  std::numeric_limits<float>::infinity();
+            nodes[result].bounds[2*axis + 1][i] = -std::numeric_limits<float>::infinity();
+        }
+        nodes[result].child[i] = nodes[result].size[i] = 0u;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const BVHNode &child = m_nodes[children[i]];
+        if (child.isLeaf() && child.leaf.size == 0)
+            continue;
+
+        uint32_t index = child.isLeaf() ? child.start() : collapse<N>(nodes, children[i]);
+        BVHWideNode<N> &wide = nodes[result];
+        for (int axis = 0; axis < 3; ++axis) {
+            wide.bounds[2*axis + 0][i] = child.bbox.min[axis];
+            wide.bounds[2*axis + 1][i] = child.bbox.max[axis];
+        }
+        wide.child[i] = index;
+        wide.size[i] = child.isLeaf() ? child.leaf.size : 0u;
+    }
+
+    return result;
+}
+
+template <int N, typename Array, typename QuantizedArray>
+bool BVH::quantize(const Array &nodes, QuantizedArray &result) const {
+    std::atomic<bool> success(true);
+    result.resize(nodes.size());
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0u, nodes.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                const BVHWideNode<N> &node = nodes[i];
+                BVHQuantizedNode<N> &qnode = result[i];
+                memset(&qnode, 0, sizeof(BVHQuantizedNode<N>));
+
+                for (int c = 0; c < N; ++c) {
+                    if (node.bounds[0][c] <= node.bounds[1][c])
+                        qnode.childMask |= (uint8_t) (1 << c);
+                    if (node.size[c] > 0xFFFF)
+                        success = false;
+                    qnode.child[c] = node.child[c];
+                    qnode.size[c] = (uint16_t) node.size[c];
+                }
+
+                for (int axis = 0; axis < 3; ++axis) {
+                    float lo = std::numeric_limits<float>::infinity(),
+                          hi = -std::numeric_limits<float>::infinity();
+                    for (int c = 0; c < N; ++c) {
+                        if (qnode.childMask & (1 << c)) {
+                            lo = std::min(lo, node.bounds[2*axis + 0][c]);
+                            hi = std::max(hi, node.bounds[2*axis + 1][c]);
+                        }
+                    }
+                    if (!qnode.childMask)
+                        continue;
+
+                    /* Find the smallest power-of-two spacing so that
+                       255 steps cover the extent of the children */
+                    int exponent = -126;
+                    if (hi > lo) {
+                        std::frexp((hi - lo) / 255.0f, &exponent);
+                        exponent = std::max(exponent, -126);
+                    }
+                    qnode.origin[axis] = lo;
+                    qnode.exponent[axis] = (int8_t) exponent;
+                    while (exponent < 127 && lo + 255 * qnode.getSpacing(axis) < hi)
+                        qnode.exponent[axis] = (int8_t) ++exponent;
+                    float spacing = qnode.getSpacing(axis);
+
+                    /* Round outwards, and verify the result using the same
+                       arithmetic as the decoder in rayIntersectWide() */
+                    for (int c = 0; c < N; ++c) {
+                        if (!(qnode.childMask & (1 << c)))
+                            continue;
+                        float bmin = node.bounds[2*axis + 0][c],
+                              bmax = node.bounds[2*axis + 1][c];
+                        int qmin = clamp((int) std::floor((bmin - lo) / spacing), 0, 255);
+                        int qmax = clamp((int) std::ceil((bmax - lo) / spacing), 0, 255);
+                        while (qmin > 0 && lo + qmin * spacing > bmin)
+                            --qmin;
+                        while (qmax < 255 && lo + qmax * spacing < bmax)
+                            ++qmax;
+                        qnode.bounds[2*axis + 0][c] = (uint8_t) qmin;
+                        qnode.bounds[2*axis + 1][c] = (uint8_t) qmax;
+                    }
+                }
+            }
+        }
+    );
+
+    if (!success) {
+        QuantizedArray().swap(result);
+        return false;
+    }
+    return true;
+}
+
+std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+    } else {
+        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
+        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+        float saCur = node.bbox.getSurfaceArea();
+        float sahCost =
+            2 * BVHBuildTask::TRAVERSAL_COST +
+            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+        return std::make_pair(
+            sahCost,
+            stats_left.second + stats_right.second + 1u
+        );
+    }
+}
+
+uint32_t BVH::depth() const {
+    if (m_nodes.empty())
+        return 0;
+
+    /* Iterative, since this is also used to detect trees that are too deep */
+    uint32_t result = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> stack { std::make_pair(0u, 0u) };
+    while (!stack.empty()) {
+        std::pair<uint32_t, uint32_t> entry = stack.back();
+        stack.pop_back();
+        const BVHNode &node = m_nodes[entry.first];
+        if (node.isInner()) {
+            stack.push_back(std::make_pair(entry.first + 1, entry.second + 1));
+            stack.push_back(std::make_pair((uint32_t) node.inner.rightChild, entry.second + 1));
+        } else {
+            result = std::max(result, entry.second);
+        }
+    }
+    return result;
+}
+
+bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+    if (shadowRay)
+        return rayOccluded(_ray);
+
+    its.t = std::numeric_limits<float>::infinity();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    TraversalStatistics &stats = localStatistics();
+    NORI_BVH_STAT(stats.rays++);
+
+    uint32_t f = 0;
+    bool foundIntersection = traverse(ray, its, f, shadowRay, stats);
+
+    if (foundIntersection) {
+        its.mesh->setHitInformation(f,ray,its);
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::rayOccluded(const Ray3f &_ray) const {
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (!m_occluderCache)
+        return rayOccludedPrimitive(ray);
+
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    TraversalStatistics &stats = localStatistics();
+    NORI_BVH_STAT(stats.rays++);
+
+    /* Test the primitive that blocked the previous shadow ray of this
+       thread. Any intersection proves occlusion, so a stale entry
+       (e.g. after a refit) costs time but never gives a wrong answer */
+    uint32_t &lastOccluder = m_lastOccluder.local();
+    if (lastOccluder < m_refShapes.size()) {
+        NORI_BVH_STAT(stats.occluderCacheQueries++);
+        NORI_BVH_STAT(stats.primitives++);
+        if (m_shapes[m_refShapes[lastOccluder]]->rayOccluded(&m_refPrims[lastOccluder], 1, ray)) {
+            NORI_BVH_STAT(stats.occluderCacheHits++);
+            return true;
+        }
+    }
+
+    return occluded(ray, stats, &lastOccluder);
+}
+
+bool BVH::rayOccludedPrimitive(const Ray3f &ray) const {
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    TraversalStatistics &stats = localStatistics();
+    NORI_BVH_STAT(stats.rays++);
+
+    return occluded(ray, stats);
+}
+
+bool BVH::rayIntersectPrimitive(Ray3f &ray, const Shape *&shape, uint32_t &prim,
+                                Point2f &uv, bool shadowRay) const {
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    TraversalStatistics &stats = localStatistics();
+    NORI_BVH_STAT(stats.rays++);
+
+    Intersection its;
+    if (!traverse(ray, its, prim, shadowRay, stats))
+        return false;
+
+    shape = its.mesh;
+    uv = its.uv;
+    return true;
+}
+
+bool BVH::traverse(Ray3f &ray, Intersection &its, uint32_t &f,
+                   bool shadowRay, TraversalStatistics &stats) const {
+    switch (m_layout) {
+        case EWide4:
+            if (!m_quantizedNodes4.empty())
+                return rayIntersectWide<4>(m_quantizedNodes4, ray, its, f, shadowRay, stats);
+            return rayIntersectWide<4>(m_nodes4, ray, its, f, shadowRay, stats);
+        case EWide8:
+            if (!m_quantizedNodes8.empty())
+                return rayIntersectWide<8>(m_quantizedNodes8, ray, its, f, shadowRay, stats);
+            return rayIntersectWide<8>(m_nodes8, ray, its, f, shadowRay, stats);
+        default:
+            return rayIntersectBinary(ray, its, f, shadowRay, stats);
+    }
+}
+
+bool BVH::occluded(const Ray3f &ray, TraversalStatistics &stats, uint32_t *occluder) const {
+    switch (m_layout) {
+        case EWide4:
+            if (!m_quantizedNodes4.empty())
+                return occludedWide<4>(m_quantizedNodes4, ray, stats, occluder);
+            return occludedWide<4>(m_nodes4, ray, stats, occluder);
+        case EWide8:
+            if (!m_quantizedNodes8.empty())
+                return occludedWide<8>(m_quantizedNodes8, ray, stats, occluder);
+            return occludedWide<8>(m_nodes8, ray, stats, occluder);
+        default:
+            return occludedBinary(ray, stats, occluder);
+    }
+}
+
+void BVH::rayIntersect(const Ray3f *rays, Intersection *its, size_t count) const {
+    rayIntersectBatch(rays, count, its, nullptr);
+}
+
+void BVH::rayIntersect(const Ray3f *rays, bool *occluded, size_t count) const {
+    rayIntersectBatch(rays, count, nullptr, occluded);
+}
+
+void BVH::rayIntersectBatch(const Ray3f *rays, size_t count, Intersection *its,
+                            bool *occluded) const {
+    TraversalStatistics &stats = localStatistics();
+
+    /* Stable counting sort of the rays by direction octant. The rays of
+       each packet then agree on the near and far planes of every box and
+       on the order in which the children of a node should be visited */
+    auto octant = [](const Ray3f &ray) {
+        return (std::signbit(ray.dRcp.x()) ? 1 : 0) |
+               (std::signbit(ray.dRcp.y()) ? 2 : 0) |
+               (std::signbit(ray.dRcp.z()) ? 4 : 0);
+    };
+
+    uint32_t start[9] = { 0 }, pos[8];
+    for (size_t i = 0; i < count; ++i)
+        start[octant(rays[i]) + 1]++;
+    for (int i = 0; i < 8; ++i) {
+        start[i + 1] += start[i];
+        pos[i] = start[i];
+    }
+
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; ++i)
+        order[pos[octant(rays[i])]++] = (uint32_t) i;
+
+    for (int i = 0; i < 8; ++i) {
+        for (uint32_t j = start[i]; j < start[i + 1]; j += PACKET_SIZE)
+            rayIntersectPacket<PACKET_SIZE>(rays, &order[j],
+                std::min((uint32_t) PACKET_SIZE, start[i + 1] - j), its, occluded, stats);
+    }
+}
+
+template <int N> void BVH::rayIntersectPacket(const Ray3f *rays, const uint32_t *indices,
+        uint32_t count, Intersection *its, bool *occluded, TraversalStatistics &stats) const {
+    typedef TSimdFloat<N> SimdFloat;
+    bool shadowRay = its == nullptr;
+
+    /* Convert the packet into SoA form. Unused lanes are never activated. The lanes
+       work on copies of the rays, which are copy-constructed into raw storage since
+       Ray3f has no assignment operator */
+    alignas(Ray3f) unsigned char rayStorage[N * sizeof(Ray3f)];
+    Ray3f *ray = reinterpret_cast<Ray3f *>(rayStorage);
+    Intersection *lanesIts[N], unused;
+    uint32_t f[N];
+    alignas(32) float o[3][N], dRcp[3][N], mint[N], maxt[N];
+    int active = 0, found = 0;
+
+    for (int i = 0; i < N; ++i) {
+        if (i < (int) count) {
+            new (&ray[i]) Ray3f(rays[indices[i]]);
+
+            /* Use an adaptive ray epsilon */
+            if (ray[i].mint == Epsilon)
+                ray[i].mint = std::max(ray[i].mint, ray[i].mint * ray[i].o.array().abs().maxCoeff());
+
+            if (ray[i].maxt >= ray[i].mint)
+                active |= 1 << i;
+
+            if (shadowRay) {
+                lanesIts[i] = &unused;
+            } else {
+                lanesIts[i] = &its[indices[i]];
+                lanesIts[i]->t = std::numeric_limits<float>::infinity();
+                lanesIts[i]->mesh = nullptr;
+            }
+        } else {
+            new (&ray[i]) Ray3f(Point3f::Zero(), Vector3f::UnitX());
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            o[axis][i] = ray[i].o[axis];
+            dRcp[axis][i] = ray[i].dRcp[axis];
+        }
+        mint[i] = ray[i].mint;
+        maxt[i] = ray[i].maxt;
+    }
+
+    NORI_BVH_STAT(stats.rays += count);
+
+    if (!m_nodes.empty() && active) {
+        bool dirIsNeg[3];
+        for (int axis = 0; axis < 3; ++axis)
+            dirIsNeg[axis] = std::signbit(ray[0].dRcp[axis]);
+
+        const SimdFloat ox = SimdFloat::load(o[0]), oy = SimdFloat::load(o[1]),
+            oz = SimdFloat::load(o[2]), rx = SimdFloat::load(dRcp[0]),
+            ry = SimdFloat::load(dRcp[1]), rz = SimdFloat::load(dRcp[2]),
+            tmin = SimdFloat::load(mint);
+
+        struct StackEntry {
+            uint32_t node_idx;
+            int mask;
+        };
+
+        StackEntry stack[MAX_DEPTH];
+        uint32_t node_idx = 0, stack_idx = 0;
+        int mask = active;
+
+        while (true) {
+            const BVHNode &node = m_nodes[node_idx];
+            const Point3f &nearP = node.bbox.min, &farP = node.bbox.max;
+            NORI_BVH_STAT(stats.nodes++);
+
+            /* Slab test of the node against all rays of the packet, which
+               are culled using their closest intersection found so far */
+            SimdFloat tNear = simdMax((SimdFloat(dirIsNeg[0] ? farP.x() : nearP.x()) - ox) * rx,
+                              simdMax((SimdFloat(dirIsNeg[1] ? farP.y() : nearP.y()) - oy) * ry,
+                              simdMax((SimdFloat(dirIsNeg[2] ? farP.z() : nearP.z()) - oz) * rz, tmin)));
+            SimdFloat tFar  = simdMin((SimdFloat(dirIsNeg[0] ? nearP.x() : farP.x()) - ox) * rx,
+                              simdMin((SimdFloat(dirIsNeg[1] ? nearP.y() : farP.y()) - oy) * ry,
+                              simdMin((SimdFloat(dirIsNeg[2] ? nearP.z() : farP.z()) - oz) * rz,
+                                      SimdFloat::load(maxt))));
+            mask &= simdLessEqualMask(tNear, tFar);
+
+            if (mask) {
+                if (node.isInner()) {
+                    uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+                    if (dirIsNeg[node.inner.axis])
+                        std::swap(near_idx, far_idx);
+                    stack[stack_idx++] = StackEntry { far_idx, mask };
+                    assert(stack_idx < MAX_DEPTH);
+                    node_idx = near_idx;
+                    continue;
+                }
+
+                for (int i = 0; i < N; ++i) {
+                    if (!(mask & (1 << i)))
+                        continue;
+                    if (intersectLeaf(node.start(), node.end(), ray[i], *lanesIts[i],
+                                      f[i], shadowRay, stats)) {
+                        found |= 1 << i;
+                        if (shadowRay)
+                            active &= ~(1 << i);
+                    }
+                    maxt[i] = ray[i].maxt;
+                }
+
+                if (!active)
+                    break;
+            }
+
+            /* Pop the next node along with the rays that reached it */
+            mask = 0;
+            do {
+                if (stack_idx == 0)
+                    break;
+                --stack_idx;
+                mask = stack[stack_idx].mask & active;
+            } while (!mask);
+
+            if (!mask)
+                break;
+            node_idx = stack[stack_idx].node_idx;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        bool hit = (found & (1 << i)) != 0;
+        if (shadowRay)
+            occluded[indices[i]] = hit;
+        else if (hit)
+            lanesIts[i]->mesh->setHitInformation(f[i], ray[i], *lanesIts[i]);
+    }
+}
+
+bool BVH::intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray, Intersection &its,
+                        uint32_t &f, bool shadowRay, TraversalStatistics &stats) const {
+    bool foundIntersection = false;
+
+    if (!m_leafBlocks.empty() && start < end && m_leafBlocks[start] != (uint32_t) -1) {
+        NORI_BVH_STAT(stats.primitives += end - start);
+        return intersectBlocks(m_leafBlocks[start], (end - start + 3) / 4,
+                               ray, its, f, shadowRay);
+    }
+
+    for (uint32_t i = start; i < end; ) {
+        /* Test runs of primitives from the same shape with a single call */
+        uint32_t shapeIdx = m_refShapes[i], runEnd = i + 1;
+        while (runEnd < end && m_refShapes[runEnd] == shapeIdx)
+            ++runEnd;
+        const Shape *shape = m_shapes[shapeIdx];
+        NORI_BVH_STAT(stats.primitives += runEnd - i);
+
+        float u, v;
+        uint32_t idx;
+        if (shape->rayIntersectPrimitives(&m_refPrims[i], runEnd - i, ray, u, v, idx, shadowRay)) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+            its.t = ray.maxt;
+            its.uv = Point2f(u, v);
+            its.mesh = shape;
+            f = idx;
+        }
+        i = runEnd;
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::occludedLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+                       TraversalStatistics &stats, uint32_t *occluder) const {
+    if (!m_leafBlocks.empty() && start < end && m_leafBlocks[start] != (uint32_t) -1) {
+        NORI_BVH_STAT(stats.primitives += end - start);
+        Ray3f tmpRay(ray);
+        Intersection its;
+        uint32_t f;
+        if (!intersectBlocks(m_leafBlocks[start], (end - start + 3) / 4,
+                             tmpRay, its, f, true))
+            return false;
+        if (occluder)
+            *occluder = findOccluder(start, end, ray);
+        return true;
+    }
+
+    for (uint32_t i = start; i < end; ) {
+        uint32_t shapeIdx = m_refShapes[i], runEnd = i + 1;
+        while (runEnd < end && m_refShapes[runEnd] == shapeIdx)
+            ++runEnd;
+        NORI_BVH_STAT(stats.primitives += runEnd - i);
+
+        if (m_shapes[shapeIdx]->rayOccluded(&m_refPrims[i], runEnd - i, ray)) {
+            if (occluder)
+                *occluder = findOccluder(i, runEnd, ray);
+            return true;
+        }
+        i = runEnd;
+    }
+
+    return false;
+}
+
+uint32_t BVH::findOccluder(uint32_t start, uint32_t end, const Ray3f &ray) const {
+    /* Only called after a hit, so this rarely costs more than one extra leaf test */
+    for (uint32_t i = start; i < end; ++i) {
+        if (m_shapes[m_refShapes[i]]->rayOccluded(&m_refPrims[i], 1, ray))
+            return i;
+    }
+    return start;
+}
+
+bool BVH::intersectTriangleBlocks(uint32_t block, uint32_t count, Ray3f &ray,
+                                  Intersection &its, uint32_t &f, bool shadowRay) const {
+    typedef TSimdFloat<4> SimdFloat;
+
+    /* Moeller-Trumbore test, see Mesh::rayIntersect() */
+    const SimdFloat ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z()),
+        dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z()), mint(ray.mint),
+        zero(0.0f), one(1.0f), eps(1e-8f), negEps(-1e-8f);
+    bool foundIntersection = false;
+
+    for (uint32_t b = block; b < block + count; ++b) {
+        const TriangleBlock &tri = m_triangleBlocks[b];
+        SimdFloat e1x = SimdFloat::load(tri.e1[0]), e1y = SimdFloat::load(tri.e1[1]),
+                  e1z = SimdFloat::load(tri.e1[2]), e2x = SimdFloat::load(tri.e2[0]),
+                  e2y = SimdFloat::load(tri.e2[1]), e2z = SimdFloat::load(tri.e2[2]);
+
+        SimdFloat px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+        SimdFloat det = e1x * px + e1y * py + e1z * pz;
+        SimdFloat invDet = one / det;
+
+        SimdFloat tx = ox - SimdFloat::load(tri.p0[0]), ty = oy - SimdFloat::load(tri.p0[1]),
+                  tz = oz - SimdFloat::load(tri.p0[2]);
+        SimdFloat u = (tx * px + ty * py + tz * pz) * invDet;
+
+        SimdFloat qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+        SimdFloat v = (dx * qx + dy * qy + dz * qz) * invDet;
+        SimdFloat t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+        int mask = (simdLessEqualMask(det, negEps) | simdLessEqualMask(eps, det)) &
+            simdLessEqualMask(zero, u) & simdLessEqualMask(u, one) &
+            simdLessEqualMask(zero, v) & simdLessEqualMask(u + v, one) &
+            simdLessEqualMask(mint, t) & simdLessEqualMask(t, SimdFloat(ray.maxt));
+
+        if (!mask)
+            continue;
+        if (shadowRay)
+            return true;
+
+        float tValues[4], uValues[4], vValues[4];
+        t.store(tValues); u.store(uValues); v.store(vValues);
+        int best = -1;
+        for (int i = 0; i < 4; ++i) {
+            if ((mask & (1 << i)) && (best == -1 || tValues[i] < tValues[best]))
+                best = i;
+        }
+
+        uint32_t ref = tri.ref[best];
+        ray.maxt = its.t = tValues[best];
+        its.uv = Point2f(uValues[best], vValues[best]);
+        its.mesh = m_shapes[m_refShapes[ref]];
+        f = m_refPrims[ref];
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::intersectSphereBlocks(uint32_t block, uint32_t count, Ray3f &ray,
+                                Intersection &its, uint32_t &f, bool shadowRay) const {
+    typedef TSimdFloat<4> SimdFloat;
+
+    /* Robust quadratic, see Sphere::intersect() */
+    const SimdFloat ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z()),
+        dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z()), a(ray.d.squaredNorm()),
+        mint(ray.mint), zero(0.0f);
+    bool foundIntersection = false;
+
+    for (uint32_t b = block; b < block + count; ++b) {
+        const SphereBlock &sph = m_sphereBlocks[b];
+        SimdFloat fx = ox - SimdFloat::load(sph.center[0]),
+                  fy = oy - SimdFloat::load(sph.center[1]),
+                  fz = oz - SimdFloat::load(sph.center[2]),
+                  r2 = SimdFloat::load(sph.radius2);
+
+        SimdFloat bq = zero - (fx * dx + fy * dy + fz * dz);
+        SimdFloat c = fx * fx + fy * fy + fz * fz - r2;
+        SimdFloat s = bq / a;
+        SimdFloat lx = fx + s * dx, ly = fy + s * dy, lz = fz + s * dz;
+        SimdFloat discrim = a * (r2 - (lx * lx + ly * ly + lz * lz));
+
+        int valid = simdLessEqualMask(zero, discrim);
+        if (!valid)
+            continue;
+
+        /* Lanes with a negative discriminant produce NaNs, which are masked out */
+        SimdFloat q = bq + simdCopySign(simdSqrt(discrim), bq);
+        SimdFloat t0 = c / q, t1 = q / a;
+        SimdFloat tNear = simdMin(t0, t1), tFar = simdMax(t0, t1), maxt(ray.maxt);
+
+        int nearMask = valid & simdLessEqualMask(mint, tNear) & simdLessEqualMask(tNear, maxt);
+        int farMask = valid & ~nearMask & simdLessEqualMask(mint, tFar) & simdLessEqualMask(tFar, maxt);
+        if (!(nearMask | farMask))
+            continue;
+        if (shadowRay)
+            return true;
+
+        float tNearValues[4], tFarValues[4];
+        tNear.store(tNearValues); tFar.store(tFarValues);
+        int best = -1;
+        float bestT = 0;
+        for (int i = 0; i < 4; ++i) {
+            float t;
+            if (nearMask & (1 << i))
+                t = tNearValues[i];
+            else if (farMask & (1 << i))
+                t = tFarValues[i];
+            else
+                continue;
+            if (best == -1 || t < bestT) {
+                best = i;
+                bestT = t;
+            }
+        }
+
+        uint32_t ref = sph.ref[best];
+        ray.maxt = its.t = bestT;
+        its.uv = Point2f(0.0f, 0.0f);
+        its.mesh = m_shapes[m_refShapes[ref]];
+        f = m_refPrims[ref];
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+/// Check if a ray segment overlaps a node and return the entry distance
+static inline bool intersectNode(const BoundingBox3f &bbox, const Ray3f &ray, float &nearT) {
+    float farT;
+    return bbox.rayIntersect(ray, nearT, farT) &&
+        nearT <= ray.maxt && farT >= ray.mint;
+}
+
+bool BVH::rayIntersectBinary(Ray3f &ray, Intersection &its, uint32_t &f,
+                             bool shadowRay, TraversalStatistics &stats) const {
+    struct StackEntry {
+        uint32_t node_idx;
+        float nearT;
+    };
+
+    StackEntry stack[MAX_DEPTH];
+    uint32_t node_idx = 0, stack_idx = 0;
+    bool foundIntersection = false;
+    float nearT;
+
+    /* The children of each node are visited front to back with respect
+       to the split axis that was chosen when building the tree */
+    bool dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+
+    NORI_BVH_STAT(stats.nodes++);
+    if (!intersectNode(m_nodes[0].bbox, ray, nearT))
+        return false;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+
+        if (node.isInner()) {
+            uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+            if (dirIsNeg[node.inner.axis])
+                std::swap(near_idx, far_idx);
+
+            float nearT0, nearT1;
+            bool hit0 = intersectNode(m_nodes[near_idx].bbox, ray, nearT0);
+            bool hit1 = intersectNode(m_nodes[far_idx].bbox, ray, nearT1);
+            NORI_BVH_STAT(stats.nodes += 2);
+
+            if (hit0) {
+                if (hit1) {
+                    stack[stack_idx++] = StackEntry { far_idx, nearT1 };
+                    assert(stack_idx < MAX_DEPTH);
+                }
+                node_idx = near_idx;
+                continue;
+            } else if (hit1) {
+                node_idx = far_idx;
+                continue;
+            }
+        } else {
+            if (intersectLeaf(node.start(), node.end(), ray, its, f, shadowRay, stats)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+
+        /* Pop the next node, skipping those that lie entirely
+           behind the closest intersection found so far */
+        do {
+            if (stack_idx == 0)
+                return foundIntersection;
+            --stack_idx;
+        } while (stack[stack_idx].nearT > ray.maxt);
+        node_idx = stack[stack_idx].node_idx;
+    }
+}
+
+bool BVH::occludedBinary(const Ray3f &ray, TraversalStatistics &stats,
+                         uint32_t *occluder) const {
+    uint32_t stack[MAX_DEPTH];
+    uint32_t node_idx = 0, stack_idx = 0;
+    float nearT;
+
+    NORI_BVH_STAT(stats.nodes++);
+    if (!intersectNode(m_nodes[0].bbox, ray, nearT))
+        return false;
+
+    while (true) {
+        const BVHNode &node = m_nodes[node_idx];
+
+        if (node.isInner()) {
+            /* Any intersection ends the query, so descend into the
+               child that is more likely to contain one first */
+            uint32_t first_idx = node_idx + 1, second_idx = node.inner.rightChild;
+            const BoundingBox3f &bbox0 = m_nodes[first_idx].bbox,
+                                &bbox1 = m_nodes[second_idx].bbox;
+
+            bool hit0 = intersectNode(bbox0, ray, nearT);
+            bool hit1 = intersectNode(bbox1, ray, nearT);
+            NORI_BVH_STAT(stats.nodes += 2);
+
+            if (hit0 && hit1) {
+                if (bbox1.getSurfaceArea() > bbox0.getSurfaceArea())
+                    std::swap(first_idx, second_idx);
+                stack[stack_idx++] = second_idx;
+                assert(stack_idx < MAX_DEPTH);
+                node_idx = first_idx;
+                continue;
+            } else if (hit0 || hit1) {
+                node_idx = hit0 ? first_idx : second_idx;
+                continue;
+            }
+        } else if (occludedLeaf(node.start(), node.end(), ray, stats, occluder)) {
+            return true;
+        }
+
+        if (stack_idx == 0)
+            return false;
+        node_idx = stack[--stack_idx];
+    }
+}
+
+template <int N, typename Array> bool BVH::occludedWide(const Array &nodes,
+        const Ray3f &ray, TraversalStatistics &stats, uint32_t *occluder) const {
+    typedef TSimdFloat<N> SimdFloat;
+
+    int nearIdx[3], farIdx[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        int negative = std::signbit(ray.dRcp[axis]) ? 1 : 0;
+        nearIdx[axis] = 2*axis + negative;
+        farIdx[axis]  = 2*axis + 1 - negative;
+    }
+
+    const SimdFloat ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z()),
+        rx(ray.dRcp.x()), ry(ray.dRcp.y()), rz(ray.dRcp.z()),
+        tmin(ray.mint), tmax(ray.maxt);
+
+    uint32_t stack[MAX_DEPTH * N];
+    uint32_t node_idx = 0, stack_idx = 0;
+
+    while (true) {
+        const typename Array::value_type &node = nodes[node_idx];
+        NORI_BVH_STAT(stats.nodes++);
+
+        /* Slab test, see rayIntersectWide() */
+        SimdFloat tNear = simdMax((node.template getBounds<SimdFloat>(nearIdx[0]) - ox) * rx,
+                          simdMax((node.template getBounds<SimdFloat>(nearIdx[1]) - oy) * ry,
+                          simdMax((node.template getBounds<SimdFloat>(nearIdx[2]) - oz) * rz, tmin)));
+        SimdFloat tFar  = simdMin((node.template getBounds<SimdFloat>(farIdx[0]) - ox) * rx,
+                          simdMin((node.template getBounds<SimdFloat>(farIdx[1]) - oy) * ry,
+                          simdMin((node.template getBounds<SimdFloat>(farIdx[2]) - oz) * rz, tmax)));
+        int mask = simdLessEqualMask(tNear, tFar) & node.getChildMask();
+
+        /* Test the intersected leaves right away, and collect the inner nodes */
+        uint32_t innerSlot[N], innerCount = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            if (node.size[i] == 0)
+                innerSlot[innerCount++] = (uint32_t) i;
+            else if (occludedLeaf(node.child[i], node.child[i] + node.size[i], ray, stats, occluder))
+                return true;
+        }
+
+        /* Push the inner nodes so that the one with the
+           largest surface area ends up on top of the stack */
+        if (innerCount > 1) {
+            SimdFloat ex = node.template getBounds<SimdFloat>(1) - node.template getBounds<SimdFloat>(0),
+                      ey = node.template getBounds<SimdFloat>(3) - node.template getBounds<SimdFloat>(2),
+                      ez = node.template getBounds<SimdFloat>(5) - node.template getBounds<SimdFloat>(4);
+            float area[N];
+            (ex * ey + ey * ez + ez * ex).store(area);
+            for (uint32_t j = 1; j < innerCount; ++j) {
+                uint32_t slot = innerSlot[j], k = j;
+                while (k > 0 && area[innerSlot[k-1]] > area[slot]) {
+                    innerSlot[k] = innerSlot[k-1];
+                    --k;
+                }
+                innerSlot[k] = slot;
+            }
+        }
+        for (uint32_t j = 0; j < innerCount; ++j) {
+            stack[stack_idx++] = node.child[innerSlot[j]];
+            assert(stack_idx < MAX_DEPTH * N);
+        }
+
+        if (stack_idx == 0)
+            return false;
+        node_idx = stack[--stack_idx];
+    }
+}
+
+template <int N, typename Array> bool BVH::rayIntersectWide(const Array &nodes,
+        Ray3f &ray, Intersection &its, uint32_t &f, bool shadowRay,
+        TraversalStatistics &stats) const {
+    typedef TSimdFloat<N> SimdFloat;
+
+    struct StackEntry {
+        uint32_t node_idx;
+        float nearT;
+    };
+
+    /* Offsets that select the near and far planes of the child bounding
+       boxes along each axis based on the sign of the ray direction */
+    int nearIdx[3], farIdx[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        int negative = std::signbit(ray.dRcp[axis]) ? 1 : 0;
+        nearIdx[axis] = 2*axis + negative;
+        farIdx[axis]  = 2*axis + 1 - negative;
+    }
+
+    const SimdFloat ox(ray.o.x()), oy(ray.o.y()), oz(ray.o.z()),
+        rx(ray.dRcp.x()), ry(ray.dRcp.y()), rz(ray.dRcp.z()),
+        tmin(ray.mint);
+
+    StackEntry stack[MAX_DEPTH * N];
+    uint32_t node_idx = 0, stack_idx = 0;
+    bool foundIntersection = false;
+
+    while (true) {
+        const typename Array::value_type &node = nodes[node_idx];
+        NORI_BVH_STAT(stats.nodes++);
+
+        /* Slab test against all N children. Note the argument order of
+           simdMin/simdMax, which discards NaNs produced by rays that
+           travel exactly within one of the bounding planes. Compressed
+           nodes are decoded on the fly into conservative bounds. */
+        SimdFloat tNear = simdMax((node.template getBounds<SimdFloat>(nearIdx[0]) - ox) * rx,
+                          simdMax((node.template getBounds<SimdFloat>(nearIdx[1]) - oy) * ry,
+                          simdMax((node.template getBounds<SimdFloat>(nearIdx[2]) - oz) * rz, tmin)));
+        SimdFloat tFar  = simdMin((node.template getBounds<SimdFloat>(farIdx[0]) - ox) * rx,
+                          simdMin((node.template getBounds<SimdFloat>(farIdx[1]) - oy) * ry,
+                          simdMin((node.template getBounds<SimdFloat>(farIdx[2]) - oz) * rz,
+                                  SimdFloat(ray.maxt))));
+        int mask = simdLessEqualMask(tNear, tFar) & node.getChildMask();
+
+        /* Sort the intersected children by their entry distance */
+        float tNearValues[N], hitNear[N];
+        uint32_t hitSlot[N], hitCount = 0;
+        tNear.store(tNearValues);
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            uint32_t j = hitCount++;
+            while (j > 0 && hitNear[j-1] > tNearValues[i]) {
+                hitNear[j] = hitNear[j-1];
+                hitSlot[j] = hitSlot[j-1];
+                --j;
+            }
+            hitNear[j] = tNearValues[i];
+            hitSlot[j] = (uint32_t) i;
+        }
+
+        /* Intersect leaves right away (front to back), and push inner
+           nodes so that the closest one ends up on top of the stack */
+        for (uint32_t j = 0; j < hitCount; ++j) {
+            uint32_t slot = hitSlot[j];
+            if (node.size[slot] == 0 || hitNear[j] > ray.maxt)
+                continue;
+            if (intersectLeaf(node.child[slot], node.child[slot] + node.size[slot],
+                              ray, its, f, shadowRay, stats)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+        for (uint32_t j = hitCount; j-- > 0; ) {
+            uint32_t slot = hitSlot[j];
+            if (node.size[slot] == 0 && hitNear[j] <= ray.maxt) {
+                stack[stack_idx++] = StackEntry { node.child[slot], hitNear[j] };
+                assert(stack_idx < MAX_DEPTH * N);
+            }
+        }
+
+        /* Pop the next node, skipping those that lie entirely
+           behind the closest intersection found so far */
+        do {
+            if (stack_idx == 0)
+                return foundIntersection;
+            --stack_idx;
+        } while (stack[stack_idx].nearT > ray.maxt);
+        node_idx = stack[stack_idx].node_idx;
+    }
+}
+
+BVH::TraversalStatistics BVH::getTraversalStatistics() const {
+    TraversalStatistics result;
+#if defined(NORI_BVH_STATS)
+    for (const TraversalStatistics &stats : m_traversalStats) {
+        result.rays += stats.rays;
+        result.nodes += stats.nodes;
+        result.primitives += stats.primitives;
+        result.occluderCacheQueries += stats.occluderCacheQueries;
+        result.occluderCacheHits += stats.occluderCacheHits;
+    }
+#endif
+    return result;
+}
+
+std::string BVH::TraversalStatistics::toString() const {
+    float invRays = rays > 0 ? 1.0f / (float) rays : 0.0f;
+    std::string result = tfm::format(
+        "%i rays, %.2f nodes/ray, %.2f primitives/ray",
+        rays, nodes * invRays, primitives * invRays);
+    if (occluderCacheQueries > 0)
+        result += tfm::format(", occluder cache hit rate %.1f%% (%i queries)",
+            100.0f * occluderCacheHits / (float) occluderCacheQueries, occluderCacheQueries);
+    return result;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,242 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/render.h>
+#include <nori/farm.h>
+#include <nori/geometrycache.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <tbb/task_scheduler_init.h>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+using namespace nori;
+
+/* Headless renderer: same as 'nori', but without OpenGL or a window */
+
+static void help() {
+    cout << "Syntax: nori-cli [options] <scene.xml>" << endl
+         << "        nori-cli [options] --batch <jobs.txt>" << endl
+         << "Options:" << endl
+         << "   -t, --threads <count>    Number of rendering threads (default: all cores)" << endl
+         << "   -s, --spp <count>        Override the sample count of the scene's sampler" << endl
+         << "   -P, --pass <count>       Samples per pixel and pass (default: adaptive)" << endl
+         << "   -b, --budget <secs>      Render as many samples as possible in the given time" << endl
+         << "   -o, --output <file>      Output image (default: scene file with .exr extension)" << endl
+         << "   -R, --raw                Write the raw weighted samples for nori-merge" << endl
+         << "   -S, --seed <value>       Offset the random numbers of the scene's sampler" << endl
+         << "   -c, --checkpoint <secs>  Save the rendering state every <secs> seconds" << endl
+         << "   -r, --resume             Continue from the checkpoint of an interrupted rendering" << endl
+         << "   -f, --farm <dir>         Distribute the blocks over worker processes that share <dir>" << endl
+         << "   -w, --workers <count>    Number of local worker processes with --farm (default: 1)" << endl
+         << "   --worker <dir>           Run as a worker process for the coordinator sharing <dir>" << endl
+         << "   --batch <jobs.txt>       Render the scenes listed in the file (one '<scene.xml> [output]'" << endl
+         << "                            per line), loading the geometry they share only once" << endl
+         << "   -p, --progress           Periodically print the rendering progress" << endl
+         << "   -h, --help               Display this message" << endl;
+}
+
+/// Read a list of jobs, whose scenes are relative to the list unless absolute
+static std::vector<std::pair<std::string, std::string>> loadJobs(const std::string &filename) {
+    std::ifstream is(filename);
+    if (is.fail())
+        throw NoriException("Unable to open the job list \"%s\"!", filename);
+    filesystem::path base = filesystem::path(filename).parent_path();
+
+    std::vector<std::pair<std::string, std::string>> jobs;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::istringstream tokenStream(line);
+        std::vector<std::string> tokens;
+        for (std::string token; tokenStream >> token; )
+            tokens.push_back(token);
+        if (tokens.empty() || tokens[0][0] == '#')
+            continue;
+        if (tokens.size() > 2 || filesystem::path(tokens[0]).extension() != "xml")
+            throw NoriException("Invalid job \"%s\" in \"%s\"!", line, filename);
+
+        auto resolve = [&](const std::string &name) {
+            filesystem::path path(name);
+            return (path.is_absolute() || base.empty() ? path : base / path).str();
+        };
+        jobs.push_back(std::make_pair(resolve(tokens[0]),
+                                      tokens.size() > 1 ? resolve(tokens[1]) : std::string()));
+    }
+    if (jobs.empty())
+        throw NoriException("The job list \"%s\" is empty!", filename);
+    return jobs;
+}
+
+int main(int argc, char **argv) {
+    try {
+        int threadCount = tbb::task_scheduler_init::automatic;
+        uint32_t sampleCount = 0, passSamples = 0, seed = 0;
+        float timeBudget = 0, checkpointInterval = 0;
+        std::string outputName, filename, farmDirectory, workerDirectory, batchName;
+        bool progress = false, resume = false, rawOutput = false;
+        int localWorkers = 1;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (arg == "-h" || arg == "--help") {
+                help();
+                return 0;
+            } else if ((arg == "-t" || arg == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Invalid thread count \"%s\"!", argv[i]);
+            } else if ((arg == "-s" || arg == "--spp") && hasValue) {
+                int value = toInt(argv[++i]);
+                if (value <= 0)
+                    throw NoriException("Invalid sample count \"%s\"!", argv[i]);
+                sampleCount = (uint32_t) value;
+            } else if ((arg == "-P" || arg == "--pass") && hasValue) {
+                int value = toInt(argv[++i]);
+                if (value <= 0)
+                    throw NoriException("Invalid pass size \"%s\"!", argv[i]);
+                passSamples = (uint32_t) value;
+            } else if ((arg == "-b" || arg == "--budget") && hasValue) {
+                timeBudget = toFloat(argv[++i]);
+                if (!(timeBudget > 0))
+                    throw NoriException("Invalid time budget \"%s\"!", argv[i]);
+            } else if ((arg == "-o" || arg == "--output") && hasValue) {
+                outputName = argv[++i];
+            } else if (arg == "-R" || arg == "--raw") {
+                rawOutput = true;
+            } else if ((arg == "-S" || arg == "--seed") && hasValue) {
+                int value = toInt(argv[++i]);
+                if (value < 0)
+                    throw NoriException("Invalid seed \"%s\"!", argv[i]);
+                seed = (uint32_t) value;
+            } else if ((arg == "-c" || arg == "--checkpoint") && hasValue) {
+                checkpointInterval = toFloat(argv[++i]);
+                if (!(checkpointInterval > 0))
+                    throw NoriException("Invalid checkpoint interval \"%s\"!", argv[i]);
+            } else if (arg == "-r" || arg == "--resume") {
+                resume = true;
+            } else if ((arg == "-f" || arg == "--farm") && hasValue) {
+                farmDirectory = argv[++i];
+            } else if ((arg == "-w" || arg == "--workers") && hasValue) {
+                localWorkers = toInt(argv[++i]);
+                if (localWorkers < 0)
+                    throw NoriException("Invalid number of workers \"%s\"!", argv[i]);
+            } else if (arg == "--worker" && hasValue) {
+                workerDirectory = argv[++i];
+            } else if (arg == "--batch" && hasValue) {
+                batchName = argv[++i];
+            } else if (arg == "-p" || arg == "--progress") {
+                progress = true;
+            } else if (arg.size() > 0 && arg[0] != '-' && filename.empty()) {
+                filename = arg;
+            } else {
+                cerr << "Error: invalid argument \"" << arg << "\"" << endl;
+                help();
+                return -1;
+            }
+        }
+
+        /* Each job consists of a scene and an output filename (empty: default) */
+        std::vector<std::pair<std::string, std::string>> jobs;
+        if (!batchName.empty()) {
+            if (!filename.empty() || !outputName.empty() || !farmDirectory.empty() || !workerDirectory.empty())
+                throw NoriException("--batch cannot be combined with a scene, --output or a farm!");
+            jobs = loadJobs(batchName);
+        } else if (filename.empty() || filesystem::path(filename).extension() != "xml") {
+            help();
+            return -1;
+        } else {
+            jobs.push_back(std::make_pair(filename, outputName));
+        }
+
+        /* Also limits the worker threads used by the render thread */
+        tbb::task_scheduler_init init(threadCount);
+
+        /* The blocks of a distributed rendering must all use the same seed */
+        if (seed > 0 && (!workerDirectory.empty() || !farmDirectory.empty()))
+            throw NoriException("Seeds are not supported by distributed rendering!");
+
+        if (!workerDirectory.empty()) {
+            RenderFarm(workerDirectory).work(filename, threadCount > 0 ? threadCount
+                : tbb::task_scheduler_init::default_num_threads());
+            return 0;
+        }
+
+        if (!farmDirectory.empty()) {
+            if (outputName.empty())
+                outputName = filename.substr(0, filename.find_last_of(".")) + ".exr";
+
+            /* Unless requested otherwise, share the cores among the local workers */
+            int workerThreads = threadCount > 0 ? threadCount : std::max(1,
+                tbb::task_scheduler_init::default_num_threads() / std::max(localWorkers, 1));
+            std::vector<std::string> workerCommand = {
+                argv[0], "--worker", farmDirectory, "-t", std::to_string(workerThreads), filename
+            };
+            RenderFarm farm(farmDirectory);
+            farm.setRawOutput(rawOutput);
+            farm.coordinate(filename, outputName, sampleCount, workerCommand,
+                            localWorkers, progress);
+            return 0;
+        }
+
+        /* Keep the geometry of each job around for the following ones */
+        getGeometryCache()->setEnabled(jobs.size() > 1);
+        Timer timer;
+
+        for (const auto &job : jobs) {
+            ImageBlock block(Vector2i(1, 1), nullptr);
+            RenderThread renderThread(block);
+            renderThread.setOutputName(job.second);
+            renderThread.setSampleCount(sampleCount);
+            renderThread.setSeed(seed);
+            renderThread.setRawOutput(rawOutput);
+            renderThread.setPassSamples(passSamples);
+            renderThread.setTimeBudget(timeBudget);
+            renderThread.setCheckpointInterval(checkpointInterval);
+            renderThread.setResume(resume);
+            renderThread.renderScene(job.first);
+
+            /* Tests (e.g. refittest) run while the file is loaded */
+            if (!renderThread.isBusy())
+                continue;
+
+            int lastPercent = -1;
+            while (renderThread.isBusy()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                int percent = (int) (renderThread.getProgress() * 100);
+                if (progress && percent != lastPercent && percent < 100) {
+                    cout << "Progress: " << percent << "%" << endl;
+                    lastPercent = percent;
+                }
+            }
+        }
+
+        if (jobs.size() > 1) {
+            cout << "Rendered " << jobs.size() << " jobs (took " << timer.elapsedString()
+                 << "), geometry cache: " << getGeometryCache()->toString() << endl;
+            getGeometryCache()->setEnabled(false);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -184,6 +184,24 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+uint64_t hashBuffer(const void *data, size_t size, uint64_t hash) {
+    const uint64_t prime = 1099511628211ULL;
+    const uint8_t *ptr = (const uint8_t *) data;
+
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), ptr += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(uint64_t));
+        hash = (hash ^ word) * prime;
+        /* The multiplication only carries upwards: fold the high bits
+           back down, or they would never affect the lower ones */
+        hash ^= hash >> 32;
+    }
+    for (; size > 0; --size, ++ptr)
+        hash = (hash ^ *ptr) * prime;
+
+    return hash;
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
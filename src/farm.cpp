@@ -0,0 +1,460 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/farm.h>
+#include <nori/render.h>
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/timer.h>
+#include <nori/bitmap.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Header of the result files that contain a rendered block
+struct FarmResultHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockId;
+    int32_t offset[2];
+    int32_t size[2];
+};
+
+static const char FARM_RESULT_MAGIC[8] = { 'N', 'O', 'R', 'I', 'P', 'R', 'T', '\0' };
+
+/// Increase when the file format changes
+static const uint32_t FARM_RESULT_VERSION = 1;
+
+/// Interval at which the shared directory is polled in milliseconds
+#define NORI_FARM_POLL_INTERVAL 100
+
+/// Interval at which workers touch the files of their claimed tasks in milliseconds
+#define NORI_FARM_HEARTBEAT_INTERVAL 2000
+
+/// Time after which the claim of a task without heartbeats is dropped in milliseconds
+#define NORI_FARM_CLAIM_TIMEOUT 30000
+
+/// Return the modification time of a file, or -1 if it does not exist
+static int64_t modificationTime(const std::string &filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return -1;
+    return (int64_t) st.st_mtime;
+}
+
+/// Return the ID of the job announced in \c jobName (empty if there is none)
+static std::string currentJob(const std::string &jobName) {
+    std::string jobId;
+    std::ifstream is(jobName);
+    is >> jobId;
+    return jobId;
+}
+
+/// Load the scene in \c filename and optionally override its sample count
+static Scene *loadScene(const std::string &filename, uint32_t sampleCount) {
+    /* Resources are referenced relative to the scene file (see RenderThread) */
+    filesystem::path path(filename);
+    getFileResolver()->prepend(path.parent_path());
+
+    NoriObject *root = loadFromXML(filename);
+    if (root->getClassType() != NoriObject::EScene) {
+        delete root;
+        throw NoriException("\"%s\" does not contain a scene!", filename);
+    }
+
+    Scene *scene = static_cast<Scene *>(root);
+    if (sampleCount > 0)
+        scene->getSampler()->setSampleCount(sampleCount);
+    return scene;
+}
+
+RenderFarm::RenderFarm(const std::string &directory) : m_directory(directory) {
+    if (!filesystem::path(directory).is_directory())
+        throw NoriException("The farm directory \"%s\" does not exist!", directory);
+}
+
+std::string RenderFarm::getPath(const std::string &name) const {
+    return (filesystem::path(m_directory) / filesystem::path(name)).str();
+}
+
+void RenderFarm::coordinate(const std::string &filename, const std::string &outputName,
+                            uint32_t sampleCount, const std::vector<std::string> &workerCommand,
+                            int localWorkers, bool progress) {
+    std::unique_ptr<Scene> scene(loadScene(filename, sampleCount));
+    if (scene->getAdaptiveThreshold() > 0 || scene->getTimeBudget() > 0)
+        throw NoriException("Distributed rendering does not support adaptive "
+                            "sampling or time budgets!");
+
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    sampleCount = (uint32_t) scene->getSampler()->getSampleCount();
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+    int taskCount = blockGenerator.getTotalBlockCount();
+
+    /* File names are prefixed by a job ID, so that leftovers of
+       earlier jobs in the same directory are never mistaken for ours */
+    uint64_t now = (uint64_t) std::chrono::system_clock::now().time_since_epoch().count();
+    std::string jobId = tfm::format("%08x", (uint32_t) hashBuffer(&now, sizeof(uint64_t)));
+    auto taskName = [&](int task) { return getPath(tfm::format("%s-task-%05i", jobId, task)); };
+    auto resultName = [&](int task) { return getPath(tfm::format("%s-result-%05i", jobId, task)); };
+
+    std::string jobName = getPath("job");
+    std::vector<int> workers;
+
+    /* Remove all files of the job. A worker that is still rendering one of
+       its tasks notices that the job is gone and discards the result */
+    auto removeJobFiles = [&]() {
+        if (currentJob(jobName) == jobId)
+            std::remove(jobName.c_str());
+        for (int task = 0; task < taskCount; ++task) {
+            std::remove((taskName(task) + ".todo").c_str());
+            std::remove((taskName(task) + ".claimed").c_str());
+            std::remove(resultName(task).c_str());
+        }
+    };
+
+    ImageBlock result(outputSize, camera->getReconstructionFilter());
+    Timer timer;
+
+    try {
+        /* Create the tasks before announcing the job */
+        for (int task = 0; task < taskCount; ++task) {
+            std::ofstream os(taskName(task) + ".todo");
+            if (!os.good())
+                throw NoriException("Unable to create the task file \"%s.todo\"!", taskName(task));
+        }
+
+        {
+            std::ofstream os(jobName + ".tmp");
+            os << jobId << " " << sampleCount << " " << taskCount << " "
+               << outputSize.x() << " " << outputSize.y() << endl;
+            os.close();
+            std::remove(jobName.c_str());
+            if (!os.good() || std::rename((jobName + ".tmp").c_str(), jobName.c_str()) != 0)
+                throw NoriException("Unable to create the job file \"%s\"!", jobName);
+        }
+
+        cout << "Distributing " << taskCount << " blocks of " << sampleCount
+             << " samples per pixel through \"" << m_directory << "\"" << endl;
+
+        /* Start the local worker processes */
+#if defined(_WIN32)
+        if (localWorkers > 0)
+            throw NoriException("Starting local worker processes is not supported on Windows!");
+#else
+        std::vector<char *> args;
+        for (const std::string &arg : workerCommand)
+            args.push_back(const_cast<char *>(arg.c_str()));
+        args.push_back(nullptr);
+
+        for (int i = 0; i < localWorkers; ++i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                execvp(args[0], args.data());
+                _exit(127);
+            } else if (pid < 0) {
+                throw NoriException("Unable to start a worker process!");
+            }
+            workers.push_back((int) pid);
+        }
+#endif
+
+        cout << "Rendering .. ";
+        cout.flush();
+        timer.reset();
+
+        /* Merge the blocks as their results arrive */
+        ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+        result.clear();
+
+        std::vector<bool> merged(taskCount, false);
+        int mergedCount = 0, firstPending = 0, lastPercent = -1;
+
+        /* Modification times of the claimed tasks and when they last changed
+           (measured by this process, since the clocks of the machines may differ) */
+        std::map<int, std::pair<int64_t, double>> claims;
+        double lastClaimCheck = 0;
+
+        while (mergedCount < taskCount) {
+            for (int task = firstPending; task < taskCount; ++task) {
+                if (merged[task])
+                    continue;
+                std::ifstream is(resultName(task), std::ios::binary);
+                if (!is.is_open())
+                    continue;
+
+                FarmResultHeader header;
+                is.read((char *) &header, sizeof(FarmResultHeader));
+                if (!is.good() || memcmp(header.magic, FARM_RESULT_MAGIC, sizeof(FARM_RESULT_MAGIC)) != 0 ||
+                    header.version != FARM_RESULT_VERSION)
+                    throw NoriException("\"%s\" is not a valid result file!", resultName(task));
+                block.setOffset(Point2i(header.offset[0], header.offset[1]));
+                block.setSize(Vector2i(header.size[0], header.size[1]));
+                block.setBlockId(header.blockId);
+                block.loadState(is);
+                is.close();
+
+                result.put(block);
+                std::remove(resultName(task).c_str());
+                std::remove((taskName(task) + ".claimed").c_str());
+                merged[task] = true;
+                mergedCount++;
+            }
+            while (firstPending < taskCount && merged[firstPending])
+                ++firstPending;
+
+            int percent = (int) (100.f * mergedCount / taskCount);
+            if (progress && percent != lastPercent && percent < 100) {
+                cout << "Progress: " << percent << "%" << endl;
+                lastPercent = percent;
+            }
+
+            /* Workers touch the files of their claimed tasks regularly. Return
+               the tasks of workers that have stopped (e.g. a worker on another
+               machine that was killed) to the queue */
+            if (timer.elapsed() - lastClaimCheck >= NORI_FARM_HEARTBEAT_INTERVAL) {
+                double time = lastClaimCheck = timer.elapsed();
+                for (int task = firstPending; task < taskCount; ++task) {
+                    std::string claimName = taskName(task) + ".claimed";
+                    int64_t mtime = merged[task] ? -1 : modificationTime(claimName);
+                    if (mtime < 0) {
+                        claims.erase(task);
+                        continue;
+                    }
+                    auto it = claims.find(task);
+                    if (it == claims.end() || it->second.first != mtime) {
+                        claims[task] = std::make_pair(mtime, time);
+                    } else if (time - it->second.second > NORI_FARM_CLAIM_TIMEOUT &&
+                               std::rename(claimName.c_str(), (taskName(task) + ".todo").c_str()) == 0) {
+                        cerr << "Warning: the worker rendering block " << task
+                             << " stopped responding, rescheduling it." << endl;
+                        claims.erase(it);
+                    }
+                }
+            }
+
+#if !defined(_WIN32)
+            /* Give up if a local worker fails, since its tasks would never finish */
+            for (int &pid : workers) {
+                int status = 0;
+                if (pid > 0 && waitpid((pid_t) pid, &status, WNOHANG) == pid) {
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                        throw NoriException("A worker process failed, giving up!");
+                    pid = 0;
+                }
+            }
+#endif
+
+            if (mergedCount < taskCount)
+                std::this_thread::sleep_for(std::chrono::milliseconds(NORI_FARM_POLL_INTERVAL));
+        }
+    } catch (...) {
+        /* Leave neither workers nor tasks behind that would never be merged */
+#if !defined(_WIN32)
+        for (int pid : workers) {
+            if (pid > 0) {
+                kill((pid_t) pid, SIGTERM);
+                waitpid((pid_t) pid, nullptr, 0);
+            }
+        }
+#endif
+        removeJobFiles();
+        throw;
+    }
+
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+    /* Also removes the results of rescheduled tasks that were rendered twice */
+    removeJobFiles();
+
+#if !defined(_WIN32)
+    for (int pid : workers)
+        if (pid > 0)
+            waitpid((pid_t) pid, nullptr, 0);
+#endif
+
+    if (m_rawOutput) {
+        result.saveEXR(outputName, sampleCount, { scene->getSampler()->getSeed() });
+        return;
+    }
+
+    /* Now turn the merged image block into a properly normalized bitmap */
+    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+    bitmap->setAttribute("sampleCount", (int) sampleCount);
+    bitmap->setAttribute("renderTime", (float) (timer.elapsed() / 1000.0));
+    bitmap->save(outputName);
+}
+
+void RenderFarm::work(const std::string &filename, int threadCount) {
+    /* Wait until the coordinator announces a job */
+    std::string jobName = getPath("job");
+    std::ifstream job(jobName);
+    if (!job.is_open()) {
+        cout << "Waiting for a job in \"" << m_directory << "\" .. " << endl;
+        while (!job.is_open()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(NORI_FARM_POLL_INTERVAL));
+            job.open(jobName);
+        }
+    }
+
+    std::string jobId;
+    uint32_t sampleCount = 0;
+    int taskCount = 0;
+    Vector2i size;
+    job >> jobId >> sampleCount >> taskCount >> size.x() >> size.y();
+    if (job.fail())
+        throw NoriException("Invalid job file \"%s\"!", jobName);
+
+    std::unique_ptr<Scene> scene(loadScene(filename, sampleCount));
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+    if (outputSize != size || blockGenerator.getTotalBlockCount() != taskCount)
+        throw NoriException("The job in \"%s\" belongs to a different scene!", m_directory);
+    scene->getIntegrator()->preprocess(scene.get());
+
+    /* The tasks are numbered in the order of the block generator */
+    std::vector<FarmResultHeader> tasks(taskCount);
+    ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+    for (FarmResultHeader &task : tasks) {
+        blockGenerator.next(block);
+        memcpy(task.magic, FARM_RESULT_MAGIC, sizeof(FARM_RESULT_MAGIC));
+        task.version = FARM_RESULT_VERSION;
+        task.blockId = block.getBlockId();
+        task.offset[0] = block.getOffset().x(); task.offset[1] = block.getOffset().y();
+        task.size[0] = block.getSize().x(); task.size[1] = block.getSize().y();
+    }
+
+    cout << "Rendering .. ";
+    cout.flush();
+    Timer timer;
+
+    /* Touch the files of the claimed tasks regularly, which tells the
+       coordinator that this worker is still alive (see coordinate()) */
+    std::mutex claimMutex;
+    std::set<std::string> claims;
+    std::atomic<bool> finished(false);
+    std::thread heartbeat([&] {
+        int elapsed = 0;
+        while (!finished) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(NORI_FARM_POLL_INTERVAL));
+            elapsed += NORI_FARM_POLL_INTERVAL;
+            if (elapsed < NORI_FARM_HEARTBEAT_INTERVAL)
+                continue;
+            elapsed = 0;
+            std::lock_guard<std::mutex> guard(claimMutex);
+            for (const std::string &claim : claims) {
+                /* Does not create the file if the claim was dropped in the meantime */
+                std::fstream fs(claim, std::ios::in | std::ios::out);
+                fs << 'h';
+            }
+        }
+    });
+
+    std::atomic<int> rendered(0);
+    try {
+        /* Keep looking for tasks while the job is active, since the
+           coordinator reschedules the tasks of failed workers */
+        while (currentJob(jobName) == jobId) {
+            std::atomic<int> nextTask(0), claimed(0);
+            tbb::parallel_for(0, threadCount, [&](int) {
+                ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+
+                for (int task = nextTask++; task < taskCount; task = nextTask++) {
+                    /* Claim the task, unless another worker was faster */
+                    std::string taskName = getPath(tfm::format("%s-task-%05i", jobId, task));
+                    std::string claimName = taskName + ".claimed";
+                    if (std::rename((taskName + ".todo").c_str(), claimName.c_str()) != 0)
+                        continue;
+                    claimed++;
+                    {
+                        std::lock_guard<std::mutex> guard(claimMutex);
+                        claims.insert(claimName);
+                    }
+
+                    const FarmResultHeader &header = tasks[task];
+                    block.setOffset(Point2i(header.offset[0], header.offset[1]));
+                    block.setSize(Vector2i(header.size[0], header.size[1]));
+                    block.setBlockId(header.blockId);
+
+                    std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+                    sampler->prepare(block);
+                    RenderThread::renderBlock(scene.get(), sampler.get(), block, 0, sampleCount);
+
+                    {
+                        std::lock_guard<std::mutex> guard(claimMutex);
+                        claims.erase(claimName);
+                    }
+
+                    /* Write to a temporary file first, so that the
+                       coordinator never reads an incomplete result */
+                    std::string resultName = getPath(tfm::format("%s-result-%05i", jobId, task));
+                    std::ofstream os(resultName + ".tmp", std::ios::binary);
+                    os.write((const char *) &header, sizeof(FarmResultHeader));
+                    block.saveState(os);
+                    os.close();
+
+                    /* Discard the result if the job has ended (or failed) in the meantime */
+                    if (currentJob(jobName) != jobId) {
+                        std::remove((resultName + ".tmp").c_str());
+                        continue;
+                    }
+                    if (!os.good() || std::rename((resultName + ".tmp").c_str(), resultName.c_str()) != 0)
+                        throw NoriException("Unable to write the result file \"%s\"!", resultName);
+                    rendered++;
+                }
+            });
+
+            /* Wait a while before looking again, but notice the end of the job quickly */
+            for (int elapsed = 0; claimed == 0 && elapsed < NORI_FARM_HEARTBEAT_INTERVAL &&
+                    currentJob(jobName) == jobId; elapsed += NORI_FARM_POLL_INTERVAL)
+                std::this_thread::sleep_for(std::chrono::milliseconds(NORI_FARM_POLL_INTERVAL));
+        }
+    } catch (...) {
+        finished = true;
+        heartbeat.join();
+        throw;
+    }
+    finished = true;
+    heartbeat.join();
+
+    cout << "done. (took " << timer.elapsedString() << ", " << rendered
+         << " of " << taskCount << " blocks)" << endl;
+}
+
+NORI_NAMESPACE_END
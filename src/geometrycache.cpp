@@ -0,0 +1,83 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/geometrycache.h>
+
+NORI_NAMESPACE_BEGIN
+
+void GeometryCache::setEnabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled)
+        clear();
+}
+
+std::string GeometryCache::getMeshKey(const std::string &filename, const Transform &trafo) {
+    /* Append the raw matrix, so that only identical transforms match */
+    const Eigen::Matrix4f &matrix = trafo.getMatrix();
+    return filename + '\0' + std::string((const char *) matrix.data(), sizeof(float) * 16);
+}
+
+std::shared_ptr<const GeometryCache::MeshData> GeometryCache::getMesh(
+        const std::string &filename, const Transform &trafo) {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    auto it = m_meshes.find(getMeshKey(filename, trafo));
+    if (it == m_meshes.end())
+        return nullptr;
+    m_meshHits++;
+    return it->second;
+}
+
+void GeometryCache::putMesh(const std::string &filename, const Transform &trafo,
+                            const std::shared_ptr<const MeshData> &mesh) {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    m_meshes[getMeshKey(filename, trafo)] = mesh;
+}
+
+std::shared_ptr<const GeometryCache::TreeData> GeometryCache::getTree(uint64_t hash) {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    auto it = m_trees.find(hash);
+    if (it == m_trees.end())
+        return nullptr;
+    m_treeHits++;
+    return it->second;
+}
+
+void GeometryCache::putTree(uint64_t hash, const std::shared_ptr<const TreeData> &tree) {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    m_trees[hash] = tree;
+}
+
+void GeometryCache::clear() {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    m_meshes.clear();
+    m_trees.clear();
+    m_meshHits = m_treeHits = 0;
+}
+
+std::string GeometryCache::toString() const {
+    tbb::mutex::scoped_lock lock(m_mutex);
+    return tfm::format("%i meshes (reused %i times), %i BVH trees (reused %i times)",
+        m_meshes.size(), m_meshHits, m_trees.size(), m_treeHits);
+}
+
+GeometryCache *getGeometryCache() {
+    static GeometryCache *cache = new GeometryCache();
+    return cache;
+}
+
+NORI_NAMESPACE_END
@@ -140,17 +140,22 @@ NoriScreen::~NoriScreen() {
 }
 
 void NoriScreen::drawContents() {
-    /* Reload the partially rendered image onto the GPU */
+    /* Reload the partially rendered image onto the GPU when the
+       render thread has stored a new snapshot */
     m_block.lock();
     int borderSize = m_block.getBorderSize();
     const Vector2i &size = m_block.getSize();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texture);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, m_block.cols());
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(),
-            0, GL_RGBA, GL_FLOAT, (uint8_t *) m_block.data() +
-            (borderSize * m_block.cols() + borderSize) * sizeof(Color4f));
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    uint32_t version = m_renderThread.getSnapshotVersion();
+    if (version != m_textureVersion) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, m_block.cols());
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(),
+                0, GL_RGBA, GL_FLOAT, (uint8_t *) m_block.data() +
+                (borderSize * m_block.cols() + borderSize) * sizeof(Color4f));
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        m_textureVersion = version;
+    }
     m_block.unlock();
 
     m_progressBar->setValue(m_renderThread.getProgress());
@@ -240,6 +245,7 @@ void NoriScreen::openEXR(const std::string &filename) {
     m_block.fromBitmap(bitmap);
     Vector2i bsize = m_block.getSize();
     m_block.unlock();
+    m_textureVersion = (uint32_t) -1;
 
     Vector2i wsize = bsize + Vector2i(0, PANEL_HEIGHT);
     glfwSetWindowSize(glfwWindow(),wsize.x(),wsize.y());
@@ -0,0 +1,152 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+#include <nori/block.h>
+
+/* Number of dimensions with their own prime base, further ones are padded with random numbers */
+#define NORI_HALTON_DIMENSIONS 128
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Halton sampling - returns the points of a scrambled Halton sequence,
+ * whose dimension \c i is the radical inverse of the sample index in the
+ * base of the <tt>i</tt>-th prime.
+ *
+ * Every pixel uses its own random linear scrambling of the digits
+ * (Matousek 1998), derived from a hash of the pixel, the seed and the
+ * dimension. This decorrelates the pixels and breaks up the correlations
+ * between the dimensions of large bases. The sequence is well stratified
+ * for any sample count, but high dimensions converge more slowly than
+ * those of the \c Sobol sampler.
+ */
+class Halton : public Sampler {
+public:
+    Halton(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~Halton() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<Halton> cloned(new Halton());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        cloned->m_pixelSeed = m_pixelSeed;
+        cloned->m_index = m_index;
+        cloned->m_dimension = m_dimension;
+        return cloned;
+    }
+
+    void prepare(const ImageBlock &block) {
+        startPixelSample(block.getOffset(), 0, 0);
+    }
+
+    /// Restart the sequence of the current pixel
+    void generate() { m_index = 0; m_dimension = 0; }
+    void advance()  { m_index++; m_dimension = 0; }
+
+    void startPixelSample(const Point2i &pixel, uint32_t index, uint32_t dimension) {
+        m_pixelSeed = hashCombine(hashCombine(m_seed, (uint32_t) pixel.x()), (uint32_t) pixel.y());
+        m_index = index;
+        m_dimension = dimension;
+    }
+
+    float next1D() {
+        return sample(m_dimension++);
+    }
+
+    Point2f next2D() {
+        float x = sample(m_dimension++);
+        float y = sample(m_dimension++);
+        return Point2f(x, y);
+    }
+
+    /* The samples only depend on the pixel and sample index,
+       which the renderer sets before every sample */
+    bool saveState(std::ostream &os) const { return true; }
+    void loadState(std::istream &is) { }
+
+    virtual std::string toString() const override {
+        return tfm::format("Halton[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    Halton() { }
+
+    /// Return the first \ref NORI_HALTON_DIMENSIONS primes
+    static const std::vector<uint32_t> &getPrimes() {
+        static std::vector<uint32_t> primes = []() {
+            std::vector<uint32_t> result;
+            for (uint32_t n = 2; result.size() < NORI_HALTON_DIMENSIONS; ++n) {
+                bool isPrime = true;
+                for (uint32_t p : result) {
+                    if (p * p > n)
+                        break;
+                    if (n % p == 0) {
+                        isPrime = false;
+                        break;
+                    }
+                }
+                if (isPrime)
+                    result.push_back(n);
+            }
+            return result;
+        }();
+        return primes;
+    }
+
+    /// Compute component \c dimension of the current sample
+    float sample(uint32_t dimension) const {
+        uint32_t seed = hashCombine(m_pixelSeed, dimension);
+        if (dimension >= NORI_HALTON_DIMENSIONS)
+            return (hashCombine(seed, m_index) >> 8) * (1.0f / (1u << 24));
+
+        /* Radical inverse with scrambled digits. The trailing zero digits
+           are scrambled too, until they no longer affect a float. */
+        const uint32_t base = getPrimes()[dimension];
+        const double invBase = 1.0 / base;
+        double invBaseN = 1.0, result = 0.0;
+        uint32_t index = m_index, state = seed;
+        while (index > 0 || invBaseN > 1e-8) {
+            uint32_t digit = index % base;
+            index /= base;
+
+            /* Random linear permutation of the digits: d -> (a*d + c) mod base,
+               with a cheap LCG providing the coefficients of every position */
+            state = state * 747796405u + 2891336453u;
+            uint32_t hash = state ^ (state >> 16);
+            uint32_t a = 1 + (((hash & 0xffffu) * (base - 1)) >> 16),
+                     c = ((hash >> 16) * base) >> 16;
+            digit = (a * digit + c) % base;
+
+            invBaseN *= invBase;
+            result += digit * invBaseN;
+        }
+        return std::min((float) result, 1.0f - std::numeric_limits<float>::epsilon() / 2);
+    }
+
+private:
+    uint32_t m_pixelSeed = 0;
+    uint32_t m_index = 0;
+    uint32_t m_dimension = 0;
+};
+
+NORI_REGISTER_CLASS(Halton, "halton");
+NORI_NAMESPACE_END
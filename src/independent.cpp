@@ -34,6 +34,7 @@ class Independent : public Sampler {
 public:
     Independent(const PropertyList &propList) {
         m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
     }
 
     virtual ~Independent() { }
@@ -41,13 +42,14 @@ public:
     std::unique_ptr<Sampler> clone() const {
         std::unique_ptr<Independent> cloned(new Independent());
         cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
         cloned->m_random = m_random;
-        return std::move(cloned);
+        return cloned;
     }
 
     void prepare(const ImageBlock &block) {
         m_random.seed(
-            block.getOffset().x(),
+            block.getOffset().x() + ((uint64_t) m_seed << 32),
             block.getOffset().y()
         );
     }
@@ -66,8 +68,19 @@ public:
         );
     }
 
+    bool saveState(std::ostream &os) const {
+        os.write((const char *) &m_random.state, sizeof(uint64_t));
+        os.write((const char *) &m_random.inc, sizeof(uint64_t));
+        return true;
+    }
+
+    void loadState(std::istream &is) {
+        is.read((char *) &m_random.state, sizeof(uint64_t));
+        is.read((char *) &m_random.inc, sizeof(uint64_t));
+    }
+
     virtual std::string toString() const override {
-        return tfm::format("Independent[sampleCount=%i]", m_sampleCount);
+        return tfm::format("Independent[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
     }
 protected:
     Independent() { }
@@ -0,0 +1,221 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+ShapeGroup::ShapeGroup(const PropertyList &propList) {
+    m_bvh = new BVH(propList);
+}
+
+ShapeGroup::~ShapeGroup() {
+    delete m_bvh;
+}
+
+void ShapeGroup::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EMesh: {
+                Shape *shape = static_cast<Shape *>(obj);
+                if (dynamic_cast<ShapeGroup *>(shape) || dynamic_cast<Instance *>(shape))
+                    throw NoriException("ShapeGroup: nested instancing is not supported!");
+                if (shape->isEmitter())
+                    throw NoriException("ShapeGroup: instanced shapes cannot be emitters!");
+                m_shapeIndex[shape] = m_bvh->getShapeCount();
+                m_bvh->addShape(shape);
+            }
+            break;
+
+        default:
+            throw NoriException("ShapeGroup::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void ShapeGroup::activate() {
+    if (m_bvh->getShapeCount() == 0)
+        throw NoriException("ShapeGroup \"%s\" is empty!", getIdName());
+    m_bvh->build();
+    m_bbox = m_bvh->getBoundingBox();
+}
+
+void ShapeGroup::refit() {
+    m_bvh->refit();
+    m_bbox = m_bvh->getBoundingBox();
+}
+
+void ShapeGroup::rebuild() {
+    m_bvh->build();
+    m_bbox = m_bvh->getBoundingBox();
+}
+
+uint64_t ShapeGroup::getGeometryHash() const {
+    uint64_t hash = hashBuffer(nullptr, 0);
+    for (uint32_t i = 0; i < m_bvh->getShapeCount(); ++i) {
+        uint64_t shapeHash = m_bvh->getShape(i)->getGeometryHash();
+        hash = hashBuffer(&shapeHash, sizeof(uint64_t), hash);
+    }
+    return hash;
+}
+
+bool ShapeGroup::rayIntersect(uint32_t, const Ray3f &, float &, float &, float &) const {
+    return false; /* Only instances of the group are intersected */
+}
+
+bool ShapeGroup::rayOccluded(const uint32_t *, uint32_t, const Ray3f &) const {
+    return false; /* Only instances of the group are intersected */
+}
+
+void ShapeGroup::setHitInformation(uint32_t, const Ray3f &, Intersection &) const {
+    throw NoriException("ShapeGroup::setHitInformation(): not supported!");
+}
+
+void ShapeGroup::sampleSurface(ShapeQueryRecord &, const Point2f &) const {
+    throw NoriException("ShapeGroup::sampleSurface(): not supported!");
+}
+
+float ShapeGroup::pdfSurface(const ShapeQueryRecord &) const {
+    throw NoriException("ShapeGroup::pdfSurface(): not supported!");
+}
+
+bool ShapeGroup::rayIntersect(Ray3f &ray, float &u, float &v, uint32_t &index, bool shadowRay) const {
+    const Shape *shape;
+    uint32_t prim;
+    Point2f uv;
+
+    if (!m_bvh->rayIntersectPrimitive(ray, shape, prim, uv, shadowRay))
+        return false;
+
+    if (!shadowRay) {
+        /* Encode the shape and primitive as a group-wide primitive index */
+        index = m_bvh->getPrimitiveOffset(m_shapeIndex.find(shape)->second) + prim;
+        u = uv.x();
+        v = uv.y();
+    }
+    return true;
+}
+
+bool ShapeGroup::rayOccluded(const Ray3f &ray) const {
+    return m_bvh->rayOccludedPrimitive(ray);
+}
+
+void ShapeGroup::setHitInformation(const Ray3f &ray, uint32_t index, Intersection &its) const {
+    const Shape *shape = m_bvh->getShape(m_bvh->findShape(index));
+    its.mesh = shape;
+    shape->setHitInformation(index, ray, its);
+}
+
+std::string ShapeGroup::toString() const {
+    std::string shapes;
+    for (uint32_t i = 0; i < m_bvh->getShapeCount(); ++i) {
+        shapes += std::string("  ") + indent(m_bvh->getShape(i)->toString(), 2);
+        if (i + 1 < m_bvh->getShapeCount())
+            shapes += ",";
+        shapes += "\n";
+    }
+
+    return tfm::format(
+        "ShapeGroup[\n"
+        "  name = \"%s\",\n"
+        "  shapes = {\n"
+        "  %s  }\n"
+        "]",
+        getIdName(),
+        indent(shapes, 2)
+    );
+}
+
+Instance::Instance(const PropertyList &propList) {
+    m_groupName = propList.getString("shapegroup");
+    m_toWorld = propList.getTransform("toWorld", Transform());
+    m_toLocal = m_toWorld.inverse();
+}
+
+void Instance::setShapeGroup(const ShapeGroup *group) {
+    m_group = group;
+    updateBoundingBox();
+}
+
+void Instance::updateBoundingBox() {
+    /* Bound the transformed corners of the group's bounding box */
+    const BoundingBox3f &bbox = m_group->getBoundingBox();
+    m_bbox.reset();
+    for (int i = 0; i < 8; ++i)
+        m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+}
+
+uint64_t Instance::getGeometryHash() const {
+    uint64_t hash = m_group->getGeometryHash();
+    return hashBuffer(m_toWorld.getMatrix().data(), sizeof(float) * 16, hash);
+}
+
+bool Instance::rayIntersect(uint32_t index, const Ray3f &_ray, float &u, float &v, float &t) const {
+    Ray3f ray(_ray);
+    uint32_t prim;
+    if (!rayIntersectPrimitives(&index, 1, ray, u, v, prim, false))
+        return false;
+    t = ray.maxt;
+    return true;
+}
+
+bool Instance::rayIntersectPrimitives(const uint32_t *, uint32_t, Ray3f &ray,
+                                      float &u, float &v, uint32_t &index, bool shadowRay) const {
+    /* The transformed direction is not normalized, hence
+       distances along the ray are the same in both spaces */
+    Ray3f localRay = m_toLocal * ray;
+    if (!m_group->rayIntersect(localRay, u, v, index, shadowRay))
+        return false;
+    ray.maxt = localRay.maxt;
+    return true;
+}
+
+bool Instance::rayOccluded(const uint32_t *, uint32_t, const Ray3f &ray) const {
+    return m_group->rayOccluded(m_toLocal * ray);
+}
+
+void Instance::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
+    m_group->setHitInformation(m_toLocal * ray, index, its);
+
+    its.p = m_toWorld * its.p;
+    its.geoFrame = Frame((m_toWorld * its.geoFrame.n).normalized());
+    its.shFrame = Frame((m_toWorld * its.shFrame.n).normalized());
+}
+
+void Instance::sampleSurface(ShapeQueryRecord &, const Point2f &) const {
+    throw NoriException("Instance::sampleSurface(): not supported!");
+}
+
+float Instance::pdfSurface(const ShapeQueryRecord &) const {
+    throw NoriException("Instance::pdfSurface(): not supported!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  shapegroup = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_groupName,
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(ShapeGroup, "shapegroup");
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
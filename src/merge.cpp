@@ -0,0 +1,114 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/bitmap.h>
+#include <filesystem/path.h>
+#include <memory>
+#include <map>
+
+using namespace nori;
+
+/* Combines the raw outputs of several renderings of the same scene (with
+   different seeds, see 'nori-cli --raw --seed') into one image. Since the
+   filter weights are summed along with the weighted radiance, the result
+   equals that of a single rendering with all of the samples. Renderings
+   with the same seed contain the same samples, so they are rejected. */
+
+static void help() {
+    cout << "Syntax: nori-merge [options] <raw1.exr> <raw2.exr> ..." << endl
+         << "Options:" << endl
+         << "   -o, --output <file>  Output image (default: merged.exr)" << endl
+         << "   -R, --raw            Write raw weighted samples again (for merging later)" << endl
+         << "   -h, --help           Display this message" << endl;
+}
+
+int main(int argc, char **argv) {
+    try {
+        std::string outputName = "merged.exr";
+        std::vector<std::string> filenames;
+        bool rawOutput = false;
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+
+            if (arg == "-h" || arg == "--help") {
+                help();
+                return 0;
+            } else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+                outputName = argv[++i];
+            } else if (arg == "-R" || arg == "--raw") {
+                rawOutput = true;
+            } else if (arg.size() > 0 && arg[0] != '-' && filesystem::path(arg).extension() == "exr") {
+                filenames.push_back(arg);
+            } else {
+                cerr << "Error: invalid argument \"" << arg << "\"" << endl;
+                help();
+                return -1;
+            }
+        }
+
+        if (filenames.empty()) {
+            help();
+            return -1;
+        }
+
+        ImageBlock merged(Vector2i(0, 0), nullptr), block(Vector2i(0, 0), nullptr);
+        std::vector<uint32_t> seeds, allSeeds;
+        std::map<uint32_t, std::string> seedFiles;
+        uint32_t sampleCount = 0;
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            ImageBlock &target = i == 0 ? merged : block;
+            sampleCount += target.loadEXR(filenames[i], &seeds);
+            if (seeds.empty())
+                cerr << "Warning: \"" << filenames[i] << "\" does not record its seed, "
+                     << "so it cannot be checked for duplicate samples." << endl;
+            for (uint32_t seed : seeds) {
+                auto it = seedFiles.find(seed);
+                if (it != seedFiles.end())
+                    throw NoriException("\"%s\" and \"%s\" were both rendered with seed %i "
+                                        "and contain the same samples!", it->second,
+                                        filenames[i], seed);
+                seedFiles[seed] = filenames[i];
+                allSeeds.push_back(seed);
+            }
+            if (i == 0)
+                continue;
+            if (block.getSize() != merged.getSize())
+                throw NoriException("\"%s\" has a different size than \"%s\"!",
+                                    filenames[i], filenames[0]);
+            merged += block;
+        }
+
+        cout << "Merged " << filenames.size() << " images with a total of "
+             << sampleCount << " samples per pixel." << endl;
+
+        if (rawOutput) {
+            merged.saveEXR(outputName, sampleCount, allSeeds);
+        } else {
+            /* Divide by the summed filter weights */
+            std::unique_ptr<Bitmap> bitmap(merged.toBitmap());
+            bitmap->setAttribute("sampleCount", (int) sampleCount);
+            bitmap->save(outputName);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
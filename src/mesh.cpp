@@ -29,7 +29,11 @@ Mesh::Mesh() { }
 
 void Mesh::activate() {
     Shape::activate();
+    buildAreaPdf();
+}
 
+void Mesh::buildAreaPdf() {
+    m_pdf.clear();
     m_pdf.reserve(getPrimitiveCount());
     for(uint32_t i = 0 ; i < getPrimitiveCount() ; ++i) {
         m_pdf.append(surfaceArea(i));
@@ -37,6 +41,23 @@ void Mesh::activate() {
     m_pdf.normalize();
 }
 
+void Mesh::setVertexPositions(const MatrixXf &positions, const MatrixXf &normals) {
+    if (positions.rows() != 3 || positions.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex positions!", m_V.cols());
+    if (normals.size() > 0 && (normals.rows() != 3 || normals.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex normals!", m_V.cols());
+
+    m_V = positions;
+    if (normals.size() > 0)
+        m_N = normals;
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+
+    buildAreaPdf();
+}
+
 void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
     Point2f s = sample;
     size_t idT = m_pdf.sampleReuse(s.x());
@@ -119,6 +140,63 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+bool Mesh::rayIntersectPrimitives(const uint32_t *indices, uint32_t count, Ray3f &ray,
+                                  float &u, float &v, uint32_t &index, bool shadowRay) const {
+    bool foundIntersection = false;
+    for (uint32_t i = 0; i < count; ++i) {
+        float triU, triV, t;
+        /* Qualified call, which the compiler can inline */
+        if (Mesh::rayIntersect(indices[i], ray, triU, triV, t)) {
+            ray.maxt = t;
+            u = triU;
+            v = triV;
+            index = indices[i];
+            foundIntersection = true;
+            if (shadowRay)
+                break;
+        }
+    }
+    return foundIntersection;
+}
+
+bool Mesh::rayOccluded(uint32_t index, const Ray3f &ray) const {
+    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+
+    Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+    Vector3f pvec = ray.d.cross(edge2);
+    float det = edge1.dot(pvec);
+
+    if (det > -1e-8f && det < 1e-8f)
+        return false;
+
+    /* Flip the signs so that the determinant is positive, after which
+       the bounds on U, V, and t can be tested without a division */
+    float sign = det < 0 ? -1.0f : 1.0f;
+    det *= sign;
+
+    Vector3f tvec = ray.o - p0;
+    float u = tvec.dot(pvec) * sign;
+    if (u < 0.0f || u > det)
+        return false;
+
+    Vector3f qvec = tvec.cross(edge1);
+    float v = ray.d.dot(qvec) * sign;
+    if (v < 0.0f || u + v > det)
+        return false;
+
+    float t = edge2.dot(qvec) * sign;
+    return t >= ray.mint * det && t <= ray.maxt * det;
+}
+
+bool Mesh::rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (Mesh::rayOccluded(indices[i], ray))
+            return true;
+    }
+    return false;
+}
+
 void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
     /* Find the barycentric coordinates */
     Vector3f bary;
@@ -165,6 +243,50 @@ BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     return result;
 }
 
+BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const {
+    /* Clip the triangle against the six planes of the box
+       (Sutherland-Hodgman), which leaves at most 9 vertices */
+    Point3f vertices[2][9];
+    int count = 3;
+    for (int i = 0; i < 3; ++i)
+        vertices[0][i] = m_V.col(m_F(i, index));
+
+    for (int axis = 0, cur = 0; axis < 3 && count > 0; ++axis) {
+        for (int side = 0; side < 2 && count > 0; ++side, cur = 1 - cur) {
+            const Point3f *in = vertices[cur];
+            Point3f *out = vertices[1 - cur];
+            float plane = side == 0 ? clip.min[axis] : clip.max[axis],
+                  sign = side == 0 ? 1.0f : -1.0f;
+            int outCount = 0;
+
+            for (int i = 0; i < count; ++i) {
+                const Point3f &p0 = in[i], &p1 = in[(i + 1) % count];
+                float d0 = sign * (p0[axis] - plane), d1 = sign * (p1[axis] - plane);
+                if (d0 >= 0)
+                    out[outCount++] = p0;
+                if ((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0)) {
+                    Point3f p = p0 + (d0 / (d0 - d1)) * (p1 - p0);
+                    p[axis] = plane; /* Avoid roundoff errors */
+                    out[outCount++] = p;
+                }
+            }
+            count = outCount;
+        }
+    }
+
+    /* After six clipping passes, the result is in vertices[0] again */
+    BoundingBox3f result;
+    for (int i = 0; i < count; ++i)
+        result.expandBy(vertices[0][i]);
+    result.clip(clip);
+    return result;
+}
+
+uint64_t Mesh::getGeometryHash() const {
+    uint64_t hash = hashBuffer(m_V.data(), sizeof(float) * m_V.size());
+    return hashBuffer(m_F.data(), sizeof(uint32_t) * m_F.size(), hash);
+}
+
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
         (m_V.col(m_F(0, index)) +
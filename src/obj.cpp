@@ -18,6 +18,7 @@
 
 #include <nori/mesh.h>
 #include <nori/timer.h>
+#include <nori/geometrycache.h>
 #include <filesystem/resolver.h>
 #include <unordered_map>
 #include <fstream>
@@ -39,6 +40,19 @@ public:
         if (is.fail())
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        m_name = filename.str();
+
+        /* Scenes rendered by the same process may share the mesh */
+        GeometryCache *cache = getGeometryCache();
+        if (cache->isEnabled()) {
+            if (std::shared_ptr<const GeometryCache::MeshData> mesh = cache->getMesh(m_name, trafo)) {
+                m_V = mesh->V; m_N = mesh->N; m_UV = mesh->UV; m_F = mesh->F;
+                m_bbox = mesh->bbox;
+                cout << "Reusing \"" << filename << "\" (V=" << m_V.cols()
+                     << ", F=" << m_F.cols() << ")." << endl;
+                return;
+            }
+        }
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
@@ -123,12 +137,18 @@ public:
                 m_UV.col(i) = texcoords.at(vertices[i].uv-1);
         }
 
-        m_name = filename.str();
         cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
              << timer.elapsedString() << " and "
              << memString(m_F.size() * sizeof(uint32_t) +
                           sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
              << ")" << endl;
+
+        if (cache->isEnabled()) {
+            std::shared_ptr<GeometryCache::MeshData> mesh(new GeometryCache::MeshData());
+            mesh->V = m_V; mesh->N = m_N; mesh->UV = m_UV; mesh->F = m_F;
+            mesh->bbox = m_bbox;
+            cache->putMesh(m_name, trafo, mesh);
+        }
     }
 
 protected:
@@ -0,0 +1,195 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <chrono>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Consistency test for the batched ray queries of \ref Scene
+ *
+ * This test loads a scene and traces two sets of rays through it: coherent
+ * rays through the pixels of the scene's camera, and segments between
+ * random points within the scene. Each set is traced with the batched
+ * intersection and occlusion queries (in batches of \c batchSize rays) and
+ * with the corresponding single-ray queries. A set passes when both agree
+ * on every ray. The test also reports the time taken by either variant.
+ */
+class PacketTest : public NoriObject {
+public:
+    PacketTest(const PropertyList &propList) {
+        /* Scene file that is ray traced */
+        m_filename = propList.getString("filename");
+
+        /* Number of random ray segments */
+        m_rayCount = propList.getInteger("rayCount", 100000);
+
+        /* Number of rays per batched query */
+        m_batchSize = propList.getInteger("batchSize", 1000);
+
+        if (m_rayCount <= 0 || m_batchSize <= 0)
+            throw NoriException("PacketTest: the ray count and batch size must be positive!");
+    }
+
+    /// Compare the batched with the single-ray queries
+    virtual void activate() override {
+        /* Resources are referenced relative to the scene file */
+        filesystem::path path = getFileResolver()->resolve(m_filename);
+        getFileResolver()->prepend(path.parent_path());
+
+        NoriObject *root = loadFromXML(path.str());
+        if (root->getClassType() != EScene) {
+            delete root;
+            throw NoriException("PacketTest: \"%s\" does not contain a scene!", m_filename);
+        }
+        std::unique_ptr<Scene> scene(static_cast<Scene *>(root));
+
+        /* Camera rays through the pixel centers in scanline order */
+        const Camera *camera = scene->getCamera();
+        Vector2i size = camera->getOutputSize();
+        std::vector<Ray3f> cameraRays;
+        cameraRays.reserve(size.x() * size.y());
+        for (int y = 0; y < size.y(); ++y) {
+            for (int x = 0; x < size.x(); ++x) {
+                Ray3f ray;
+                camera->sampleRay(ray, Point2f(x + 0.5f, y + 0.5f), Point2f(0.5f, 0.5f));
+                cameraRays.push_back(ray);
+            }
+        }
+
+        /* Segments between random points within the scene */
+        BoundingBox3f bbox = scene->getBoundingBox();
+        std::vector<Ray3f> randomRays;
+        randomRays.reserve(m_rayCount);
+        pcg32 random;
+        auto randomPoint = [&]() {
+            return Point3f(bbox.min + bbox.getExtents().cwiseProduct(
+                Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat())));
+        };
+        for (int i = 0; i < m_rayCount; ++i) {
+            Point3f o = randomPoint(), p = randomPoint();
+            Vector3f d = p - o;
+            float length = d.norm();
+            if (length == 0)
+                continue;
+            randomRays.emplace_back(o, d / length, Epsilon, length);
+        }
+
+        int passed = 0;
+        passed += test("Camera rays", scene.get(), cameraRays) ? 1 : 0;
+        passed += test("Random segments", scene.get(), randomRays) ? 1 : 0;
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Passed " << passed << "/2 tests." << endl;
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "PacketTest[\n"
+            "  filename = \"%s\",\n"
+            "  rayCount = %i,\n"
+            "  batchSize = %i\n"
+            "]",
+            m_filename,
+            m_rayCount,
+            m_batchSize
+        );
+    }
+
+    virtual EClassType getClassType() const override { return ETest; }
+private:
+    /// Trace a set of rays in both ways and report whether the results agree
+    bool test(const std::string &name, const Scene *scene, const std::vector<Ray3f> &rays) const {
+        cout << "------------------------------------------------------" << endl;
+        cout << name << " (" << rays.size() << ")" << endl;
+
+        /* Batches take less than the millisecond resolution of Timer */
+        typedef std::chrono::steady_clock Clock;
+        auto elapsed = [](Clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        };
+
+        size_t count = rays.size();
+        std::vector<Intersection> its(count), batchIts(count);
+        std::unique_ptr<bool[]> hits(new bool[count]), occluded(new bool[count]),
+            batchOccluded(new bool[count]);
+
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < count; ++i)
+            hits[i] = scene->rayIntersect(rays[i], its[i]);
+        double singleTime = elapsed(start);
+
+        start = Clock::now();
+        size_t batchHits = 0;
+        for (size_t i = 0; i < count; i += m_batchSize)
+            batchHits += scene->rayIntersect(&rays[i], &batchIts[i],
+                std::min((size_t) m_batchSize, count - i));
+        double batchTime = elapsed(start);
+
+        start = Clock::now();
+        for (size_t i = 0; i < count; ++i)
+            occluded[i] = scene->rayIntersect(rays[i]);
+        double singleShadowTime = elapsed(start);
+
+        start = Clock::now();
+        for (size_t i = 0; i < count; i += m_batchSize)
+            scene->rayIntersect(&rays[i], &batchOccluded[i],
+                std::min((size_t) m_batchSize, count - i));
+        double batchShadowTime = elapsed(start);
+
+        size_t hitMismatches = 0, occlusionMismatches = 0, scalarHits = 0;
+        for (size_t i = 0; i < count; ++i) {
+            bool batchHit = batchIts[i].mesh != nullptr;
+            if (hits[i] != batchHit || (hits[i] && (its[i].mesh != batchIts[i].mesh ||
+                    std::abs(its[i].t - batchIts[i].t) > 1e-4f * std::max(1.f, its[i].t))))
+                ++hitMismatches;
+            if (occluded[i] != batchOccluded[i])
+                ++occlusionMismatches;
+            scalarHits += hits[i] ? 1 : 0;
+        }
+
+        cout << "Intersection: " << timeString(singleTime, true) << " single, "
+             << timeString(batchTime, true) << " batched" << endl;
+        cout << "Occlusion: " << timeString(singleShadowTime, true) << " single, "
+             << timeString(batchShadowTime, true) << " batched" << endl;
+
+        if (hitMismatches == 0 && occlusionMismatches == 0 && batchHits == scalarHits) {
+            cout << "Accepted: all " << count << " rays agree with the single-ray queries." << endl;
+            return true;
+        } else {
+            cout << "Rejected: " << hitMismatches << " intersections and " << occlusionMismatches
+                 << " occlusion queries of " << count << " rays disagree with the single-ray queries";
+            if (batchHits != scalarHits)
+                cout << " (" << batchHits << " vs. " << scalarHits << " hits reported)";
+            cout << "!" << endl;
+            return false;
+        }
+    }
+
+    std::string m_filename;
+    int m_rayCount;
+    int m_batchSize;
+};
+
+NORI_REGISTER_CLASS(PacketTest, "packettest");
+NORI_NAMESPACE_END
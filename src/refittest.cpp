@@ -0,0 +1,196 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/mesh.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <chrono>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Animation test for \ref BVH::refit()
+ *
+ * This test loads a scene twice and animates the vertices of all of its
+ * meshes (shapes in shape groups are left as they are) with a wave that
+ * travels through the scene. In every frame, the BVH of the first copy is
+ * refitted, while that of the second copy is rebuilt from scratch. A frame
+ * passes when both trees report the same intersections for a fixed set of
+ * random rays. The test also compares the time needed for the refit and
+ * the full build, and the resulting traversal performance.
+ */
+class BVHRefitTest : public NoriObject {
+public:
+    BVHRefitTest(const PropertyList &propList) {
+        /* Scene file whose meshes are animated */
+        m_filename = propList.getString("filename");
+
+        /* Number of animated frames */
+        m_frameCount = propList.getInteger("frames", 10);
+
+        /* Amplitude of the wave relative to the diagonal of the scene */
+        m_amplitude = propList.getFloat("amplitude", 0.02f);
+
+        /* Number of random rays traced per frame */
+        m_rayCount = propList.getInteger("rayCount", 100000);
+
+        if (m_frameCount <= 0 || m_rayCount <= 0)
+            throw NoriException("BVHRefitTest: the frame and ray counts must be positive!");
+    }
+
+    /// Animate the scenes and compare the refitted with the rebuilt BVH
+    virtual void activate() override {
+        /* Resources are referenced relative to the scene file */
+        filesystem::path path = getFileResolver()->resolve(m_filename);
+        getFileResolver()->prepend(path.parent_path());
+
+        std::unique_ptr<Scene> scenes[2];
+        for (int i = 0; i < 2; ++i) {
+            NoriObject *root = loadFromXML(path.str());
+            if (root->getClassType() != EScene) {
+                delete root;
+                throw NoriException("BVHRefitTest: \"%s\" does not contain a scene!", m_filename);
+            }
+            scenes[i].reset(static_cast<Scene *>(root));
+        }
+
+        std::vector<Mesh *> meshes[2];
+        std::vector<MatrixXf> positions;
+        for (int i = 0; i < 2; ++i) {
+            for (auto shape : scenes[i]->getShapes()) {
+                if (Mesh *mesh = dynamic_cast<Mesh *>(shape)) {
+                    meshes[i].push_back(mesh);
+                    if (i == 0)
+                        positions.push_back(mesh->getVertexPositions());
+                }
+            }
+        }
+        if (meshes[0].empty())
+            throw NoriException("BVHRefitTest: \"%s\" does not contain any meshes!", m_filename);
+
+        /* Rays with random origins within the scene and random directions */
+        BoundingBox3f bbox = scenes[0]->getBoundingBox();
+        float diagonal = bbox.getExtents().norm();
+        std::vector<Ray3f> rays;
+        rays.reserve(m_rayCount);
+        pcg32 random;
+        for (int i = 0; i < m_rayCount; ++i) {
+            Point3f o = bbox.min + bbox.getExtents().cwiseProduct(
+                Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat()));
+            float z = 1 - 2 * random.nextFloat(), phi = 2 * M_PI * random.nextFloat();
+            float r = std::sqrt(std::max(0.f, 1 - z * z));
+            rays.emplace_back(o, Vector3f(r * std::cos(phi), r * std::sin(phi), z));
+        }
+
+        /* Refits of small scenes take less than the millisecond resolution of Timer */
+        typedef std::chrono::steady_clock Clock;
+        auto elapsed = [](Clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        };
+
+        int passed = 0;
+        double refitTime = 0, buildTime = 0, refitTraceTime = 0, buildTraceTime = 0;
+        for (int frame = 1; frame <= m_frameCount; ++frame) {
+            cout << "------------------------------------------------------" << endl;
+            cout << "Frame " << frame << "/" << m_frameCount << endl;
+
+            /* Displace the vertices by two wavelengths of a wave across the scene */
+            float phase = 2 * M_PI * frame / m_frameCount, frequency = 4 * M_PI / diagonal;
+            for (size_t k = 0; k < positions.size(); ++k) {
+                MatrixXf V = positions[k];
+                for (int j = 0; j < V.cols(); ++j) {
+                    Point3f p = V.col(j);
+                    V.col(j) += m_amplitude * diagonal * Vector3f(
+                        std::sin(frequency * p.y() + phase),
+                        std::sin(frequency * p.z() + phase),
+                        std::sin(frequency * p.x() + phase));
+                }
+                meshes[0][k]->setVertexPositions(V);
+                meshes[1][k]->setVertexPositions(V);
+            }
+
+            Clock::time_point start = Clock::now();
+            scenes[0]->refit();
+            refitTime += elapsed(start);
+
+            start = Clock::now();
+            scenes[1]->rebuild();
+            buildTime += elapsed(start);
+
+            std::vector<Intersection> its[2];
+            std::vector<bool> hits[2];
+            for (int i = 0; i < 2; ++i) {
+                its[i].resize(rays.size());
+                hits[i].resize(rays.size());
+                start = Clock::now();
+                for (size_t j = 0; j < rays.size(); ++j)
+                    hits[i][j] = scenes[i]->rayIntersect(rays[j], its[i][j]);
+                (i == 0 ? refitTraceTime : buildTraceTime) += elapsed(start);
+            }
+
+            size_t mismatches = 0;
+            for (size_t j = 0; j < rays.size(); ++j) {
+                if (hits[0][j] != hits[1][j] || (hits[0][j] &&
+                        std::abs(its[0][j].t - its[1][j].t) > 1e-4f * std::max(1.f, its[1][j].t)))
+                    ++mismatches;
+            }
+
+            if (mismatches == 0) {
+                cout << "Accepted: all " << rays.size() << " rays agree with the rebuilt BVH." << endl;
+                ++passed;
+            } else {
+                cout << "Rejected: " << mismatches << " of " << rays.size()
+                     << " rays disagree with the rebuilt BVH!" << endl;
+            }
+        }
+
+        cout << "------------------------------------------------------" << endl;
+        cout << "Refit: " << timeString(refitTime / m_frameCount, true) << " per frame, tracing "
+             << timeString(refitTraceTime / m_frameCount, true) << endl;
+        cout << "Full build: " << timeString(buildTime / m_frameCount, true) << " per frame, tracing "
+             << timeString(buildTraceTime / m_frameCount, true) << endl;
+        cout << "Passed " << passed << "/" << m_frameCount << " tests." << endl;
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+            "BVHRefitTest[\n"
+            "  filename = \"%s\",\n"
+            "  frames = %i,\n"
+            "  amplitude = %f,\n"
+            "  rayCount = %i\n"
+            "]",
+            m_filename,
+            m_frameCount,
+            m_amplitude,
+            m_rayCount
+        );
+    }
+
+    virtual EClassType getClassType() const override { return ETest; }
+private:
+    std::string m_filename;
+    int m_frameCount;
+    float m_amplitude;
+    int m_rayCount;
+};
+
+NORI_REGISTER_CLASS(BVHRefitTest, "refittest");
+NORI_NAMESPACE_END
@@ -24,21 +24,155 @@
 #include <nori/timer.h>
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
+#include <nori/rfilter.h>
 #include <nori/integrator.h>
-#include <nori/gui.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <filesystem/resolver.h>
 #include <tbb/concurrent_vector.h>
+#include <fstream>
+#include <sstream>
 
 
 NORI_NAMESPACE_BEGIN
 
+/// Target duration of an adaptive rendering pass in milliseconds
+#define NORI_PASS_DURATION 500.0
+
+/// Minimum time between two snapshots of the image in milliseconds
+#define NORI_SNAPSHOT_INTERVAL 250.0
+
+/// Header of the checkpoint files written by \ref RenderThread
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height;
+    int32_t borderSize;     ///< Border size of the accumulated image
+    uint32_t sampleCount;   ///< Samples per pixel to be rendered in total
+    uint32_t samplesDone;   ///< Samples per pixel rendered so far
+    uint32_t passSamples;   ///< Size of the next pass
+    uint32_t adaptive;      ///< Whether the file contains \ref PixelStatistics
+    double renderTime;      ///< Time spent rendering so far in milliseconds
+    uint64_t fileSize;      ///< Size of the entire file in bytes
+};
+
+static const char CHECKPOINT_MAGIC[8] = { 'N', 'O', 'R', 'I', 'C', 'K', 'P', '\0' };
+
+/// Increase when the file format changes
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+/**
+ * Write a checkpoint containing the accumulated image, the finished blocks,
+ * the pixel statistics (if any) and the sampler states of all blocks.
+ * Returns \c false if no checkpoints can be written.
+ */
+static bool saveCheckpoint(const std::string &filename, CheckpointHeader header,
+                           const ImageBlock &accum, const BlockGenerator &blockGenerator,
+                           const PixelStatistics *stats,
+                           const tbb::concurrent_vector< std::unique_ptr<Sampler> > &samplers) {
+    /* Write to a temporary file first, so that a crash while
+       writing does not destroy the previous checkpoint */
+    std::string tempName = filename + ".tmp";
+    std::ofstream os(tempName, std::ios::binary);
+    os.write((const char *) &header, sizeof(CheckpointHeader));
+    accum.saveState(os);
+    blockGenerator.saveState(os);
+    if (stats)
+        stats->saveState(os);
+
+    /* Sampler states, each prefixed by its size (empty for blocks without a sampler) */
+    for (const auto &sampler : samplers) {
+        std::ostringstream state;
+        if (sampler && !sampler->saveState(state)) {
+            cerr << "Warning: the sampler does not support checkpoints, disabling them" << endl;
+            os.close();
+            std::remove(tempName.c_str());
+            return false;
+        }
+        std::string data = state.str();
+        uint32_t size = (uint32_t) data.size();
+        os.write((const char *) &size, sizeof(uint32_t));
+        os.write(data.data(), size);
+    }
+
+    /* Record the file size, which allows detecting incomplete files */
+    header.fileSize = (uint64_t) os.tellp();
+    os.seekp(0);
+    os.write((const char *) &header, sizeof(CheckpointHeader));
+    os.close();
+
+    if (!os.good()) {
+        cerr << "Warning: unable to write the checkpoint file \"" << tempName << "\"" << endl;
+        std::remove(tempName.c_str());
+        return true;
+    }
+
+    std::remove(filename.c_str());
+    if (std::rename(tempName.c_str(), filename.c_str()) != 0) {
+        cerr << "Warning: unable to write the checkpoint file \"" << filename << "\"" << endl;
+        std::remove(tempName.c_str());
+    }
+    return true;
+}
+
+/**
+ * Check that a checkpoint written by \ref saveCheckpoint() is complete and
+ * matches the image size, border size, sample count and mode in \c header,
+ * which then receives the remaining fields. Returns \c false if the file
+ * does not exist.
+ */
+static bool readCheckpointHeader(const std::string &filename, CheckpointHeader &header) {
+    std::ifstream is(filename, std::ios::binary);
+    if (!is.is_open()) {
+        cout << "No checkpoint found at \"" << filename << "\", starting from scratch." << endl;
+        return false;
+    }
+
+    CheckpointHeader stored;
+    is.read((char *) &stored, sizeof(CheckpointHeader));
+    is.seekg(0, std::ios::end);
+    if (!is.good() || memcmp(stored.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        stored.version != CHECKPOINT_VERSION || stored.fileSize != (uint64_t) is.tellg())
+        throw NoriException("\"%s\" is not a valid checkpoint file!", filename);
+    if (stored.width != header.width || stored.height != header.height ||
+        stored.borderSize != header.borderSize || stored.sampleCount != header.sampleCount ||
+        stored.adaptive != header.adaptive)
+        throw NoriException("The checkpoint \"%s\" was created with different rendering "
+                            "settings (image size, reconstruction filter, sample count, "
+                            "time budget or adaptive sampling)!", filename);
+
+    header = stored;
+    cout << "Resuming from checkpoint \"" << filename << "\" ("
+         << header.samplesDone << " samples per pixel)." << endl;
+    return true;
+}
+
+/// Restore the state stored in a checkpoint that passed \ref readCheckpointHeader()
+static void loadCheckpoint(const std::string &filename, ImageBlock &accum,
+                           BlockGenerator &blockGenerator, PixelStatistics *stats,
+                           std::vector<std::string> &samplerStates) {
+    std::ifstream is(filename, std::ios::binary);
+    is.seekg(sizeof(CheckpointHeader));
+    accum.loadState(is);
+    blockGenerator.loadState(is);
+    if (stats)
+        stats->loadState(is);
+
+    samplerStates.resize(blockGenerator.getTotalBlockCount());
+    for (std::string &state : samplerStates) {
+        uint32_t size = 0;
+        is.read((char *) &size, sizeof(uint32_t));
+        state.resize(size);
+        is.read(&state[0], size);
+    }
+}
+
 RenderThread::RenderThread(ImageBlock & block) :
-        m_block(block)
+        m_block(block), m_accum(Vector2i(0, 0), nullptr)
 {
     m_render_status = 0;
     m_progress = 1.f;
+    m_snapshotVersion = 0;
 }
 RenderThread::~RenderThread() {
     stopRendering();
@@ -69,7 +203,25 @@ float RenderThread::getProgress() {
     else return 1.f;
 }
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+void RenderThread::storeSnapshot(bool force) {
+    if (force)
+        m_block.lock();
+    else if (!m_block.tryLock())
+        return;
+
+    if (force || m_snapshotTimer.elapsed() >= NORI_SNAPSHOT_INTERVAL) {
+        /* Blocks that are being merged concurrently may be partially
+           included, which is harmless for display purposes */
+        m_block.topLeftCorner(m_accum.rows(), m_accum.cols()) = m_accum;
+        m_snapshotTimer.reset();
+        ++m_snapshotVersion;
+    }
+
+    m_block.unlock();
+}
+
+void RenderThread::renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                               uint32_t firstSample, uint32_t sampleCount, PixelStatistics *stats) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
@@ -79,21 +231,68 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-            Point2f apertureSample = sampler->next2D();
+    /* Number of sample components consumed by the pixel and aperture samples */
+    const uint32_t cameraDimensions = 4;
+
+    for (uint32_t index = firstSample; index < firstSample + sampleCount; ++index) {
+        if (integrator->usesPrimaryIntersections()) {
+            /* Trace the camera rays of each row as a single coherent batch */
+            Point2i pixels[NORI_BLOCK_SIZE];
+            Point2f pixelSamples[NORI_BLOCK_SIZE];
+            Color3f values[NORI_BLOCK_SIZE];
+            Ray3f rays[NORI_BLOCK_SIZE];
+            Intersection its[NORI_BLOCK_SIZE];
+
+            for (int y=0; y<size.y(); ++y) {
+                int count = 0;
+                for (int x=0; x<size.x(); ++x) {
+                    Point2i pixel(x + offset.x(), y + offset.y());
+                    if (stats && !stats->isActive(pixel))
+                        continue;
+                    pixels[count] = pixel;
+                    sampler->startPixelSample(pixel, index);
+                    pixelSamples[count] = pixel.cast<float>() + sampler->next2D();
+                    Point2f apertureSample = sampler->next2D();
+                    values[count] = camera->sampleRay(rays[count], pixelSamples[count], apertureSample);
+                    count++;
+                }
+
+                scene->rayIntersect(rays, its, (size_t) count);
+
+                for (int j=0; j<count; ++j) {
+                    sampler->startPixelSample(pixels[j], index, cameraDimensions);
+                    Color3f value = values[j] * integrator->LiPrimary(scene, sampler, rays[j], its[j]);
+                    block.put(pixelSamples[j], value);
+                    if (stats)
+                        stats->put(pixels[j], value);
+                }
+            }
+            continue;
+        }
+
+        /* For each pixel and pixel sample sample */
+        for (int y=0; y<size.y(); ++y) {
+            for (int x=0; x<size.x(); ++x) {
+                Point2i pixel(x + offset.x(), y + offset.y());
+                if (stats && !stats->isActive(pixel))
+                    continue;
+
+                sampler->startPixelSample(pixel, index);
+                Point2f pixelSample = pixel.cast<float>() + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
 
-            /* Sample a ray from the camera */
-            Ray3f ray;
-            Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+                /* Sample a ray from the camera */
+                Ray3f ray;
+                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
 
-            /* Compute the incident radiance */
-            value *= integrator->Li(scene, sampler, ray);
+                /* Compute the incident radiance */
+                value *= integrator->Li(scene, sampler, ray);
 
-            /* Store in the image block */
-            block.put(pixelSample, value);
+                /* Store in the image block */
+                block.put(pixelSample, value);
+                if (stats)
+                    stats->put(pixel, value);
+            }
         }
     }
 }
@@ -113,68 +312,168 @@ void RenderThread::renderScene(const std::string & filename) {
     if (root->getClassType() == NoriObject::EScene) {
         m_scene = static_cast<Scene *>(root);
 
+        if (m_sampleCount > 0)
+            m_scene->getSampler()->setSampleCount(m_sampleCount);
+        if (m_seed > 0)
+            m_scene->getSampler()->setSeed(m_seed);
+        if (m_rawOutput && m_scene->getAdaptiveThreshold() > 0)
+            throw NoriException("Raw output does not support adaptive sampling!");
+
         const Camera *camera_ = m_scene->getCamera();
         m_scene->getIntegrator()->preprocess(m_scene);
 
+        /* Adaptive sampling accumulates the samples using a box filter and
+           applies the camera's reconstruction filter at the end */
+        std::shared_ptr<ReconstructionFilter> boxFilter;
+        const ReconstructionFilter *filter = camera_->getReconstructionFilter();
+        if (m_scene->getAdaptiveThreshold() > 0) {
+            boxFilter.reset(static_cast<ReconstructionFilter *>(
+                NoriObjectFactory::createInstance("box", PropertyList())));
+            filter = boxFilter.get();
+        }
+
         /* Allocate memory for the entire output image and clear it */
-        m_block.init(camera_->getOutputSize(), camera_->getReconstructionFilter());
+        m_block.lock();
+        m_block.init(camera_->getOutputSize(), filter);
         m_block.clear();
+        m_block.unlock();
+        m_accum.init(camera_->getOutputSize(), filter);
+        m_accum.clear();
+        ++m_snapshotVersion;
 
         /* Determine the filename of the output bitmap */
-        std::string outputName = filename;
-        size_t lastdot = outputName.find_last_of(".");
-        if (lastdot != std::string::npos)
-            outputName.erase(lastdot, std::string::npos);
-        outputName += ".exr";
+        std::string outputName = m_outputName;
+        if (outputName.empty()) {
+            outputName = filename;
+            size_t lastdot = outputName.find_last_of(".");
+            if (lastdot != std::string::npos)
+                outputName.erase(lastdot, std::string::npos);
+            outputName += ".exr";
+        }
+
+        /* With a time budget, keep rendering passes until the deadline */
+        uint32_t numSamples = (uint32_t) m_scene->getSampler()->getSampleCount();
+        float budget = m_timeBudget > 0 ? m_timeBudget : m_scene->getTimeBudget();
+        if (budget > 0)
+            numSamples = std::numeric_limits<uint32_t>::max();
+
+        /* Check whether an interrupted rendering with the same settings can be continued */
+        std::string checkpointName = outputName + ".checkpoint";
+        CheckpointHeader checkpoint;
+        memset(&checkpoint, 0, sizeof(CheckpointHeader));
+        memcpy(checkpoint.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        checkpoint.version = CHECKPOINT_VERSION;
+        checkpoint.width = camera_->getOutputSize().x();
+        checkpoint.height = camera_->getOutputSize().y();
+        checkpoint.borderSize = m_accum.getBorderSize();
+        checkpoint.sampleCount = numSamples;
+        checkpoint.adaptive = boxFilter ? 1 : 0;
+        bool resume = m_resume && readCheckpointHeader(checkpointName, checkpoint);
 
         /* Do the following in parallel and asynchronously */
         m_render_status = 1;
-        m_render_thread = std::thread([this,outputName] {
+        m_render_thread = std::thread([this,outputName,boxFilter,filter,numSamples,budget,
+                                       checkpointName,checkpoint,resume]() mutable {
             const Camera *camera = m_scene->getCamera();
             Vector2i outputSize = camera->getOutputSize();
 
             /* Create a block generator (i.e. a work scheduler) */
             BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+            auto numBlocks = blockGenerator.getTotalBlockCount();
+            double deadline = budget * 1000.0;
 
-            cout << "Rendering .. ";
-            cout.flush();
-            Timer timer;
-
-            auto numSamples = m_scene->getSampler()->getSampleCount();
-            auto numBlocks = blockGenerator.getBlockCount();
+            /* Adaptive sampling: track the pixel variances, skip converged
+               pixels and stop rendering blocks once all of them have converged */
+            std::unique_ptr<PixelStatistics> stats;
+            if (boxFilter)
+                stats.reset(new PixelStatistics(outputSize, m_scene->getAdaptiveThreshold(),
+                                                m_scene->getAdaptiveMinSamples()));
 
             tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
             samplers.resize(numBlocks);
 
-            for (uint32_t k = 0; k < numSamples ; ++k) {
-                m_progress = k/float(numSamples);
-                if(m_render_status == 2)
+            /* Each pass renders several samples per block before merging it into
+               the image. Unless a fixed pass size was requested, the size is
+               adapted so that the image is still refreshed regularly */
+            uint32_t passSamples = m_passSamples > 0 ? m_passSamples : 1;
+            uint32_t k = 0;
+
+            /* Continue an interrupted rendering */
+            std::vector<std::string> samplerStates;
+            if (resume) {
+                loadCheckpoint(checkpointName, m_accum, blockGenerator, stats.get(), samplerStates);
+                k = checkpoint.samplesDone;
+                passSamples = checkpoint.passSamples;
+                deadline -= checkpoint.renderTime;
+                storeSnapshot(true);
+            }
+            double previousTime = checkpoint.renderTime;
+            bool checkpoints = m_checkpointInterval > 0;
+            Timer checkpointTimer;
+
+            cout << "Rendering .. ";
+            cout.flush();
+            Timer timer;
+
+            std::atomic<uint32_t> samplesDone(k * numBlocks);
+            auto updateProgress = [&](uint32_t samples) {
+                samplesDone += samples;
+                if (budget > 0)
+                    m_progress = (float) std::min(timer.elapsed() / deadline, 1.0);
+                else
+                    m_progress = samplesDone / ((float) numBlocks * numSamples);
+            };
+
+            while (k < numSamples) {
+                if(m_render_status == 2 || blockGenerator.getBlockCount() == 0)
                     break;
 
-                tbb::blocked_range<int> range(0, numBlocks);
+                uint32_t count = std::min(passSamples, numSamples - k);
+                Timer passTimer;
+
+                tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+                std::atomic<int> blocksDone(0);
 
                 auto map = [&](const tbb::blocked_range<int> &range) {
                     // Allocate memory for a small image block to be rendered by the current thread
-                    ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                                     camera->getReconstructionFilter());
+                    ImageBlock block(Vector2i(NORI_BLOCK_SIZE), filter);
 
                     for (int i = range.begin(); i < range.end(); ++i) {
+                        if (m_render_status == 2)
+                            break;
+
                         // Request an image block from the block generator
                         blockGenerator.next(block);
 
                         // Get block id to continue using the same sampler
                         auto blockId = block.getBlockId();
-                        if(k == 0) { // Initialize the sampler for the first sample
+
+                        // Skip blocks whose pixels have all converged in the previous passes
+                        if (k > 0 && stats && !stats->isActive(block)) {
+                            blockGenerator.setFinished(blockId);
+                            updateProgress(numSamples - k);
+                            ++blocksDone;
+                            continue;
+                        }
+                        if (!samplers.at(blockId)) { // Initialize the sampler for the first sample
                             std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
                             sampler->prepare(block);
+                            if (!samplerStates.empty() && !samplerStates[blockId].empty()) {
+                                std::istringstream state(samplerStates[blockId]);
+                                sampler->loadState(state);
+                            }
                             samplers.at(blockId) = std::move(sampler);
                         }
 
                         // Render all contained pixels
-                        renderBlock(m_scene, samplers.at(blockId).get(), block);
+                        renderBlock(m_scene, samplers.at(blockId).get(), block, k, count, stats.get());
 
                         // The image block has been processed. Now add it to the "big" block that represents the entire image
-                        m_block.put(block);
+                        m_accum.put(block);
+                        storeSnapshot(false);
+
+                        updateProgress(count);
+                        ++blocksDone;
                     }
                 };
 
@@ -184,19 +483,92 @@ void RenderThread::renderScene(const std::string & filename) {
                 /// Default: parallel rendering
                 tbb::parallel_for(range, map);
 
+                /* A stopped pass has only rendered some of the blocks. They remain
+                   in the image (its pixels are normalized by their weights), but
+                   only the passes completed by all blocks count as samples */
+                if (blocksDone < (int) range.size())
+                    break;
+
+                k += count;
+                if (stats)
+                    stats->update();
                 blockGenerator.reset();
+
+                if (m_passSamples == 0) {
+                    /* Aim for passes of about NORI_PASS_DURATION milliseconds,
+                       but grow by at most 4x at a time */
+                    double scale = NORI_PASS_DURATION / std::max(passTimer.elapsed(), 1.0);
+                    passSamples = (uint32_t) clamp((int) (count * std::min(scale, 4.0)),
+                                                   1, (int) passSamples * 4);
+                }
+
+                if (budget > 0) {
+                    /* Shrink the next pass if it would not finish before the
+                       deadline at the throughput of this one */
+                    double remaining = deadline - timer.elapsed();
+                    double fit = std::floor(remaining * count / std::max(passTimer.elapsed(), 1e-3));
+                    if (fit < 1)
+                        break;
+                    passSamples = (uint32_t) std::min((double) passSamples, fit);
+                }
+
+                if (checkpoints && m_render_status != 2 && k < numSamples &&
+                    checkpointTimer.elapsed() >= m_checkpointInterval * 1000.0) {
+                    checkpoint.samplesDone = k;
+                    checkpoint.passSamples = passSamples;
+                    checkpoint.renderTime = previousTime + timer.elapsed();
+                    checkpoints = saveCheckpoint(checkpointName, checkpoint, m_accum,
+                                                 blockGenerator, stats.get(), samplers);
+                    checkpointTimer.reset();
+                }
             }
 
             cout << "done. (took " << timer.elapsedString() << ")" << endl;
+            if (budget > 0)
+                cout << "Time budget of " << budget << "s: rendered "
+                     << k << " samples per pixel." << endl;
+
+            float averageSamples = (float) k;
+            if (stats) {
+                averageSamples = stats->getTotalSampleCount() / (float) outputSize.prod();
+                cout << "Adaptive sampling: " << averageSamples << " samples per pixel on average";
+                if (k > 0)
+                    cout << " (" << 100.f * averageSamples / k << "% of " << k << ")";
+                cout << "." << endl;
+            }
+#if defined(NORI_BVH_STATS)
+            cout << "BVH traversal: " << m_scene->getBVH()
+                ->getTraversalStatistics().toString() << endl;
+#endif
 
             /* Now turn the rendered image block into
                a properly normalized bitmap */
-            m_block.lock();
-            std::unique_ptr<Bitmap> bitmap(m_block.toBitmap());
-            m_block.unlock();
+            std::unique_ptr<Bitmap> bitmap(stats ?
+                m_accum.toBitmap(camera->getReconstructionFilter()) : m_accum.toBitmap());
+
+            if (stats) {
+                /* Also show the filtered image */
+                m_block.lock();
+                m_block.fromBitmap(*bitmap);
+                ++m_snapshotVersion;
+                m_block.unlock();
+            } else {
+                storeSnapshot(true);
+            }
 
-            /* Save using the OpenEXR format */
-            bitmap->save(outputName);
+            /* Save using the OpenEXR format, along with the number of samples */
+            bitmap->setAttribute("sampleCount", (int) k);
+            if (stats)
+                bitmap->setAttribute("averageSampleCount", averageSamples);
+            bitmap->setAttribute("renderTime", (float) ((previousTime + timer.elapsed()) / 1000.0));
+            if (m_rawOutput)
+                m_accum.saveEXR(outputName, k, { m_scene->getSampler()->getSeed() });
+            else
+                bitmap->save(outputName);
+
+            /* The checkpoint is obsolete once the rendering is complete */
+            if ((m_checkpointInterval > 0 || m_resume) && m_render_status != 2)
+                std::remove(checkpointName.c_str());
 
             delete m_scene;
             m_scene = nullptr;
@@ -25,8 +25,22 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_bvh = new BVH();
+Scene::Scene(const PropertyList &propList) {
+    m_bvh = new BVH(propList);
+
+    /* Adaptive sampling (disabled by default) */
+    m_adaptiveThreshold = propList.getFloat("adaptiveThreshold", 0.0f);
+    int minSamples = propList.getInteger("adaptiveMinSamples", 16);
+    if (m_adaptiveThreshold < 0)
+        throw NoriException("Scene: 'adaptiveThreshold' must be nonnegative!");
+    if (minSamples < 2)
+        throw NoriException("Scene: 'adaptiveMinSamples' must be at least 2!");
+    m_adaptiveMinSamples = (uint32_t) minSamples;
+
+    /* Render for a fixed time instead of a fixed number of samples (disabled by default) */
+    m_timeBudget = propList.getFloat("timeBudget", 0.0f);
+    if (m_timeBudget < 0)
+        throw NoriException("Scene: 'timeBudget' must be nonnegative!");
 }
 
 Scene::~Scene() {
@@ -37,6 +51,8 @@ Scene::~Scene() {
     for(auto e : m_emitters)
         delete e;
     m_emitters.clear();
+    for (auto &group : m_shapeGroups)
+        delete group.second;
 }
 
 void Scene::activate() {
@@ -59,10 +75,50 @@ void Scene::activate() {
     cout << endl;
 }
 
+void Scene::refit() {
+    for (auto &group : m_shapeGroups)
+        group.second->refit();
+    for (auto shape : m_shapes) {
+        if (Instance *instance = dynamic_cast<Instance *>(shape))
+            instance->updateBoundingBox();
+    }
+    m_bvh->refit();
+}
+
+void Scene::rebuild() {
+    for (auto &group : m_shapeGroups)
+        group.second->rebuild();
+    for (auto shape : m_shapes) {
+        if (Instance *instance = dynamic_cast<Instance *>(shape))
+            instance->updateBoundingBox();
+    }
+    m_bvh->build();
+}
+
 void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Shape *mesh = static_cast<Shape *>(obj);
+
+                /* Shape groups are only rendered through their instances */
+                if (ShapeGroup *group = dynamic_cast<ShapeGroup *>(mesh)) {
+                    const std::string &name = group->getIdName();
+                    if (name.empty())
+                        throw NoriException("A shape group must have a name!");
+                    if (m_shapeGroups.find(name) != m_shapeGroups.end())
+                        throw NoriException("Duplicate shape group \"%s\"!", name);
+                    m_shapeGroups[name] = group;
+                    break;
+                }
+
+                if (Instance *instance = dynamic_cast<Instance *>(mesh)) {
+                    auto it = m_shapeGroups.find(instance->getShapeGroupName());
+                    if (it == m_shapeGroups.end())
+                        throw NoriException("Instance: unknown shape group \"%s\" (shape groups "
+                            "must be declared before their instances)!", instance->getShapeGroupName());
+                    instance->setShapeGroup(it->second);
+                }
+
                 m_bvh->addShape(mesh);
                 m_shapes.push_back(mesh);
                 if(mesh->isEmitter())
@@ -61,6 +61,45 @@ void Shape::addChild(NoriObject *obj) {
     }
 }
 
+bool Shape::rayIntersectPrimitives(const uint32_t *indices, uint32_t count, Ray3f &ray,
+                                   float &u, float &v, uint32_t &index, bool shadowRay) const {
+    bool foundIntersection = false;
+    for (uint32_t i = 0; i < count; ++i) {
+        float primU, primV, t;
+        if (rayIntersect(indices[i], ray, primU, primV, t)) {
+            ray.maxt = t;
+            u = primU;
+            v = primV;
+            index = indices[i];
+            foundIntersection = true;
+            if (shadowRay)
+                break;
+        }
+    }
+    return foundIntersection;
+}
+
+bool Shape::rayOccluded(const uint32_t *indices, uint32_t count, const Ray3f &ray) const {
+    for (uint32_t i = 0; i < count; ++i) {
+        float u, v, t;
+        if (rayIntersect(indices[i], ray, u, v, t))
+            return true;
+    }
+    return false;
+}
+
+uint64_t Shape::getGeometryHash() const {
+    uint64_t hash = hashBuffer(nullptr, 0);
+    for (uint32_t i = 0; i < getPrimitiveCount(); ++i) {
+        BoundingBox3f bbox = getBoundingBox(i);
+        Point3f centroid = getCentroid(i);
+        hash = hashBuffer(bbox.min.data(), sizeof(float) * 3, hash);
+        hash = hashBuffer(bbox.max.data(), sizeof(float) * 3, hash);
+        hash = hashBuffer(centroid.data(), sizeof(float) * 3, hash);
+    }
+    return hash;
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
@@ -0,0 +1,141 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sampler.h>
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Sobol sampling - returns the points of an Owen-scrambled Sobol
+ * sequence, which stratify much better than independent random numbers.
+ *
+ * Following "Practical Hash-based Owen Scrambling" (Burley 2020), every
+ * 1D or 2D request uses the first one or two dimensions of the Sobol
+ * sequence, which form a (0,2)-sequence in base 2. To decorrelate the
+ * requests, the sample index is shuffled and the components are Owen-
+ * scrambled using hashes of the pixel, the seed and the dimension. The
+ * samples of every pixel are thus well stratified in each pair of
+ * dimensions, particularly for power-of-two sample counts.
+ */
+class Sobol : public Sampler {
+public:
+    Sobol(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~Sobol() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<Sobol> cloned(new Sobol());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        cloned->m_pixelSeed = m_pixelSeed;
+        cloned->m_index = m_index;
+        cloned->m_dimension = m_dimension;
+        return cloned;
+    }
+
+    void prepare(const ImageBlock &block) {
+        startPixelSample(block.getOffset(), 0, 0);
+    }
+
+    /// Restart the sequence of the current pixel
+    void generate() { m_index = 0; m_dimension = 0; }
+    void advance()  { m_index++; m_dimension = 0; }
+
+    void startPixelSample(const Point2i &pixel, uint32_t index, uint32_t dimension) {
+        m_pixelSeed = hashCombine(hashCombine(m_seed, (uint32_t) pixel.x()), (uint32_t) pixel.y());
+        m_index = index;
+        m_dimension = dimension;
+    }
+
+    float next1D() {
+        uint32_t seed = hashCombine(m_pixelSeed, m_dimension++);
+        uint32_t index = nestedUniformScramble(m_index, seed);
+        return toFloat(nestedUniformScramble(reverseBits(index), hashCombine(seed, 1)));
+    }
+
+    Point2f next2D() {
+        uint32_t seed = hashCombine(m_pixelSeed, m_dimension);
+        m_dimension += 2;
+        uint32_t index = nestedUniformScramble(m_index, seed);
+        return Point2f(
+            toFloat(nestedUniformScramble(reverseBits(index), hashCombine(seed, 1))),
+            toFloat(nestedUniformScramble(sobol1(index), hashCombine(seed, 2)))
+        );
+    }
+
+    /* The samples only depend on the pixel and sample index,
+       which the renderer sets before every sample */
+    bool saveState(std::ostream &os) const { return true; }
+    void loadState(std::istream &is) { }
+
+    virtual std::string toString() const override {
+        return tfm::format("Sobol[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    Sobol() { }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    /// Owen scrambling of the bits of \c x (most significant bit first)
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+        /* Laine-Karras style permutation, which only propagates
+           changes from the lower to the higher bits */
+        x = reverseBits(x);
+        x ^= x * 0x3d20adeau;
+        x += seed;
+        x *= (seed >> 16) | 1;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return reverseBits(x);
+    }
+
+    /// Second dimension of the Sobol sequence (the first is the bit reversal of the index)
+    static uint32_t sobol1(uint32_t index) {
+        uint32_t result = 0, direction = 0x80000000u;
+        for (; index; index >>= 1) {
+            if (index & 1)
+                result ^= direction;
+            direction ^= direction >> 1;
+        }
+        return result;
+    }
+
+    /// Map to <tt>[0, 1)</tt> without rounding up to one
+    static float toFloat(uint32_t x) {
+        return (float) (x >> 8) * (1.0f / (1u << 24));
+    }
+
+private:
+    uint32_t m_pixelSeed = 0;
+    uint32_t m_index = 0;
+    uint32_t m_dimension = 0;
+};
+
+NORI_REGISTER_CLASS(Sobol, "sobol");
+NORI_NAMESPACE_END
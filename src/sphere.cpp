@@ -16,67 +16,95 @@
     along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <nori/shape.h>
+#include <nori/sphere.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
 #include <nori/warp.h>
 
 NORI_NAMESPACE_BEGIN
 
-class Sphere : public Shape {
-public:
-    Sphere(const PropertyList & propList) {
-        m_position = propList.getPoint3("center", Point3f());
-        m_radius = propList.getFloat("radius", 1.f);
-
-        m_bbox.expandBy(m_position - Vector3f(m_radius));
-        m_bbox.expandBy(m_position + Vector3f(m_radius));
-    }
-
-    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
-
-    virtual Point3f getCentroid(uint32_t index) const override { return m_position; }
+Sphere::Sphere(const PropertyList & propList) {
+    m_position = propList.getPoint3("center", Point3f());
+    m_radius = propList.getFloat("radius", 1.f);
+
+    m_bbox.expandBy(m_position - Vector3f(m_radius));
+    m_bbox.expandBy(m_position + Vector3f(m_radius));
+}
+
+bool Sphere::intersect(const Ray3f &ray, float &t) const {
+    /* Solve a*t^2 - 2*b*t + c = 0 (the direction need not be normalized) */
+    Vector3f f = ray.o - m_position;
+    float a = ray.d.squaredNorm();
+    float b = -f.dot(ray.d);
+    float c = f.squaredNorm() - m_radius * m_radius;
+
+    /* Compute the discriminant from the distance between the sphere
+       center and the line, instead of the difference b^2 - a*c */
+    Vector3f l = f + (b / a) * ray.d;
+    float discrim = a * (m_radius * m_radius - l.squaredNorm());
+    if (discrim < 0)
+        return false;
 
-    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override {
+    float q = b + std::copysign(std::sqrt(discrim), b);
+    float t0 = c / q, t1 = q / a;
+    if (t0 > t1)
+        std::swap(t0, t1);
 
-	/* to be implemented */
+    if (t0 >= ray.mint && t0 <= ray.maxt)
+        t = t0;
+    else if (t1 >= ray.mint && t1 <= ray.maxt)
+        t = t1;
+    else
         return false;
-
-    }
-
-    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override {
-        /* to be implemented */
-    }
-
-    virtual void sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const override {
-        Vector3f q = Warp::squareToUniformSphere(sample);
-        sRec.p = m_position + m_radius * q;
-        sRec.n = q;
-        sRec.pdf = std::pow(1.f/m_radius,2) * Warp::squareToUniformSpherePdf(Vector3f(0.0f,0.0f,1.0f));
-    }
-    virtual float pdfSurface(const ShapeQueryRecord & sRec) const override {
-        return std::pow(1.f/m_radius,2) * Warp::squareToUniformSpherePdf(Vector3f(0.0f,0.0f,1.0f));
-    }
-
-
-    virtual std::string toString() const override {
-        return tfm::format(
-                "Sphere[\n"
-                "  center = %s,\n"
-                "  radius = %f,\n"
-                "  bsdf = %s,\n"
-                "  emitter = %s\n"
-                "]",
-                m_position.toString(),
-                m_radius,
-                m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
-                m_emitter ? indent(m_emitter->toString()) : std::string("null"));
-    }
-
-protected:
-    Point3f m_position;
-    float m_radius;
-};
+    return true;
+}
+
+bool Sphere::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
+    u = v = 0.0f;
+    return intersect(ray, t);
+}
+
+bool Sphere::rayOccluded(const uint32_t *, uint32_t, const Ray3f &ray) const {
+    float t;
+    return intersect(ray, t);
+}
+
+void Sphere::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
+    /* Project the hit point onto the sphere to remove the error of ray(t) */
+    Vector3f n = (ray(its.t) - m_position).normalized();
+    its.p = m_position + m_radius * n;
+
+    Point2f coords = sphericalCoordinates(n);
+    its.uv = Point2f(coords.y() * INV_TWOPI, coords.x() * INV_PI);
+
+    its.geoFrame = Frame(n);
+    its.shFrame = its.geoFrame;
+}
+
+void Sphere::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
+    Vector3f q = Warp::squareToUniformSphere(sample);
+    sRec.p = m_position + m_radius * q;
+    sRec.n = q;
+    sRec.pdf = std::pow(1.f/m_radius,2) * Warp::squareToUniformSpherePdf(Vector3f(0.0f,0.0f,1.0f));
+}
+
+float Sphere::pdfSurface(const ShapeQueryRecord & sRec) const {
+    return std::pow(1.f/m_radius,2) * Warp::squareToUniformSpherePdf(Vector3f(0.0f,0.0f,1.0f));
+}
+
+std::string Sphere::toString() const {
+    return tfm::format(
+            "Sphere[\n"
+            "  center = %s,\n"
+            "  radius = %f,\n"
+            "  bsdf = %s,\n"
+            "  emitter = %s\n"
+            "]",
+            m_position.toString(),
+            m_radius,
+            m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+            m_emitter ? indent(m_emitter->toString()) : std::string("null"));
+}
 
 NORI_REGISTER_CLASS(Sphere, "sphere");
 NORI_NAMESPACE_END